@@ -0,0 +1,250 @@
+#include "../nbb.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Streams small messages from a client to a busy-polling service over item
+// or cell rings (-c), and counts the cache misses each side takes per
+// message with perf_event_open(). Both sides count their own thread in
+// user space only, so this works with perf_event_paranoid up to 2.
+
+#define SERVICE_NAME "cell_benchmark"
+#define CLIENT_NAME "cell_client"
+
+enum {
+    COUNTER_L1D,
+    COUNTER_LLC,
+    NUM_COUNTERS
+};
+
+struct side_stats {
+    long long nsec;
+    long long counts[NUM_COUNTERS]; // -1 if the counter isn't available
+};
+
+static int length = 32;
+static long long messages = 100000;
+
+static volatile long long received = 0;
+static volatile int started = 0;
+static volatile int done = 0;
+
+static long long now_nsec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_nsec + (1000000000LL * ts.tv_sec);
+}
+
+static int open_counter(int counter)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    if(counter == COUNTER_L1D) {
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_L1D |
+                      (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    }
+    else {
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    }
+
+    // This thread, any cpu
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void start_counters(int* fds)
+{
+    int i;
+
+    for(i = 0; i < NUM_COUNTERS; i++) {
+        if((fds[i] = open_counter(i)) >= 0) {
+            ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+}
+
+static void stop_counters(int* fds, struct side_stats* stats)
+{
+    int i;
+
+    for(i = 0; i < NUM_COUNTERS; i++) {
+        stats->counts[i] = -1;
+        if(fds[i] < 0) {
+            continue;
+        }
+        ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+        if(read(fds[i], &stats->counts[i], sizeof(long long)) != sizeof(long long)) {
+            stats->counts[i] = -1;
+        }
+        close(fds[i]);
+    }
+}
+
+static void on_data(int slot_id)
+{
+    char buf[1<<14];
+    int size;
+
+    while((size = nbb_read_bytes(slot_id, buf, sizeof(buf))) > 0) {
+        received += size;
+    }
+    started = 1;
+    if(received >= messages * length) {
+        done = 1;
+    }
+}
+
+static void run_service(int ready, int results, int cells)
+{
+    int fds[NUM_COUNTERS];
+    struct side_stats stats;
+    long long start;
+
+    if(cells) {
+        nbb_set_ring_format(NBB_RING_CELLS);
+    }
+    if(nbb_init_service(1, SERVICE_NAME)) {
+        printf("Error initializing as service, failing!\n");
+        exit(-1);
+    }
+    nbb_set_cb_new_data(SERVICE_NAME, on_data);
+    nbb_set_busy_poll_owner(SERVICE_NAME, 1);
+
+    write(ready, "x", 1);
+    close(ready);
+
+    // Counting starts with the first byte, not with the connect
+    nbb_poll_loop(0, -1, &started);
+    start_counters(fds);
+    start = now_nsec();
+    nbb_poll_loop(100, -1, &done);
+    stats.nsec = now_nsec() - start;
+    stop_counters(fds, &stats);
+
+    write(results, &stats, sizeof(stats));
+    exit(0);
+}
+
+static void print_side(const char* name, struct side_stats* stats)
+{
+    static const char* counter_names[NUM_COUNTERS] = { "L1d read misses", "LLC misses" };
+    int i;
+
+    printf("%-8s nsec/msg: %lld", name, stats->nsec / messages);
+    for(i = 0; i < NUM_COUNTERS; i++) {
+        if(stats->counts[i] < 0) {
+            printf("  %s/msg: n/a", counter_names[i]);
+        }
+        else {
+            printf("  %s/msg: %.2f", counter_names[i], (double) stats->counts[i] / messages);
+        }
+    }
+    printf("\n");
+}
+
+void usage()
+{
+    printf("./cell_benchmark [-c] [-l <message length (1..%d)>] [-n <messages>]\n",
+           NBB_BULK_THRESHOLD);
+    return;
+}
+
+int main(int argc, char** argv)
+{
+    int cells = 0;
+    int opt;
+    int ready[2];
+    int results[2];
+    pid_t service;
+    int slot;
+    int fds[NUM_COUNTERS];
+    struct side_stats client_stats, service_stats;
+    char msg[NBB_BULK_THRESHOLD];
+    long long i, start;
+    char c;
+
+    while((opt = getopt(argc, argv, "cl:n:")) != -1) {
+        switch (opt) {
+            case 'c':
+                cells = 1;
+                break;
+            case 'l':
+                length = atoi(optarg);
+                break;
+            case 'n':
+                messages = atoll(optarg);
+                break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    if(length <= 0 || length > NBB_BULK_THRESHOLD || messages <= 0) {
+        usage();
+        return 1;
+    }
+    memset(msg, 'a', length);
+
+    if(pipe(ready) || pipe(results)) {
+        perror("pipe");
+        return -1;
+    }
+
+    if((service = fork()) == 0) {
+        close(ready[0]);
+        close(results[0]);
+        run_service(ready[1], results[1], cells);
+    }
+    close(ready[1]);
+    close(results[1]);
+
+    if(read(ready[0], &c, 1) != 1) {
+        printf("Service didn't come up!\n");
+        return -1;
+    }
+
+    if((slot = nbb_connect_service(CLIENT_NAME, SERVICE_NAME)) < 0) {
+        printf("Error getting channel!\n");
+        kill(service, SIGKILL);
+        return -1;
+    }
+
+    start_counters(fds);
+    start = now_nsec();
+    for(i = 0; i < messages; i++) {
+        // The service shares the cpu with us, let it drain
+        while(nbb_write_bytes(slot, msg, length) != 0) {
+            sched_yield();
+        }
+    }
+    client_stats.nsec = now_nsec() - start;
+    stop_counters(fds, &client_stats);
+
+    // Our own NBB signals may interrupt the read
+    while(read(results[0], &service_stats, sizeof(service_stats)) < 0 && errno == EINTR)
+        ;
+    waitpid(service, NULL, 0);
+
+    printf("format: %s length: %d messages: %lld\n", cells ? "cells" : "items", length, messages);
+    print_side("client", &client_stats);
+    print_side("service", &service_stats);
+
+    return 0;
+}
@@ -0,0 +1,130 @@
+#include "../nbb.h"
+
+#include <errno.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Simultaneous launch of N clients against one service, like a session
+// restore. Every client waits on a shared pipe, then all of them call
+// nbb_connect_service() at once and report how long it took.
+
+#define SERVICE_NAME "connect_benchmark"
+
+static volatile int connected = 0;
+
+static void on_new_connection(int slot_id, void *arg)
+{
+    connected++;
+}
+
+static long long now_nsec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_nsec + (1000000000LL * ts.tv_sec);
+}
+
+void usage()
+{
+    printf("./connect_benchmark -n <number of clients (1..%d)>\n", SERVICE_MAX_CHANNELS - 1);
+    return;
+}
+
+int main(int argc, char** argv)
+{
+    int num_clients = 0;
+    int opt;
+    int i;
+    int go[2];
+    int results[2];
+    char client_name[MAX_NAME_SIZE];
+
+    while((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+            case 'n':
+                num_clients = atoi(optarg);
+                break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    // Slot 0 is the nameserver's, so that's how many we can hold
+    if(num_clients <= 0 || num_clients >= SERVICE_MAX_CHANNELS) {
+        usage();
+        return 1;
+    }
+
+    if(pipe(go) || pipe(results)) {
+        perror("pipe");
+        return -1;
+    }
+
+    // Fork before registering, so the clients don't inherit our channels
+    for(i = 0; i < num_clients; i++) {
+        if(fork() == 0) {
+            char c;
+            long long start, elapsed;
+
+            close(go[1]);
+            sprintf(client_name, "client%d", i);
+
+            // Block until the parent closes the write end
+            read(go[0], &c, 1);
+
+            start = now_nsec();
+            elapsed = nbb_connect_service(client_name, SERVICE_NAME) < 0 ?
+                -1 : now_nsec() - start;
+            write(results[1], &elapsed, sizeof(elapsed));
+
+            // Keep the channel until everybody is done
+            sleep(1);
+            exit(0);
+        }
+    }
+
+    close(go[0]);
+    close(results[1]);
+
+    if(nbb_init_service(num_clients, SERVICE_NAME)) {
+        printf("Error initializing as service, failing!\n");
+        return -1;
+    }
+    nbb_set_cb_new_connection(SERVICE_NAME, on_new_connection, NULL);
+
+    long long start = now_nsec();
+    close(go[1]);
+
+    long long elapsed, min = -1, max = 0, total = 0;
+    int failed = 0;
+    for(i = 0; i < num_clients; i++) {
+        int ret;
+        // Our own NBB signals may interrupt the read
+        do {
+            ret = read(results[0], &elapsed, sizeof(elapsed));
+        } while(ret < 0 && errno == EINTR);
+
+        if(ret != sizeof(elapsed) || elapsed < 0) {
+            failed++;
+            continue;
+        }
+        total += elapsed;
+        if(min < 0 || elapsed < min) min = elapsed;
+        if(elapsed > max) max = elapsed;
+    }
+    long long wall = now_nsec() - start;
+
+    while(wait(NULL) > 0)
+        ;
+
+    printf("clients: %d failed: %d notified: %d\n", num_clients, failed, connected);
+    if(failed < num_clients) {
+        printf("connect usec min: %lld avg: %lld max: %lld\n",
+            min / 1000, total / (num_clients - failed) / 1000, max / 1000);
+    }
+    printf("all connected after usec: %lld\n", wall / 1000);
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,187 @@
+#include "../nbb.h"
+
+#include <time.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Compares nbb_copy_to_shm() with plain memcpy() into a shared mapping,
+// per size class. For each it reports bandwidth, how many LLC misses
+// re-reading our own working set takes after a copy (what the copy evicted
+// from the producer's cache) and how many reading the copied data back
+// takes (roughly what a consumer sharing that cache level sees). Misses
+// are counted in user space for this thread only; they print as n/a if
+// the cpu doesn't expose the counter.
+
+#define WORKING_SET (256 * 1024)
+#define MAX_SIZE (1 << 20)
+#define TOTAL_BYTES (256LL << 20)
+
+typedef void (*copy_func)(void* dst, const void* src, size_t size);
+
+struct result {
+    double gbps;
+    double evict_misses;  // Per copy, -1 if not available
+    double read_misses;
+};
+
+static volatile unsigned long sink;
+
+static long long now_nsec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_nsec + (1000000000LL * ts.tv_sec);
+}
+
+static int open_llc_counter()
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static long long counter_read(int fd)
+{
+    long long count;
+
+    if(fd < 0 || read(fd, &count, sizeof(count)) != sizeof(count)) {
+        return -1;
+    }
+    return count;
+}
+
+static void touch(const unsigned char* buf, size_t size)
+{
+    unsigned long sum = 0;
+    size_t i;
+
+    for(i = 0; i < size; i += 64) {
+        sum += buf[i];
+    }
+    sink = sum;
+}
+
+static void copy_memcpy(void* dst, const void* src, size_t size)
+{
+    memcpy(dst, src, size);
+}
+
+static void measure(copy_func copy, unsigned char* dst, const unsigned char* src,
+                    const unsigned char* working_set, size_t size, struct result* res)
+{
+    long long rounds = TOTAL_BYTES / size;
+    long long i, start, elapsed;
+    long long evict = 0, readback = 0, before;
+    int fd = open_llc_counter();
+    int samples = 64;
+
+    if(rounds > 1000000) {
+        rounds = 1000000;
+    }
+
+    copy(dst, src, size);
+    start = now_nsec();
+    for(i = 0; i < rounds; i++) {
+        copy(dst, src, size);
+    }
+    elapsed = now_nsec() - start;
+    res->gbps = (double) rounds * size / elapsed;
+
+    if(fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    for(i = 0; i < samples; i++) {
+        touch(working_set, WORKING_SET);
+
+        copy(dst, src, size);
+
+        before = counter_read(fd);
+        touch(working_set, WORKING_SET);
+        evict += counter_read(fd) - before;
+
+        before = counter_read(fd);
+        touch(dst, size);
+        readback += counter_read(fd) - before;
+    }
+
+    if(fd < 0) {
+        res->evict_misses = res->read_misses = -1;
+        return;
+    }
+    close(fd);
+    res->evict_misses = (double) evict / samples;
+    res->read_misses = (double) readback / samples;
+}
+
+static void print_misses(double misses)
+{
+    if(misses < 0) {
+        printf(" %10s", "n/a");
+    }
+    else {
+        printf(" %10.1f", misses);
+    }
+}
+
+void usage()
+{
+    printf("./copy_benchmark\n"
+           "Run with NBB_COPY=memcpy to check that both columns match.\n");
+    return;
+}
+
+int main(int argc, char** argv)
+{
+    static const size_t sizes[] = { 16, 64, 256, 1024, 4096, 16384,
+                                    NBB_COPY_STREAM_MIN, 256 * 1024, MAX_SIZE };
+    unsigned char* src;
+    unsigned char* dst;
+    unsigned char* working_set;
+    struct result plain, nbb;
+    unsigned int i;
+
+    if(argc > 1) {
+        usage();
+        return 1;
+    }
+
+    // The destination stands in for a shm segment
+    dst = (unsigned char*) mmap(NULL, MAX_SIZE + 64, PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    src = (unsigned char*) malloc(MAX_SIZE);
+    working_set = (unsigned char*) malloc(WORKING_SET);
+    if(dst == MAP_FAILED || !src || !working_set) {
+        perror("alloc");
+        return -1;
+    }
+    memset(src, 'a', MAX_SIZE);
+    memset(dst, 0, MAX_SIZE + 64);
+    memset(working_set, 1, WORKING_SET);
+
+    printf("%8s %12s %12s %10s %10s %10s %10s\n", "size", "memcpy GB/s", "nbb GB/s",
+           "evict mc", "evict nbb", "read mc", "read nbb");
+
+    for(i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        measure(copy_memcpy, dst, src, working_set, sizes[i], &plain);
+        measure(nbb_copy_to_shm, dst, src, working_set, sizes[i], &nbb);
+
+        printf("%8zu %12.2f %12.2f", sizes[i], plain.gbps, nbb.gbps);
+        print_misses(plain.evict_misses);
+        print_misses(nbb.evict_misses);
+        print_misses(plain.read_misses);
+        print_misses(nbb.read_misses);
+        printf("\n");
+    }
+
+    return 0;
+}
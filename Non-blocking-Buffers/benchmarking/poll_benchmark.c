@@ -0,0 +1,218 @@
+#include "../nbb.h"
+
+#include <errno.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Ping-pong latency between a client and an echo service, with both ends
+// either signal driven or busy-polling. Reports round trip times and how
+// much cpu each side burned for them.
+
+#define SERVICE_NAME "poll_benchmark"
+#define CLIENT_NAME "poll_client"
+
+static int busy_poll = 0;
+static int spin_budget = 1000;
+static int length = 64;
+
+static volatile int got_reply = 0;
+static volatile int never = 0;
+static char msg[1<<14];
+
+static long long now_nsec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_nsec + (1000000000LL * ts.tv_sec);
+}
+
+static long long cpu_usec(struct rusage* ru)
+{
+    return ru->ru_utime.tv_sec * 1000000LL + ru->ru_utime.tv_usec +
+           ru->ru_stime.tv_sec * 1000000LL + ru->ru_stime.tv_usec;
+}
+
+static int cmp_ll(const void* a, const void* b)
+{
+    long long x = *(const long long*) a;
+    long long y = *(const long long*) b;
+    return x < y ? -1 : x > y;
+}
+
+static void on_echo(int slot_id)
+{
+    char buf[sizeof(msg)];
+    int size;
+
+    while((size = nbb_read_bytes(slot_id, buf, sizeof(buf))) > 0) {
+        nbb_write_bytes(slot_id, buf, size);
+    }
+}
+
+static void on_reply(int slot_id)
+{
+    char buf[sizeof(msg)];
+
+    while(nbb_read_bytes(slot_id, buf, sizeof(buf)) > 0)
+        ;
+    got_reply = 1;
+}
+
+static void run_service(int ready, int cpu)
+{
+    if(nbb_init_service(1, SERVICE_NAME)) {
+        printf("Error initializing as service, failing!\n");
+        exit(-1);
+    }
+    nbb_set_cb_new_data(SERVICE_NAME, on_echo);
+    if(busy_poll) {
+        nbb_set_busy_poll_owner(SERVICE_NAME, 1);
+    }
+
+    write(ready, "x", 1);
+    close(ready);
+
+    if(busy_poll && nbb_poll_loop(spin_budget, cpu, &never)) {
+        printf("Can't poll on cpu %d, failing!\n", cpu);
+        exit(-1);
+    }
+    while(1) {
+        pause();
+    }
+}
+
+void usage()
+{
+    printf("./poll_benchmark [-p] [-s <spin budget>] [-c <service cpu>] "
+           "[-l <message length>] [-n <round trips>]\n");
+    return;
+}
+
+int main(int argc, char** argv)
+{
+    int round_trips = 10000;
+    int cpu = -1;
+    int opt;
+    int i;
+    int ready[2];
+    pid_t service;
+    sigset_t block, orig;
+    struct rusage ru_start, ru_end, ru_service;
+    long long* rtt;
+    long long start, wall, total = 0;
+    int slot;
+
+    while((opt = getopt(argc, argv, "ps:c:l:n:")) != -1) {
+        switch (opt) {
+            case 'p':
+                busy_poll = 1;
+                break;
+            case 's':
+                spin_budget = atoi(optarg);
+                break;
+            case 'c':
+                cpu = atoi(optarg);
+                break;
+            case 'l':
+                length = atoi(optarg);
+                break;
+            case 'n':
+                round_trips = atoi(optarg);
+                break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    if(length <= 0 || length > (int) sizeof(msg) || round_trips <= 0 || spin_budget < 0 ||
+       cpu >= sysconf(_SC_NPROCESSORS_ONLN)) {
+        usage();
+        return 1;
+    }
+    memset(msg, 'a', length);
+
+    if(pipe(ready)) {
+        perror("pipe");
+        return -1;
+    }
+
+    // The service registers in its own process, we only connect
+    if((service = fork()) == 0) {
+        close(ready[0]);
+        run_service(ready[1], cpu);
+    }
+    close(ready[1]);
+
+    char c;
+    if(read(ready[0], &c, 1) != 1) {
+        printf("Service didn't come up!\n");
+        return -1;
+    }
+
+    if((slot = nbb_connect_service(CLIENT_NAME, SERVICE_NAME)) < 0) {
+        printf("Error getting channel!\n");
+        kill(service, SIGKILL);
+        return -1;
+    }
+    nbb_set_cb_new_data(CLIENT_NAME, on_reply);
+    if(busy_poll) {
+        nbb_set_busy_poll(slot, 1);
+    }
+
+    rtt = (long long*) malloc(round_trips * sizeof(long long));
+
+    // Signal mode sleeps in sigsuspend, so the wakeup can't slip in
+    // between checking the flag and going to sleep
+    sigemptyset(&block);
+    sigaddset(&block, NBB_SIGNAL);
+    sigprocmask(SIG_BLOCK, &block, &orig);
+
+    getrusage(RUSAGE_SELF, &ru_start);
+    start = now_nsec();
+
+    for(i = 0; i < round_trips; i++) {
+        long long sent;
+
+        got_reply = 0;
+        sent = now_nsec();
+        while(nbb_write_bytes(slot, msg, length) != 0)
+            ;
+
+        if(busy_poll) {
+            nbb_poll_loop(spin_budget, -1, &got_reply);
+        }
+        else {
+            while(!got_reply) {
+                sigsuspend(&orig);
+            }
+        }
+
+        rtt[i] = now_nsec() - sent;
+        total += rtt[i];
+    }
+
+    wall = now_nsec() - start;
+    getrusage(RUSAGE_SELF, &ru_end);
+    sigprocmask(SIG_SETMASK, &orig, NULL);
+
+    // The service's usage covers its whole life, which is mostly the run
+    kill(service, SIGKILL);
+    wait4(service, NULL, 0, &ru_service);
+
+    qsort(rtt, round_trips, sizeof(long long), cmp_ll);
+
+    printf("mode: %s spin budget: %d length: %d round trips: %d\n",
+        busy_poll ? "busy-poll" : "signal", spin_budget, length, round_trips);
+    printf("rtt nsec min: %lld avg: %lld p50: %lld p99: %lld max: %lld\n",
+        rtt[0], total / round_trips, rtt[round_trips / 2],
+        rtt[(round_trips * 99) / 100], rtt[round_trips - 1]);
+    printf("cpu %% of wall client: %lld service: %lld\n",
+        (cpu_usec(&ru_end) - cpu_usec(&ru_start)) * 100000 / wall,
+        cpu_usec(&ru_service) * 100000 / wall);
+
+    free(rtt);
+    return 0;
+}
@@ -6,7 +6,6 @@
 #define PROCESS_MAX_SERVICES 500 // Total # of services / process
 #define MAX_MSG_LEN 1000 
 #define READ_WRITE_CONV 1000 // Read id always differ by 1000 from write id 
-#define SEM_KEY "/1337" // POSIX semaphore identifier to be used by everyone
 #define NAMESERVER_SLOT 0 // Nameserver will always communicate in this slot
 
 #define NBB_SIGNAL SIGRTMAX
@@ -17,6 +16,7 @@ enum {
 	SERVICE_TEST_WRITE = 3002,
   NAMESERVER_WRITE = 4000,
   NAMESERVER_READ = 4001, 
+  NAMESERVER_DIRECTORY = 4002,
 };
 
 enum {
@@ -24,13 +24,23 @@ enum {
   OPEN,
 };
 
-static const char NAMESERVER_PID_FILE[] = "/tmp/nameserver_pid";
-static const char NAMESERVER_CHANNEL_FULL[] = "Nameserver Full";
-static const char UNKNOWN_SERVICE[] = "Unknown Service";
-static const char SERVICE_BUSY[] = "Service Too Busy";
+// Nameserver request types (see struct ns_request)
+enum {
+  NS_REGISTER_SERVICE = 0,
+  NS_CONNECT_CLIENT,
+  NS_ACTIVATE_SERVICE,
+};
+
+// Nameserver reply status (see struct ns_reply)
+enum {
+  NS_OK = 0,
+  NS_CHANNEL_FULL,
+  NS_UNKNOWN_SERVICE,
+  NS_SERVICE_BUSY,
+  NS_REGISTRY_FULL,
+  NS_BAD_REQUEST,
+};
 
-static const char NBB_SERVICE[] = "0";
-static const char NBB_CLIENT[] = "1";
 static const char NBB_GUI[] = "GUI";
 
 #endif // CONSTANTS_H
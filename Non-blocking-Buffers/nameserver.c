@@ -1,169 +1,275 @@
 #include "nameserver.h"
 
+#include <assert.h>
+#include <stddef.h>
+#include <errno.h>
+
 #define CHANNEL_ID 0
 
 service_t service_lists[NUM_SERVICES] = {}; 
-int free_lists[TOTAL_CHANNELS] = {};
+
+// Two-level channel bitmap: bit b of channel_map[w] is set when channel
+// id w * 32 + b + 1 is taken, and bit w of channel_map_full is set when
+// channel_map[w] has no free bit left. Finding a free id is two ffs().
+// Ids past TOTAL_CHANNELS are permanently marked as taken.
+#define CHANNEL_MAP_TAIL (TOTAL_CHANNELS % 32 ? ~0u << (TOTAL_CHANNELS % 32) : 0)
+static unsigned int channel_map[CHANNEL_MAP_WORDS] = {
+  [CHANNEL_MAP_WORDS - 1] = CHANNEL_MAP_TAIL,
+};
+static unsigned int channel_map_full = 0;
+
+// Handle incoming requests (so far there's only service & client)
+static void (*handle_connection[NUM_CONNECTION_TYPE])(const struct ns_request*, struct ns_reply*) = 
+{
+  handle_service,
+  handle_client,
+  handle_activate,
+};
 
 void data_available(int signum)
 {
-	char* recv;
+  struct ns_request request;
+  struct ns_reply reply;
   size_t recv_len;
-	int retval = -1;
-  int request_type;
+  int retval;
 
-	retval = nbb_read_item(CHANNEL_ID, (void**)&recv, &recv_len);
+  retval = nbb_read_item_r(CHANNEL_ID, &request, &recv_len, sizeof(request));
 
-	// This is kind of a hack
-	// Do an extra resize and copy to null terminate
-	char* recv_str = (char*)calloc(recv_len+1, sizeof(char));
-	memcpy(recv_str, recv, recv_len);
-	recv_str[recv_len] = '\0';
- 
-  request_type = atoi(strtok(recv_str, " "));
-  handle_connection[request_type](strtok(NULL, ""));
+  if(retval == OK) {
+    memset(&reply, 0, NS_REPLY_SIZE(0));
+
+    // Everything up to and including the name must be there
+    if(recv_len != sizeof(request) ||
+       request.type < 0 || request.type >= NUM_CONNECTION_TYPE ||
+       memchr(request.name, '\0', MAX_NAME_SIZE) == NULL) {
+      PRINTF("** Malformed request (%zu bytes)\n", recv_len);
+      reply.status = NS_BAD_REQUEST;
+    }
+    else {
+      handle_connection[request.type](&request, &reply);
+    }
+
+    nbb_insert_item(CHANNEL_ID, &reply, NS_REPLY_SIZE(reply.num_channels));
+  }
 
   signal(NBB_SIGNAL, data_available);
-  free(recv);
-  free(recv_str);
 }
 
-void handle_client(char* arg)
+void handle_client(const struct ns_request* request, struct ns_reply* reply)
 {
   PRINTF("\n** Handling client\n");
 
-  char* msg = (char*)malloc(50*sizeof(char));
   int service_id;
   int channel_id; 
 
-  service_id = find_service(arg);
+  // The channel is claimed in the client's name, see sweep_dead_peers()
+  if(request->pid <= 0) {
+    reply->status = NS_BAD_REQUEST;
+    return;
+  }
 
-  if(service_id == -1) {
-   PRINTF("** Unable to find service: %s\n", arg);
-    strcpy(msg, UNKNOWN_SERVICE);
+  service_id = find_service(request->name, nbb_hash_name(request->name));
 
-    nbb_insert_item(CHANNEL_ID, msg, strlen(msg));
-    free(msg);
+  if(service_id == -1) {
+    PRINTF("** Unable to find service: %s\n", request->name);
+    reply->status = NS_UNKNOWN_SERVICE;
     return;
   }
 
- PRINTF("** Able to find service: %s\n", arg);
+  PRINTF("** Able to find service: %s\n", request->name);
 
-  channel_id = bind_client_service(service_id);
+  channel_id = bind_client_service(service_id, request->pid);
   if(channel_id == -1) {
-   PRINTF("** Service has no channel free\n");
-    strcpy(msg, SERVICE_BUSY);
-
-    nbb_insert_item(CHANNEL_ID, msg, strlen(msg));
-    free(msg);
+    PRINTF("** Service has no channel free\n");
+    reply->status = NS_SERVICE_BUSY;
     return;
   }
 
- PRINTF("** Service could accept connection\n");
-
-  char tmp[2]; 
-  sprintf(tmp, "%d", service_lists[service_id].pid); 
+  PRINTF("** Service could accept connection\n");
 
-  sprintf(msg, "%d", channel_id);
-  strcat(msg, " "); 
-  strcat(msg, tmp);
-
-  nbb_insert_item(CHANNEL_ID, msg, strlen(msg));
-  free(msg);
-  return;
+  reply->status = NS_OK;
+  reply->pid = service_lists[service_id].pid;
+  reply->num_channels = 1;
+  reply->channel_ids[0] = channel_id;
 }
 
-void handle_service(char* arg)
+void handle_service(const struct ns_request* request, struct ns_reply* reply)
 {
- PRINTF("** Handling service\n");
+  PRINTF("** Handling service\n");
 
-  char* service_name = strtok(arg, " ");
-  int num_channels = atoi(strtok(NULL, " "));
-  int service_pid = atoi(strtok(NULL, " "));
+  unsigned int hash = nbb_hash_name(request->name);
   int slot;
-  char* msg = (char*)calloc(50,sizeof(char));
-  int i;
 
-  slot = reserve_service_slot();
+  if(request->num_channels <= 0 || request->num_channels > SERVICE_MAX_CHANNELS) {
+    reply->status = NS_BAD_REQUEST;
+    return;
+  }
+
+  // A restarted service registers again under the same name
+  slot = find_service(request->name, hash);
+  if(slot != -1) {
+    dealloc_service(slot);
+  }
+
+  slot = reserve_service_slot(request->name, hash);
 
   if(slot == -1) {
+    reply->status = NS_REGISTRY_FULL;
     return;
   }
 
-  service_lists[slot].name = (char*)malloc(strlen(service_name));
-  strcpy(service_lists[slot].name, service_name);
-  service_lists[slot].num_channels = num_channels;
-  service_lists[slot].channel_ids = (int*)malloc(sizeof(int)*num_channels);
-  service_lists[slot].is_channel_busy = (int*)calloc(num_channels,sizeof(int));
-  service_lists[slot].pid = service_pid;
+  service_t* service = &service_lists[slot];
 
- PRINTF("** Name: %s, num_channel:%d, pid: %d\n", service_lists[slot].name, num_channels, service_pid);
+  strcpy(service->name, request->name);
+  service->hash = hash;
+  service->num_channels = request->num_channels;
+  service->pid = request->pid;
+
+  PRINTF("** Name: %s, num_channel:%d, pid: %d\n", service->name, service->num_channels, service->pid);
 
   if(reserve_channel(slot)) { 
-   PRINTF("** Unable to reserve %d channels\n", num_channels);
-    strcpy(msg, NAMESERVER_CHANNEL_FULL);
+    PRINTF("** Unable to reserve %d channels\n", request->num_channels);
+    reply->status = NS_CHANNEL_FULL;
+    return;
   }
-  else {
-   PRINTF("** Able to reserve %d channels\n", num_channels);
-    for(i = 0;i < service_lists[slot].num_channels;i++) {
-      char tmp[5] = "\0"; 
-      sprintf(tmp, "%d", service_lists[slot].channel_ids[i]);
-      strcat(msg, tmp);
-      strcat(msg, " "); 
-    }
+
+  PRINTF("** Able to reserve %d channels\n", request->num_channels);
+
+  // Published by handle_activate() once the service created its channels
+  reply->status = NS_OK;
+  reply->pid = service->pid;
+  reply->num_channels = service->num_channels;
+  memcpy(reply->channel_ids, service->channel_ids, service->num_channels * sizeof(int));
+}
+
+void handle_activate(const struct ns_request* request, struct ns_reply* reply)
+{
+  int slot = find_service(request->name, nbb_hash_name(request->name));
+
+  if(slot == -1 || service_lists[slot].pid != request->pid) {
+    reply->status = NS_UNKNOWN_SERVICE;
+    return;
   }
 
-  nbb_insert_item(CHANNEL_ID, msg, strlen(msg));
-  free(msg); 
-  return;
+  publish_service(slot);
+  reply->status = NS_OK;
 }
 
-int find_service(char* name)
+// Open addressing with linear probing. Lookups stop at the first slot
+// that has never been used and skip over removed ones.
+int find_service(const char* name, unsigned int hash)
 {
   int i;
+  int slot;
 
   for(i = 0;i < NUM_SERVICES;i++) {
-    if(service_lists[i].is_use && !strcmp(service_lists[i].name, name)) {
-      return i;
+    slot = (hash + i) & (NUM_SERVICES - 1);
+
+    if(service_lists[slot].is_use == SERVICE_EMPTY) {
+      break;
+    }
+
+    if(service_lists[slot].is_use == SERVICE_IN_USE &&
+       service_lists[slot].hash == hash &&
+       !strcmp(service_lists[slot].name, name)) {
+      return slot;
     }
   }
 
   return -1;
 }
 
-int bind_client_service(int service_id)
+// Clients normally claim channels themselves through the directory;
+// this is the same claim done on their behalf.
+int bind_client_service(int service_id, int client_pid)
 {
-  int i;
+  struct nbb_directory_entry* entry = &nbb_get_directory(0)->entries[service_id];
+  int bit;
 
-  for(i = 0;i < service_lists[service_id].num_channels;i++) {
-    if(!service_lists[service_id].is_channel_busy[i]) {
-      service_lists[service_id].is_channel_busy[i] = 1;
-      return service_lists[service_id].channel_ids[i];
-    }
+  bit = nbb_directory_claim_index(entry, service_lists[service_id].num_channels, client_pid);
+  if(bit < 0) {
+    return -1;
   }
 
-  return -1;
+  return service_lists[service_id].channel_ids[bit];
 }
 
-int reserve_channel(int slot)
+// The nameserver is the only writer of the directory, so a plain seqlock
+// is enough: bump |seq| to odd, update, bump it back to even.
+void publish_service(int slot)
 {
+  struct nbb_directory_entry* entry = &nbb_get_directory(0)->entries[slot];
+  service_t* service = &service_lists[slot];
   int i;
-  int count = 0;
 
-  for(i = 0;i < TOTAL_CHANNELS;i++) {
-    if(free_lists[i] == 0) {
-      free_lists[i] = 1;
-      service_lists[slot].channel_ids[count] = i + 1; // Since nameserver is bind to id 0 
-      count++;
-    }
+  entry->seq++;
+  __sync_synchronize();
+
+  entry->state = service->is_use;
+  entry->hash = service->hash;
+  entry->pid = service->pid;
+  entry->num_channels = service->num_channels;
+  memcpy(entry->channel_ids, service->channel_ids, sizeof(entry->channel_ids));
+  memcpy(entry->name, service->name, sizeof(entry->name));
+  entry->busy_map = 0;
+  entry->attached_map = 0;
+  for(i = 0;i < SERVICE_MAX_CHANNELS;i++) {
+    entry->client_pids[i] = 0;
+  }
+
+  __sync_synchronize();
+  entry->seq++;
+}
+
+int alloc_channel_id()
+{
+  int word;
+  int bit;
+
+  if(~channel_map_full == 0) {
+    return -1;
+  }
+
+  word = __builtin_ffs(~channel_map_full) - 1;
+  if(word >= CHANNEL_MAP_WORDS) {
+    return -1;
+  }
+
+  bit = __builtin_ffs(~channel_map[word]) - 1;
+  channel_map[word] |= 1u << bit;
+  if(~channel_map[word] == 0) {
+    channel_map_full |= 1u << word;
+  }
+
+  return word * 32 + bit + 1; // Since nameserver is bind to id 0
+}
+
+void free_channel_id(int channel_id)
+{
+  int index = channel_id - 1;
+
+  assert(channel_id >= 1 && channel_id <= TOTAL_CHANNELS);
+
+  channel_map[index / 32] &= ~(1u << (index % 32));
+  channel_map_full &= ~(1u << (index / 32));
+}
+
+int reserve_channel(int slot)
+{
+  int count;
+  int channel_id;
 
-    if(count == service_lists[slot].num_channels) {
+  for(count = 0;count < service_lists[slot].num_channels;count++) {
+    channel_id = alloc_channel_id();
+    if(channel_id == -1) {
       break;
     }
+    service_lists[slot].channel_ids[count] = channel_id;
   }
   
   // Couldn't reserve all of the channels requested
   if(count != service_lists[slot].num_channels) {
+    service_lists[slot].num_channels = count;
     dealloc_service(slot);
     return -1;
   }
@@ -171,14 +277,17 @@ int reserve_channel(int slot)
   return 0;
 }
 
-int reserve_service_slot()
+int reserve_service_slot(const char* name, unsigned int hash)
 {
   int i;
+  int slot;
 
   for(i = 0;i < NUM_SERVICES;i++) {
-    if(!service_lists[i].is_use) {
-      service_lists[i].is_use = 1;
-      return i;
+    slot = (hash + i) & (NUM_SERVICES - 1);
+
+    if(service_lists[slot].is_use != SERVICE_IN_USE) {
+      service_lists[slot].is_use = SERVICE_IN_USE;
+      return slot;
     }
   }
 
@@ -190,10 +299,64 @@ void dealloc_service(int slot)
   int i;
 
   for(i = 0;i < service_lists[slot].num_channels;i++) {
-    free_lists[service_lists[slot].channel_ids[i]] = 0;
+    free_channel_id(service_lists[slot].channel_ids[i]);
   }
 
-  service_lists[slot].is_use = 0;  
-  free(service_lists[slot].name);
-  free(service_lists[slot].channel_ids);
+  service_lists[slot].num_channels = 0;
+  service_lists[slot].is_use = SERVICE_REMOVED;  
+  publish_service(slot);
+}
+
+static int is_pid_alive(int pid)
+{
+  return kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+// Remove the segments of a channel that nobody is going to use again
+static void remove_channel_shm(int channel_id)
+{
+  nbb_shm_unlink(channel_id);
+  nbb_shm_unlink(channel_id + READ_WRITE_CONV);
+  nbb_shm_unlink(channel_id + NBB_HIGH_ID_OFFSET);
+  nbb_shm_unlink(channel_id + READ_WRITE_CONV + NBB_HIGH_ID_OFFSET);
+  nbb_shm_unlink(channel_id + NBB_BULK_ID_OFFSET);
+  nbb_shm_unlink(channel_id + READ_WRITE_CONV + NBB_BULK_ID_OFFSET);
+  nbb_shm_unlink(channel_id + NBB_SPILL_ID_OFFSET);
+  nbb_shm_unlink(channel_id + READ_WRITE_CONV + NBB_SPILL_ID_OFFSET);
+}
+
+void sweep_dead_peers()
+{
+  struct nbb_directory_entry* entry;
+  int slot;
+  int i;
+  int pid;
+
+  for(slot = 0;slot < NUM_SERVICES;slot++) {
+    if(service_lists[slot].is_use != SERVICE_IN_USE) {
+      continue;
+    }
+
+    // Service is gone, so are all of its channels
+    if(!is_pid_alive(service_lists[slot].pid)) {
+      PRINTF("** Service %s (pid %d) died\n", service_lists[slot].name, service_lists[slot].pid);
+      for(i = 0;i < service_lists[slot].num_channels;i++) {
+        remove_channel_shm(service_lists[slot].channel_ids[i]);
+      }
+      dealloc_service(slot);
+      continue;
+    }
+
+    // Clients that died without releasing their channel. The pid is the
+    // claim, so this also catches one that died before setting its bit.
+    entry = &nbb_get_directory(0)->entries[slot];
+    for(i = 0;i < service_lists[slot].num_channels;i++) {
+      pid = entry->client_pids[i];
+      if(pid && !is_pid_alive(pid)) {
+        PRINTF("** Reclaiming channel %d of %s from pid %d\n",
+               service_lists[slot].channel_ids[i], service_lists[slot].name, pid);
+        nbb_directory_release_index(entry, i, pid);
+      }
+    }
+  }
 }
@@ -7,27 +7,28 @@
 #include "constants.h"
 
 //TODO: Anything could be automated?
-#define NUM_CONNECTION_TYPE 2 // Server & client only for now
-#define NUM_SERVICES 5 // # of services this nameserver could hold
-#define TOTAL_CHANNELS 100 //Total # of channels that could be opened
+#define NUM_CONNECTION_TYPE 3 // Service registration, client, service activation
+#define NUM_SERVICES NBB_DIRECTORY_ENTRIES // # of services this nameserver could hold
+#define TOTAL_CHANNELS 999 //Total # of channels that could be opened (< READ_WRITE_CONV)
+#define CHANNEL_MAP_WORDS ((TOTAL_CHANNELS + 31) / 32) // Must be <= 32
 
 typedef struct service
 {
-  char* name;
-  int* channel_ids;
-  int* is_channel_busy;
+  char name[MAX_NAME_SIZE];
+  unsigned int hash;
+  int channel_ids[SERVICE_MAX_CHANNELS];
   int num_channels;
 
   int pid; // So that it could be interrupted
-  int is_use;
+  int is_use; // SERVICE_EMPTY, SERVICE_IN_USE or SERVICE_REMOVED
 } service_t;
 
 // Called by nameserver at initialization
 // Invariant: nameserver should be the first one that's starting
 int init_nameserver();
 
-// Finds whether the nameserver is able to store any more services
-int reserve_service_slot();
+// Finds a registry slot for a new service called |name|
+int reserve_service_slot(const char* name, unsigned int hash);
 
 // Control jumps to this function when nameserver receives new data
 // via signal
@@ -36,27 +37,34 @@ void data_available(int signum);
 // Allocate new channel to a particular service
 int reserve_channel(int slot);
 
+// Take / give back a single channel id from the channel bitmap
+int alloc_channel_id();
+void free_channel_id(int channel_id);
+
 // Deallocate the resources to the service
 void dealloc_service(int slot);
 
-// Find 
-void handle_client(char* arg);
+// Look up the service and hand out one of its free channels
+void handle_client(const struct ns_request* request, struct ns_reply* reply);
+
+// Register the service with the number of channels it wants to reserve
+// & the service's pid
+void handle_service(const struct ns_request* request, struct ns_reply* reply);
 
-// Arg consists of the name of the service, the number of channels 
-// it want to reserve & the service's pid
-void handle_service(char* arg);
+// Make a registered service visible to clients once its channels exist
+void handle_activate(const struct ns_request* request, struct ns_reply* reply);
 
-// Find the pointer to service with the name in the argument if it exist
-int find_service(char* name);
+// Find the registry slot of the service with the name in the argument if it exist
+int find_service(const char* name, unsigned int hash);
 
 // Find a free channel slot in the server
-int bind_client_service(int service_id);
+int bind_client_service(int service_id, int client_pid);
 
-// Handle incoming requests (so far there's only service & client)
-static void (*handle_connection[NUM_CONNECTION_TYPE])(char*) = 
-{
-  handle_service,
-  handle_client,
-};
+// Mirror registry slot |slot| into the shared service directory
+void publish_service(int slot);
+
+// Reclaim the channels of services and clients that are no longer alive.
+// Must not race with data_available(), so NBB_SIGNAL has to be blocked.
+void sweep_dead_peers();
 
 #endif // NAMESERVER_H
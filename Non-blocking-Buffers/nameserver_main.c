@@ -32,7 +32,15 @@ int main()
 
   signal(NBB_SIGNAL, data_available);
 
+  sigset_t nbb_signal_set;
+  sigemptyset(&nbb_signal_set);
+  sigaddset(&nbb_signal_set, NBB_SIGNAL);
+
 	while(1) {
     sleep(1);
+
+    sigprocmask(SIG_BLOCK, &nbb_signal_set, NULL);
+    sweep_dead_peers();
+    sigprocmask(SIG_UNBLOCK, &nbb_signal_set, NULL);
 	}
 }
@@ -1,16 +1,23 @@
+#define _GNU_SOURCE // sched_setaffinity
 #include "nbb.h"
 #include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <stdint.h>
+#if defined(__i386__) || defined(__x86_64__)
+#include <immintrin.h>
+#endif
 #include <unistd.h>
 
-// list of channel pointers (to shared memory)
-struct channel channel_list[SERVICE_MAX_CHANNELS] = {};
-struct connected_node connected_nodes[SERVICE_MAX_CHANNELS] = {};
-delay_buffer_t delay_buffers[SERVICE_MAX_CHANNELS];
 
-sem_t *sem_id;   // POSIX semaphore
-
-#define PID_MAX_STRLEN 5 // Assume maximum pid value of 16-bit
+#define PID_MAX_STRLEN 10 // Enough for any 32-bit pid
 #define CHANNEL_MAX_STRLEN 5
 
 // When a client nbb_connect_service()s to a service, this message is
@@ -18,681 +25,2944 @@ sem_t *sem_id;   // POSIX semaphore
 #define NEW_CONN_NOTIFY_MSG "**Q_Q**"
 #define NEW_CONN_NOTIFY_MSG_LEN (sizeof(NEW_CONN_NOTIFY_MSG) - 1)
 
-// Re-entrant version of nbb_read_item for use only in signal handler
+static int nbb_write_bulk(int slot_id, const char* msg, size_t size);
+static int nbb_ring_insert(int channel_id, int lane, const void* ptr_to_item, size_t size,
+                           unsigned short flags);
+static int nbb_ring_read(int channel_id, int lane, void* item, size_t* size, size_t max_size,
+                         unsigned short* flags);
+static inline unsigned char* nbb_bulk_data(struct bulk_arena* arena);
+static void nbb_record_open();
+static void nbb_install_signal_handler();
+static void nbb_delay_reserve(delay_buffer_t* buffer, int size);
+static void nbb_record(int slot, int direction, int lane, const char* msg, size_t size);
+static void nbb_watch_peer(struct nbb_context* ctx, int slot_id, int pid);
+static void nbb_spill_release(struct channel* ch);
+
+// Buffer for nbb_read_item_r in the signal handler
 // 16KB should be enough for 1 read at a time in the signal handler
 #define signal_handler_buffer_size (1<<14)
-static char signal_handler_buffer[signal_handler_buffer_size];
-static int nbb_read_item_r(int channel_id, void* item, size_t* size, size_t max_size);
 
+// Everything a thread needs to own channels. Slot ids index into the
+// calling thread's context, and the signal handler serves the context of
+// the thread it interrupted, which is the one the peer signalled.
+struct nbb_context {
+  // list of channel pointers (to shared memory)
+  struct channel channel_list[SERVICE_MAX_CHANNELS];
+  struct connected_node connected_nodes[SERVICE_MAX_CHANNELS];
+  delay_buffer_t delay_buffers[SERVICE_MAX_CHANNELS];
+
+  char signal_handler_buffer[signal_handler_buffer_size];
+  // Same, for nbb_poll_loop. Separate since a signal for another slot may
+  // interrupt the poll loop halfway through a read.
+  char poll_buffer[signal_handler_buffer_size];
+
+  // The nameserver channel stays open once we've talked to the nameserver
+  int nameserver_channel_open;
+
+  handle_events_func handler_func;
+
+  // Fires at the earliest pending doorbell deadline, see nbb_set_batching()
+  int batch_timer_open;
+  int batch_timer_fd;
+  long long batch_timer_deadline; // 0 when disarmed
+
+  // NBB_SIGNAL is blocked in signal_fd_tid and read from this instead, see
+  // nbb_signal_fd()
+  int signal_fd_open;
+  int signal_fd;
+  int signal_fd_tid;
+
+  // Holds the pidfds of our peers, see nbb_peer_fd()
+  int peer_epoll_open;
+  int peer_epoll_fd;
+
+  struct nbb_context* next;
+};
 
-int nbb_nameserver_connect(const char* request, char** ret, int* ret_len)
+// Used by threads that never attached a context of their own
+static struct nbb_context default_context;
+
+// initial-exec keeps the access async-signal-safe in a shared library
+static __thread struct nbb_context* current_context
+    __attribute__((tls_model("initial-exec")));
+
+// All contexts, so that claims can be released at exit
+static struct nbb_context* all_contexts = &default_context;
+static pthread_mutex_t contexts_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline struct nbb_context* nbb_ctx()
 {
-  int nameserver_pid = 0;
-  FILE* pFile;
-  int retval;
-  char* recv;
-  size_t recv_len;
+  return current_context ? current_context : &default_context;
+}
 
-  // Sanity check to isolate errors faster
-  assert(request != NULL && ret != NULL && ret_len != NULL);
-  *ret = NULL;
-  *ret_len = 0;
+// Shared service directory, mapped on first use
+static struct nbb_directory* directory = NULL;
 
-  // Should be reversed since what's written by service is read by nameserver
-  if(nbb_open_channel(NULL, NAMESERVER_WRITE, NAMESERVER_READ, !IPC_CREAT)) {
-    return -1;
-  }
+// Claimed channels are given back at exit
+static int release_claims_registered = 0;
 
-  pFile = fopen(NAMESERVER_PID_FILE, "r+");
-  fscanf(pFile,"%d",&nameserver_pid);
-  fclose(pFile);
+static int nbb_gettid()
+{
+  return syscall(SYS_gettid);
+}
 
-  nbb_insert_item(NAMESERVER_SLOT, request, strlen(request));
-  kill(nameserver_pid, NBB_SIGNAL);
+nbb_context_t* nbb_context_new()
+{
+  struct nbb_context* ctx = (struct nbb_context*) calloc(1, sizeof(struct nbb_context));
 
-  // Poll until we get something
-  do{
-    retval = nbb_read_item(NAMESERVER_SLOT, (void**)&recv, &recv_len);
-  } while (retval == BUFFER_EMPTY || retval == BUFFER_EMPTY_PRODUCER_INSERTING);
+  if(ctx == NULL) {
+    return NULL;
+  }
 
-  // Set return values
-  *ret = recv;
-  *ret_len = recv_len;
+  pthread_mutex_lock(&contexts_lock);
+  ctx->next = all_contexts;
+  all_contexts = ctx;
+  pthread_mutex_unlock(&contexts_lock);
 
-  // No errors, we're happy
-  return 0;
+  return ctx;
 }
 
-int init_nameserver()
+void nbb_context_free(nbb_context_t* ctx)
 {
-  FILE* pFile;
+  // Closing goes through the calling thread's context, so borrow it and
+  // put back whatever the caller had attached
+  struct nbb_context* saved = current_context == ctx ? NULL : current_context;
+  struct nbb_context** p;
+  int i;
 
-  // XXX: Initial semaphore value? Use 1 for now...
-  sem_id = sem_open(SEM_KEY, O_CREAT, 0666, 1);
-  if(sem_id == SEM_FAILED) {
-    PRINTF("! Unable to obtain semaphore\n");
-    return -1;
+  assert(ctx != NULL && ctx != &default_context);
+
+  for(i = 0;i < SERVICE_MAX_CHANNELS;i++) {
+    if(ctx->channel_list[i].in_use) {
+      nbb_context_attach(ctx);
+      nbb_close_channel(i);
+    }
   }
+  nbb_context_attach(saved);
 
-  if(nbb_open_channel(NULL, NAMESERVER_READ, NAMESERVER_WRITE, IPC_CREAT)) {
-    PRINTF("! Unable to open channel\n");
-    return -1;
+  pthread_mutex_lock(&contexts_lock);
+  for(p = &all_contexts;*p;p = &(*p)->next) {
+    if(*p == ctx) {
+      *p = ctx->next;
+      break;
+    }
   }
+  pthread_mutex_unlock(&contexts_lock);
 
-  pFile = fopen(NAMESERVER_PID_FILE,"w+");
-  fprintf(pFile,"%d",(int)getpid());
-  fclose(pFile);
+  if(ctx->batch_timer_open) {
+    close(ctx->batch_timer_fd);
+  }
+  if(ctx->signal_fd_open) {
+    close(ctx->signal_fd);
+  }
+  if(ctx->peer_epoll_open) {
+    close(ctx->peer_epoll_fd);
+  }
+  free(ctx);
+}
 
-  return 0;
+void nbb_context_attach(nbb_context_t* ctx)
+{
+  current_context = ctx;
 }
 
-int nbb_init_service(int num_channels, const char* name)
+nbb_context_t* nbb_context_current()
 {
-  char request[MAX_MSG_LEN] = {};
-  char num_channel[CHANNEL_MAX_STRLEN];
-  char pid[PID_MAX_STRLEN + 1];
+  return nbb_ctx();
+}
 
-  assert(num_channels > 0 && name != NULL);
+unsigned int nbb_hash_name(const char* name)
+{
+  // FNV-1a
+  unsigned int hash = 2166136261u;
 
-  sem_id = sem_open(SEM_KEY, 0);
-  if(sem_id == SEM_FAILED) {
-    PRINTF("! nbb_init_service(): Unable to obtain semaphore\n");
-    return -1;
+  while(*name) {
+    hash ^= (unsigned char) *name++;
+    hash *= 16777619u;
   }
 
-  // BEGIN CRITICAL SECTION
-  //TODO: sem_wait(sem_id);
+  return hash;
+}
 
-  sprintf(num_channel, "%d", num_channels);
-  sprintf(pid, "%d", getpid());
+struct nbb_directory* nbb_get_directory(int is_ipc_create)
+{
+  struct nbb_directory* dir;
 
-  strcpy(request, NBB_SERVICE);
-  strcat(request, " ");
-  strcat(request, name);
-  strcat(request, " ");
-  strcat(request, num_channel);
-  strcat(request, " ");
-  strcat(request, pid);
+  if(directory) {
+    return directory;
+  }
 
-  PRINTF("request: %s, len: %zu\n", request, strlen(request));
+  dir = (struct nbb_directory*) nbb_shm_map(NAMESERVER_DIRECTORY,
+      sizeof(struct nbb_directory), is_ipc_create);
+  if(dir == NULL) {
+    PRINTF("! nbb_get_directory(): nameserver not running\n");
+    return NULL;
+  }
 
-  char* recv;
-  int recv_len;
+  if(is_ipc_create) {
+    dir->nameserver_pid = getpid();
+    __sync_synchronize();
+    dir->magic = NBB_DIRECTORY_MAGIC;
+  }
+  else if(dir->magic != NBB_DIRECTORY_MAGIC) {
+    PRINTF("! nbb_get_directory(): nameserver not running\n");
+    nbb_shm_unmap(dir, sizeof(struct nbb_directory));
+    return NULL;
+  }
 
-  if(nbb_nameserver_connect(request, &recv, &recv_len)) {
-    PRINTF("! nbb_init_service(): Could not connect to nameserver\n");
-    sem_post(sem_id);
-    return -1;
+  // Another thread may have mapped it meanwhile, keep only one mapping
+  if(!__sync_bool_compare_and_swap(&directory, NULL, dir)) {
+    nbb_shm_unmap(dir, sizeof(struct nbb_directory));
   }
 
-  if(!strcmp(recv, NAMESERVER_CHANNEL_FULL)) {
-    PRINTF("! nbb_init_service(): Reserving channel unsuccessful\n");
-  
-    sem_post(sem_id);
-    return -1;
+  return directory;
+}
+
+// Take a consistent copy of the seqlock-protected part of |entry|
+static void directory_read_entry(struct nbb_directory_entry* entry,
+                                 struct nbb_directory_entry* copy)
+{
+  unsigned int seq;
+
+  do {
+    seq = entry->seq;
+    __sync_synchronize();
+    memcpy(copy, entry, sizeof(*copy));
+    __sync_synchronize();
+  } while((seq & 1) || seq != entry->seq);
+
+  copy->seq = seq;
+}
+
+// Probe the directory the same way the nameserver fills it
+static struct nbb_directory_entry* directory_find(const char* service_name,
+                                                  struct nbb_directory_entry* copy)
+{
+  unsigned int hash = nbb_hash_name(service_name);
+  struct nbb_directory_entry* entry;
+  int i;
+
+  for(i = 0;i < NBB_DIRECTORY_ENTRIES;i++) {
+    entry = &directory->entries[(hash + i) & (NBB_DIRECTORY_ENTRIES - 1)];
+    directory_read_entry(entry, copy);
+
+    if(copy->state == SERVICE_EMPTY) {
+      break;
+    }
+
+    if(copy->state == SERVICE_IN_USE && copy->hash == hash &&
+       !strncmp(copy->name, service_name, MAX_NAME_SIZE)) {
+      return entry;
+    }
   }
-  else {
-    PRINTF("** Acquired the following channels: %.*s\n", recv_len, recv);
-
-    int i;
-    int channel;
-    char* tmp;
-
-    tmp = strtok(recv, " ");
-    for(i = 1;i <= num_channels;i++) {
-      channel = atoi(tmp);
-      if(nbb_open_channel(name, channel, channel + READ_WRITE_CONV, IPC_CREAT) == -1) {
-        PRINTF("! nbb_init_service(): Failed to open the %d-th channel\n", i);
-        sem_post(sem_id);
-        free(recv);
-        return -1;
+
+  return NULL;
+}
+
+int nbb_directory_claim_index(struct nbb_directory_entry* entry, int num_channels, int pid)
+{
+  unsigned int free_map = ~entry->busy_map & ((1u << num_channels) - 1);
+  int bit;
+
+  // A clear bit whose pid is set is being claimed or released right now
+  while(free_map) {
+    bit = __builtin_ffs(free_map) - 1;
+    if(entry->client_pids[bit] == 0 && !(entry->attached_map & (1u << bit)) &&
+       __sync_bool_compare_and_swap(&entry->client_pids[bit], 0, pid)) {
+      // The service may have attached its previous client in the meantime,
+      // see nbb_directory_attach()
+      if(!(entry->attached_map & (1u << bit))) {
+        __sync_fetch_and_or(&entry->busy_map, 1u << bit);
+        return bit;
       }
-      tmp = strtok(NULL, " ");
+      __sync_bool_compare_and_swap(&entry->client_pids[bit], pid, 0);
     }
+    free_map &= ~(1u << bit);
+  }
 
-    signal(NBB_SIGNAL, nbb_recv_data);
+  return -1;
+}
 
-    sem_post(sem_id);
-    free(recv);
-    return 0;
+void nbb_directory_release_index(struct nbb_directory_entry* entry, int index, int pid)
+{
+  if(entry->client_pids[index] != pid) {
+    return;
   }
-  // END CRITICAL SECTION
+  __sync_fetch_and_and(&entry->busy_map, ~(1u << index));
+  __sync_bool_compare_and_swap(&entry->client_pids[index], pid, 0);
 }
 
-// Called by clients connecting to a server
-// Needs to map shm buffers into client's address space
-int nbb_connect_service(const char* client_name, const char* service_name)
+int nbb_directory_claim(const char* service_name, int* service_pid, int* status)
 {
-  char request[MAX_MSG_LEN];
-  int ret_code;
+  struct nbb_directory_entry copy;
+  struct nbb_directory_entry* entry;
+  int bit;
 
-  assert(service_name != NULL);
+  assert(service_name != NULL && service_pid != NULL && status != NULL);
 
-  sem_id = sem_open(SEM_KEY, 0);
-  if(sem_id == SEM_FAILED) {
-    PRINTF("! nbb_connect_service(): Unable to obtain semaphore\n");
+  if(nbb_get_directory(0) == NULL) {
+    *status = NS_BAD_REQUEST;
     return -1;
   }
-  // BEGIN CRITICAL SECTION
-  sem_wait(sem_id);
 
-  strcpy(request, NBB_CLIENT);
-  strcat(request, " ");
-  strcat(request, service_name);
+  for(;;) {
+    entry = directory_find(service_name, &copy);
+    if(entry == NULL) {
+      *status = NS_UNKNOWN_SERVICE;
+      return -1;
+    }
 
-  char* recv;
-  int recv_len;
-  if(nbb_nameserver_connect(request, &recv, &recv_len)) {
-    PRINTF("! nbb_connect_service(): Could not connect to nameserver!\n");
-    return -1;
+    bit = nbb_directory_claim_index(entry, copy.num_channels, getpid());
+    if(bit < 0) {
+      *status = NS_SERVICE_BUSY;
+      return -1;
+    }
+
+    // The nameserver may have replaced the entry while we were claiming.
+    // If so, give the channel back and look the service up again.
+    if(entry->seq == copy.seq) {
+      break;
+    }
+    nbb_directory_release_index(entry, bit, getpid());
   }
 
-  if(!recv) {
-    ret_code = -1;
+  *service_pid = copy.pid;
+  *status = NS_OK;
+  return copy.channel_ids[bit];
+}
+
+void nbb_directory_release(const char* service_name, int channel_id)
+{
+  struct nbb_directory_entry copy;
+  struct nbb_directory_entry* entry;
+  int i;
+
+  if(directory == NULL || (entry = directory_find(service_name, &copy)) == NULL) {
+    return;
   }
 
-  else if(!strcmp(recv, UNKNOWN_SERVICE)) {
-    PRINTF("! nbb_connect_service(): Invalid service: %s\n", service_name);
-    ret_code = -1;
+  for(i = 0;i < copy.num_channels;i++) {
+    if(copy.channel_ids[i] == channel_id) {
+      nbb_directory_release_index(entry, i, getpid());
+      return;
+    }
   }
+}
 
-  else if(!strcmp(recv, SERVICE_BUSY)) {
-    PRINTF("! nbb_connect_service(): Service %s too busy, not enough channel\n", service_name); 
-    ret_code = -1;
+// The directory entry of service |owner| and the index in it of the
+// channel the service reads as |read_id|, or NULL
+static struct nbb_directory_entry* nbb_directory_channel(const char* owner, int read_id,
+                                                         int* index)
+{
+  struct nbb_directory_entry copy;
+  struct nbb_directory_entry* entry;
+  int i;
+
+  if(owner == NULL || directory == NULL || (entry = directory_find(owner, &copy)) == NULL) {
+    return NULL;
   }
 
-  else {
-    char* tmp;
-    int slot;
-    int channel_id;
-    int service_pid;
-    char msg[MAX_MSG_LEN];
-    char pid[PID_MAX_STRLEN + 1];
-
-    tmp = strtok(recv, " ");
-    channel_id = atoi(tmp);
-    tmp = strtok(NULL, " ");
-    service_pid = atoi(tmp);
-
-    slot = nbb_open_channel(client_name, channel_id + READ_WRITE_CONV, channel_id, !IPC_CREAT);
-
-    //connected_nodes[slot].name = (char*)malloc(sizeof(char)*MAX_MSG_LEN);
-    assert(strlen(service_name) + 1 <= MAX_NAME_SIZE);
-    strcpy(connected_nodes[slot].name, service_name);
-    connected_nodes[slot].pid = service_pid;
-
-    ret_code = slot;
-
-    sprintf(pid, "%d", getpid());
-    strcpy(msg, NEW_CONN_NOTIFY_MSG) ;
-    strcat(msg, " ");
-    strcat(msg, pid);
-    strcat(msg, " ");
-    strcat(msg, client_name);
-
-    // Have to set up the signal handler before we connect to the service
-    // Ran into this condition under heavy load
-    signal(NBB_SIGNAL, nbb_recv_data);
-    // Notify service of the new connection
-    if (nbb_send(service_name, msg, strlen(msg))) {
-      PRINTF("! nbb_connect_service(): Can't notify service '%s' of new connection\n", service_name);
-      ret_code = -1;
-    } else {
-      PRINTF("** Connecting to service successful, channel: %d service pid: %d\n", channel_id, service_pid);
+  for(i = 0;i < copy.num_channels;i++) {
+    if(copy.channel_ids[i] == read_id) {
+      *index = i;
+      return entry;
     }
   }
 
-  // END CRITICAL SECTION
-  sem_post(sem_id);
+  return NULL;
+}
+
+// Service side: keep the channel of |slot_id| from being claimed again
+// until nbb_directory_detach(), for client |pid| that just announced
+// itself. Fails if the channel isn't |pid|'s anymore: it died and the
+// nameserver reclaimed the channel before we got to its announcement.
+// Set before checking, and claimers check after their CAS, so either we
+// see the new client or it sees the bit.
+static int nbb_directory_attach(struct nbb_context* ctx, int slot_id, int pid)
+{
+  struct channel* ch = &ctx->channel_list[slot_id];
+  struct nbb_directory_entry* entry;
+  int i;
 
-	return ret_code;
+  if((entry = nbb_directory_channel(ch->owner, ch->read_id, &i)) == NULL) {
+    return 0;
+  }
+
+  __sync_fetch_and_or(&entry->attached_map, 1u << i);
+  if(entry->client_pids[i] != pid) {
+    __sync_fetch_and_and(&entry->attached_map, ~(1u << i));
+    return -1;
+  }
+
+  return 0;
 }
 
-void nbb_set_cb_new_connection(const char* owner, cb_new_conn_func func, void* arg)
+// Service side: the channel of |slot_id| is ready for its next client
+static void nbb_directory_detach(struct nbb_context* ctx, int slot_id)
 {
+  struct channel* ch = &ctx->channel_list[slot_id];
+  struct nbb_directory_entry* entry;
   int i;
 
-  // |arg| can be NULL
-  assert(owner != NULL && func != NULL);
+  if((entry = nbb_directory_channel(ch->owner, ch->read_id, &i)) != NULL) {
+    __sync_fetch_and_and(&entry->attached_map, ~(1u << i));
+  }
+}
 
-  for(i = 1;i < SERVICE_MAX_CHANNELS;i++) {
-    if(!channel_list[i].in_use) {
-      continue;
+// Give back every channel we claimed, so that a service keeps its
+// capacity across client restarts
+static void nbb_release_claims(void)
+{
+  struct nbb_context* ctx;
+  int i;
+
+  pthread_mutex_lock(&contexts_lock);
+  for(ctx = all_contexts;ctx;ctx = ctx->next) {
+    for(i = NAMESERVER_SLOT + 1;i < SERVICE_MAX_CHANNELS;i++) {
+      if(ctx->channel_list[i].in_use && ctx->channel_list[i].claimed_channel) {
+        nbb_directory_release(ctx->connected_nodes[i].name, ctx->channel_list[i].claimed_channel);
+        ctx->channel_list[i].claimed_channel = 0;
+      }
     }
+  }
+  pthread_mutex_unlock(&contexts_lock);
+}
+
+// Wake up the reader of |slot_id|. Goes to the thread that opened the
+// other end when it told us, so one thread's traffic doesn't land in
+// another thread's context, and carries the reader's slot so its handler
+// only looks at this channel.
+static void nbb_notify(struct nbb_context* ctx, int slot_id)
+{
+  struct buffer* write = ctx->channel_list[slot_id].write;
+  int tid = write->reader_tid;
+  int pid = ctx->connected_nodes[slot_id].pid;
+  siginfo_t info;
+
+  // A polling reader finds the item on its own. Nobody to wake before a
+  // client announced itself, and kill(0) would hit our own process group.
+  if(write->reader_polls || pid <= 0) {
+    return;
+  }
 
-    if(channel_list[i].owner && !strcmp(owner, channel_list[i].owner)) {
-      channel_list[i].new_conn = func;
-      channel_list[i].arg = arg;
+  if(tid > 0) {
+    memset(&info, 0, sizeof(info));
+    info.si_signo = NBB_SIGNAL;
+    info.si_code = SI_QUEUE;
+    info.si_pid = getpid();
+    info.si_uid = getuid();
+    info.si_value.sival_int = write->reader_slot;
+
+    // sigqueue() for a single thread
+    if(syscall(SYS_rt_tgsigqueueinfo, pid, tid, NBB_SIGNAL, &info) == 0) {
+      return;
     }
   }
+
+  // The reader's signal queue is full (EAGAIN), or it never told us its
+  // thread. kill() still gets through without a queue entry, and a signal
+  // without a slot makes the reader scan all of its channels.
+  if(kill(pid, NBB_SIGNAL) == -1 && errno == ESRCH) {
+    ctx->channel_list[slot_id].peer_dead = 1;
+  }
 }
 
-void nbb_set_cb_new_data(const char* owner, cb_new_data_func func)
+static inline long long nbb_now_nsec()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_nsec + (1000000000LL * ts.tv_sec);
+}
+
+// Make the batch timer fire at |deadline| unless it fires earlier already.
+// Without a timer fd, deadlines are only checked on writes and in
+// nbb_flush_expired().
+static void nbb_arm_batch_timer(struct nbb_context* ctx, long long deadline)
+{
+  struct itimerspec its;
+
+  if(!ctx->batch_timer_open ||
+     (ctx->batch_timer_deadline && ctx->batch_timer_deadline <= deadline)) {
+    return;
+  }
+
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = deadline / 1000000000LL;
+  its.it_value.tv_nsec = deadline % 1000000000LL;
+  if(timerfd_settime(ctx->batch_timer_fd, TFD_TIMER_ABSTIME, &its, NULL) == 0) {
+    ctx->batch_timer_deadline = deadline;
+  }
+}
+
+// Wake the reader for |size| more bytes on |slot_id|, unless the channel
+// batches and neither its byte threshold nor its deadline was reached.
+// High priority writes always ring, and that covers the batch too.
+static void nbb_doorbell(struct nbb_context* ctx, int slot_id, size_t size, int lane)
+{
+  struct channel* ch = &ctx->channel_list[slot_id];
+  long long now;
+
+  if(ch->batch_bytes == 0 || lane == NBB_LANE_HIGH) {
+    ch->unsignalled = 0;
+    nbb_notify(ctx, slot_id);
+    return;
+  }
+
+  now = nbb_now_nsec();
+  if(ch->unsignalled == 0) {
+    ch->unsignalled_since = now;
+    nbb_arm_batch_timer(ctx, now + ch->batch_nsec);
+  }
+  ch->unsignalled += size;
+
+  if(ch->unsignalled >= ch->batch_bytes || now - ch->unsignalled_since >= ch->batch_nsec) {
+    ch->unsignalled = 0;
+    nbb_notify(ctx, slot_id);
+  }
+}
+
+int nbb_set_batching(int slot_id, size_t max_bytes, int max_usec)
+{
+  struct nbb_context* ctx = nbb_ctx();
+
+  assert(slot_id > NAMESERVER_SLOT && slot_id < SERVICE_MAX_CHANNELS);
+
+  if(!ctx->channel_list[slot_id].in_use || (max_bytes && max_usec <= 0)) {
+    PRINTF("! nbb_set_batching(): bad slot %d or deadline %d\n", slot_id, max_usec);
+    return -1;
+  }
+
+  // Whatever was held back goes out under the old settings
+  nbb_flush(slot_id);
+  ctx->channel_list[slot_id].batch_bytes = max_bytes;
+  ctx->channel_list[slot_id].batch_nsec = max_usec * 1000LL;
+
+  return 0;
+}
+
+int nbb_flush(int slot_id)
+{
+  struct nbb_context* ctx = nbb_ctx();
+
+  assert(slot_id >= 0 && slot_id < SERVICE_MAX_CHANNELS);
+
+  if(!ctx->channel_list[slot_id].unsignalled) {
+    return 0;
+  }
+  ctx->channel_list[slot_id].unsignalled = 0;
+  nbb_notify(ctx, slot_id);
+
+  return 1;
+}
+
+int nbb_flush_expired()
 {
+  struct nbb_context* ctx = nbb_ctx();
+  long long now = nbb_now_nsec();
+  long long next = 0;
+  unsigned long long expirations;
+  int flushed = 0;
   int i;
 
-  assert(owner != NULL && func != NULL);
+  // Clear the timer fd's readability, it's rearmed below if need be
+  if(ctx->batch_timer_open) {
+    read(ctx->batch_timer_fd, &expirations, sizeof(expirations));
+  }
+  ctx->batch_timer_deadline = 0;
 
   for(i = 1;i < SERVICE_MAX_CHANNELS;i++) {
-    if(!channel_list[i].in_use) {
+    struct channel* ch = &ctx->channel_list[i];
+    long long deadline = ch->unsignalled_since + ch->batch_nsec;
+
+    if(!ch->in_use || !ch->unsignalled) {
       continue;
     }
+    if(deadline <= now) {
+      flushed += nbb_flush(i);
+    }
+    else if(!next || deadline < next) {
+      next = deadline;
+    }
+  }
+
+  if(next) {
+    nbb_arm_batch_timer(ctx, next);
+  }
+
+  return flushed;
+}
+
+int nbb_batch_timer_fd()
+{
+  struct nbb_context* ctx = nbb_ctx();
+
+  if(!ctx->batch_timer_open) {
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+    if(fd == -1) {
+      PRINTF("! nbb_batch_timer_fd(): timerfd_create failed, errno %d\n", errno);
+      return -1;
+    }
+    ctx->batch_timer_fd = fd;
+    ctx->batch_timer_open = 1;
+  }
+
+  return ctx->batch_timer_fd;
+}
+
+int nbb_nameserver_connect(const struct ns_request* request, struct ns_reply* reply)
+{
+  struct nbb_context* ctx = nbb_ctx();
+  int retval;
+  size_t recv_len;
+
+  // Sanity check to isolate errors faster
+  assert(request != NULL && reply != NULL);
+
+  if(nbb_get_directory(0) == NULL) {
+    return -1;
+  }
+
+  // Should be reversed since what's written by service is read by nameserver
+  if(!ctx->nameserver_channel_open) {
+    if(nbb_open_channel(NULL, NAMESERVER_WRITE, NAMESERVER_READ, !IPC_CREAT)) {
+      return -1;
+    }
+    ctx->nameserver_channel_open = 1;
+  }
+
+  nbb_insert_item(NAMESERVER_SLOT, request, sizeof(*request));
+  kill(directory->nameserver_pid, NBB_SIGNAL);
+
+  // Poll until we get something
+  do{
+    retval = nbb_read_item_r(NAMESERVER_SLOT, reply, &recv_len, sizeof(*reply));
+  } while (retval == BUFFER_EMPTY || retval == BUFFER_EMPTY_PRODUCER_INSERTING);
+
+  if(recv_len < NS_REPLY_SIZE(0)) {
+    PRINTF("! nbb_nameserver_connect(): Short reply (%zu bytes)\n", recv_len);
+    return -1;
+  }
+
+  // No errors, we're happy
+  return 0;
+}
 
-    if(channel_list[i].owner && !strcmp(owner, channel_list[i].owner)) {
-      channel_list[i].new_data = func;
+// Serializes registrations on the nameserver channel. A lock left behind by
+// a service that died is taken over.
+static void nbb_registration_lock()
+{
+  volatile int* lock = &directory->registration_lock;
+  int pid = getpid();
+  int owner;
+
+  for(;;) {
+    owner = *lock;
+    if(owner == 0) {
+      if(__sync_bool_compare_and_swap(lock, 0, pid)) {
+        return;
+      }
+    }
+    else if(kill(owner, 0) == -1 && errno == ESRCH) {
+      if(__sync_bool_compare_and_swap(lock, owner, pid)) {
+        return;
+      }
+    }
+    else {
+      sched_yield();
     }
   }
 }
 
-void nbb_set_owner(int slot_id, const char *owner)
+static void nbb_registration_unlock()
+{
+  __sync_bool_compare_and_swap(&directory->registration_lock, getpid(), 0);
+}
+
+int init_nameserver()
+{
+  if(nbb_open_channel(NULL, NAMESERVER_READ, NAMESERVER_WRITE, IPC_CREAT)) {
+    PRINTF("! Unable to open channel\n");
+    return -1;
+  }
+
+  // Publishing the directory is what makes the nameserver visible
+  if(nbb_get_directory(IPC_CREAT) == NULL) {
+    PRINTF("! Unable to create service directory\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+// Registration is two round trips to the nameserver: reserve the channel
+// ids, create the segments, then activate. Clients can only find the
+// service in the directory once its channels are ready to attach to.
+int nbb_init_service(int num_channels, const char* name)
+{
+  struct ns_request request;
+  struct ns_reply reply;
+  int i;
+  int ret = -1;
+
+  assert(num_channels > 0 && name != NULL);
+
+  if(num_channels > SERVICE_MAX_CHANNELS || strlen(name) + 1 > MAX_NAME_SIZE) {
+    PRINTF("! nbb_init_service(): Invalid request for service %s\n", name);
+    return -1;
+  }
+
+  if(nbb_get_directory(0) == NULL) {
+    PRINTF("! nbb_init_service(): Nameserver is not running\n");
+    return -1;
+  }
+
+  memset(&request, 0, sizeof(request));
+  request.type = NS_REGISTER_SERVICE;
+  request.pid = getpid();
+  request.num_channels = num_channels;
+  strcpy(request.name, name);
+
+  // BEGIN CRITICAL SECTION
+  nbb_registration_lock();
+
+  if(nbb_nameserver_connect(&request, &reply)) {
+    PRINTF("! nbb_init_service(): Could not connect to nameserver\n");
+    goto out;
+  }
+
+  if(reply.status != NS_OK || reply.num_channels != num_channels) {
+    PRINTF("! nbb_init_service(): Reserving channel unsuccessful (%d)\n", reply.status);
+    goto out;
+  }
+
+  for(i = 0;i < num_channels;i++) {
+    if(nbb_open_channel(name, reply.channel_ids[i], reply.channel_ids[i] + READ_WRITE_CONV, IPC_CREAT) == -1) {
+      PRINTF("! nbb_init_service(): Failed to open the %d-th channel\n", i);
+      goto out;
+    }
+  }
+
+  nbb_install_signal_handler();
+
+  request.type = NS_ACTIVATE_SERVICE;
+  if(nbb_nameserver_connect(&request, &reply) || reply.status != NS_OK) {
+    PRINTF("! nbb_init_service(): Could not activate service %s\n", name);
+    goto out;
+  }
+
+  ret = 0;
+
+out:
+  nbb_registration_unlock();
+  // END CRITICAL SECTION
+  return ret;
+}
+
+// Called by clients connecting to a server
+// Needs to map shm buffers into client's address space
+//
+// The service and a free channel are looked up in the shared directory, so
+// there's no round trip to the nameserver here.
+int nbb_connect_service(const char* client_name, const char* service_name)
+{
+  struct nbb_context* ctx = nbb_ctx();
+  int slot;
+  int status;
+  int channel_id;
+  int service_pid;
+  char msg[MAX_MSG_LEN];
+  char pid[PID_MAX_STRLEN + 1];
+
+  assert(service_name != NULL);
+
+  if(strlen(service_name) + 1 > MAX_NAME_SIZE) {
+    PRINTF("! nbb_connect_service(): Service name too long: %s\n", service_name);
+    return -1;
+  }
+
+  channel_id = nbb_directory_claim(service_name, &service_pid, &status);
+
+  if(status == NS_UNKNOWN_SERVICE) {
+    PRINTF("! nbb_connect_service(): Invalid service: %s\n", service_name);
+    return -1;
+  }
+
+  if(status == NS_SERVICE_BUSY) {
+    PRINTF("! nbb_connect_service(): Service %s too busy, not enough channel\n", service_name); 
+    return -1;
+  }
+
+  if(status != NS_OK) {
+    PRINTF("! nbb_connect_service(): Could not read service directory!\n");
+    return -1;
+  }
+
+  slot = nbb_open_channel(client_name, channel_id + READ_WRITE_CONV, channel_id, !IPC_CREAT);
+  if(slot == -1) {
+    PRINTF("! nbb_connect_service(): Could not open channel %d\n", channel_id);
+    nbb_directory_release(service_name, channel_id);
+    return -1;
+  }
+  ctx->channel_list[slot].claimed_channel = channel_id;
+
+  if(!release_claims_registered) {
+    atexit(nbb_release_claims);
+    release_claims_registered = 1;
+  }
+
+  //ctx->connected_nodes[slot].name = (char*)malloc(sizeof(char)*MAX_MSG_LEN);
+  assert(strlen(service_name) + 1 <= MAX_NAME_SIZE);
+  strcpy(ctx->connected_nodes[slot].name, service_name);
+  ctx->connected_nodes[slot].pid = service_pid;
+  nbb_watch_peer(ctx, slot, service_pid);
+
+  sprintf(pid, "%d", getpid());
+  strcpy(msg, NEW_CONN_NOTIFY_MSG) ;
+  strcat(msg, " ");
+  strcat(msg, pid);
+  strcat(msg, " ");
+  strcat(msg, client_name);
+
+  // Have to set up the signal handler before we connect to the service
+  // Ran into this condition under heavy load
+  nbb_install_signal_handler();
+  // Notify service of the new connection
+  if (nbb_send(service_name, msg, strlen(msg))) {
+    PRINTF("! nbb_connect_service(): Can't notify service '%s' of new connection\n", service_name);
+    return -1;
+  }
+
+  PRINTF("** Connecting to service successful, channel: %d service pid: %d\n", channel_id, service_pid);
+  return slot;
+}
+
+void nbb_set_cb_new_connection(const char* owner, cb_new_conn_func func, void* arg)
+{
+  struct nbb_context* ctx = nbb_ctx();
+  int i;
+
+  // |arg| can be NULL
+  assert(owner != NULL && func != NULL);
+
+  for(i = 1;i < SERVICE_MAX_CHANNELS;i++) {
+    if(!ctx->channel_list[i].in_use) {
+      continue;
+    }
+
+    if(ctx->channel_list[i].owner && !strcmp(owner, ctx->channel_list[i].owner)) {
+      ctx->channel_list[i].new_conn = func;
+      ctx->channel_list[i].arg = arg;
+    }
+  }
+}
+
+void nbb_set_cb_new_data(const char* owner, cb_new_data_func func)
+{
+  struct nbb_context* ctx = nbb_ctx();
+  int i;
+
+  assert(owner != NULL && func != NULL);
+
+  for(i = 1;i < SERVICE_MAX_CHANNELS;i++) {
+    if(!ctx->channel_list[i].in_use) {
+      continue;
+    }
+
+    if(ctx->channel_list[i].owner && !strcmp(owner, ctx->channel_list[i].owner)) {
+      ctx->channel_list[i].new_data = func;
+    }
+  }
+}
+
+void nbb_set_cb_disconnect(const char* owner, cb_disconnect_func func)
+{
+  struct nbb_context* ctx = nbb_ctx();
+  int i;
+
+  assert(owner != NULL && func != NULL);
+
+  for(i = 1;i < SERVICE_MAX_CHANNELS;i++) {
+    if(!ctx->channel_list[i].in_use) {
+      continue;
+    }
+
+    if(ctx->channel_list[i].owner && !strcmp(owner, ctx->channel_list[i].owner)) {
+      ctx->channel_list[i].peer_gone = func;
+    }
+  }
+}
+
+void nbb_set_owner(int slot_id, const char *owner)
+{
+  struct nbb_context* ctx = nbb_ctx();
+  assert(slot_id >= 0 && slot_id < SERVICE_MAX_CHANNELS && "Invalid slot id");
+  assert(owner != NULL && "Invalid owner");
+
+  if (ctx->channel_list[slot_id].owner != NULL) {
+    free(ctx->channel_list[slot_id].owner);
+  }
+
+  ctx->channel_list[slot_id].owner = (char *) malloc(sizeof(char) * (strlen(owner) + 1));
+  assert(ctx->channel_list[slot_id].owner != NULL && "malloc failed");
+
+  strcpy(ctx->channel_list[slot_id].owner, owner);
+  PRINTF("***nbb_change_owner***: Changed owner for slot %d to '%s'\n", slot_id, owner);
+}
+
+int nbb_write_bytes(int slot_id, const char* msg, size_t msg_len)
+{
+  return nbb_write_bytes_lane(slot_id, msg, msg_len, NBB_LANE_NORMAL);
+}
+
+int nbb_write_bytes_lane(int slot_id, const char* msg, size_t msg_len, int lane)
+{
+  struct nbb_context* ctx = nbb_ctx();
+  assert(msg != NULL);
+
+  if (msg_len == 0) {
+    PRINTF("! nbb_send(): nothing to send (0 length passed in)\n");
+    return 0;
+  }
+
+  assert(slot_id >= 0 && slot_id < SERVICE_MAX_CHANNELS && "Process not found");
+
+  // Closed, possibly by nbb_reap_dead_peers() behind the caller's back
+  if(!ctx->channel_list[slot_id].in_use) {
+    PRINTF("! nbb_write_bytes_lane(): slot %d is not open\n", slot_id);
+    return -1;
+  }
+
+  int ret;
+  if(msg_len > NBB_BULK_THRESHOLD && ctx->channel_list[slot_id].write_bulk) {
+    ret = nbb_write_bulk(slot_id, msg, msg_len);
+  }
+  else if(lane == NBB_LANE_HIGH && ctx->channel_list[slot_id].high_write) {
+    ret = nbb_ring_insert(slot_id, NBB_LANE_HIGH, msg, msg_len, 0);
+  }
+  else {
+    ret = nbb_insert_item(slot_id, msg, msg_len);
+  }
+  if(ret == OK) {
+    nbb_record(slot_id, NBB_RECORD_SENT, lane, msg, msg_len);
+    nbb_doorbell(ctx, slot_id, msg_len, lane);
+  } else {
+      return ret;
+  }
+
+  return 0;
+}
+
+// Find the slot to put |key|'s message in: the one already holding it, if
+// nothing went through the ring since, or else an empty one. Returns it in
+// NBB_SLOT_WRITING state, or NULL if all of them are taken.
+static struct coalesce_slot* nbb_claim_coalesce_slot(struct buffer* buf, unsigned int key)
+{
+  struct coalesce_slot* free_slot = NULL;
+  int i;
+
+  for(i = 0;i < NBB_COALESCE_SLOTS;i++) {
+    struct coalesce_slot* cs = &buf->coalesce[i];
+
+    // The reader may take it meanwhile, then it's just empty again
+    if(cs->state == NBB_SLOT_READY && cs->key == key &&
+       cs->ring_pos == nbb_ring_write_pos(buf) &&
+       __sync_bool_compare_and_swap(&cs->state, NBB_SLOT_READY, NBB_SLOT_WRITING)) {
+      return cs;
+    }
+    if(free_slot == NULL && cs->state == NBB_SLOT_EMPTY) {
+      free_slot = cs;
+    }
+  }
+
+  // Only we move slots out of EMPTY
+  if(free_slot) {
+    free_slot->state = NBB_SLOT_WRITING;
+    free_slot->key = key;
+    free_slot->ring_pos = nbb_ring_write_pos(buf);
+  }
+  return free_slot;
+}
+
+int nbb_write_coalesced(int slot_id, unsigned int key, const char* msg, size_t msg_len)
+{
+  struct nbb_context* ctx = nbb_ctx();
+  struct buffer* buf;
+  struct coalesce_slot* cs;
+
+  assert(msg != NULL);
+  assert(slot_id >= 0 && slot_id < SERVICE_MAX_CHANNELS && "Process not found");
+
+  buf = ctx->channel_list[slot_id].high_write;
+  if(buf == NULL || msg_len == 0 || msg_len > NBB_COALESCE_MAX_SIZE ||
+     (cs = nbb_claim_coalesce_slot(buf, key)) == NULL) {
+    return nbb_write_bytes_lane(slot_id, msg, msg_len, NBB_LANE_HIGH);
+  }
+
+  nbb_copy_to_shm(cs->data, msg, msg_len);
+  cs->size = msg_len;
+  cs->seq = buf->coalesce_seq++;
+  __sync_synchronize();
+  cs->state = NBB_SLOT_READY;
+
+  ctx->channel_list[slot_id].write_count += (msg_len - 1); // Like nbb_ring_insert()
+  nbb_record(slot_id, NBB_RECORD_SENT, NBB_LANE_HIGH, msg, msg_len);
+  nbb_notify(ctx, slot_id);
+
+  return 0;
+}
+
+int nbb_send(const char* destination, const char* msg, size_t msg_len)
+{
+  struct nbb_context* ctx = nbb_ctx();
+  int i;
+
+  // Since i = 0 is already reserved for nameserver
+  for(i = 1; i < SERVICE_MAX_CHANNELS;i++) {
+    if(ctx->channel_list[i].in_use && ctx->connected_nodes[i].name &&
+       !strcmp(destination, ctx->connected_nodes[i].name)) {
+      break;
+    }
+  }
+
+  return nbb_write_bytes(i, msg, msg_len);
+}
+
+// Flush the coalescing slots of |buf| that sit at ring position |pos|, in
+// the order they were written, and return how many. Sets *|busy| if the
+// producer is filling one: it might belong before the next ring item, so
+// the caller has to stop there. The producer signals us once it's done.
+// Slots behind |pos| go too: the producer can fill one and commit the ring
+// item at its position between our scan and our ring read, and nothing
+// would match it again until the position wraps.
+static int nbb_recv_coalesced(int slot, struct buffer* buf, unsigned short pos, int* busy)
+{
+  int got = 0;
+  int i;
+
+  while(1) {
+    struct coalesce_slot* next = NULL;
+
+    for(i = 0;i < NBB_COALESCE_SLOTS;i++) {
+      struct coalesce_slot* cs = &buf->coalesce[i];
+
+      if(cs->state == NBB_SLOT_WRITING) {
+        *busy = 1;
+        return got;
+      }
+      if(cs->state == NBB_SLOT_READY && (short) (cs->ring_pos - pos) <= 0 &&
+         (next == NULL || (int) (cs->seq - next->seq) < 0)) {
+        next = cs;
+      }
+    }
+
+    if(next == NULL) {
+      return got;
+    }
+    // Lost it to an overwrite, look again
+    if(!__sync_bool_compare_and_swap(&next->state, NBB_SLOT_READY, NBB_SLOT_READING)) {
+      continue;
+    }
+
+    nbb_flush_shm(slot, next->data, next->size);
+    nbb_record(slot, NBB_RECORD_RECEIVED, NBB_LANE_HIGH, next->data, next->size);
+    __sync_synchronize();
+    next->state = NBB_SLOT_EMPTY;
+    got++;
+  }
+}
+
+// Where the next item of |slot| is read to. The signal handler passes its
+// own buffer in |recv| and nbb_flush_shm() copies from there. Outside of it
+// (|recv| is NULL) we can grow the delay buffer beforehand and read right
+// to its end, and nbb_flush_shm() only has to count it.
+static char* nbb_recv_target(struct nbb_context* ctx, int slot, char* recv, size_t recv_max_len)
+{
+  delay_buffer_t* buffer = &ctx->delay_buffers[slot];
+
+  if(recv) {
+    return recv;
+  }
+
+  // One spare byte, see nbb_recv_slot()
+  nbb_delay_reserve(buffer, recv_max_len + 1);
+  return buffer->content + buffer->len;
+}
+
+/* Called when the service gets new client data */
+// Drain the high priority lane of |slot|. Items there are whole messages,
+// and so is everything already in the delay buffer, so appending keeps the
+// stream intact. Returns the number of items.
+static int nbb_recv_high(struct nbb_context* ctx, int slot, char* recv, size_t recv_max_len)
+{
+  size_t recv_len = 0;
+  unsigned short flags;
+  int got = 0;
+  struct buffer* buf = ctx->channel_list[slot].high_read;
+  int busy = 0;
+  char* target;
+
+  if(buf == NULL) {
+    return 0;
+  }
+
+  // Coalesced messages go before the ring item that was written after them
+  while(1) {
+    got += nbb_recv_coalesced(slot, buf, nbb_ring_read_pos(buf), &busy);
+    if(busy) {
+      break;
+    }
+    target = nbb_recv_target(ctx, slot, recv, recv_max_len);
+    if(nbb_ring_read(slot, NBB_LANE_HIGH, (void*) target, &recv_len, recv_max_len, &flags) != OK) {
+      break;
+    }
+    nbb_flush_shm(slot, target, recv_len);
+    nbb_record(slot, NBB_RECORD_RECEIVED, NBB_LANE_HIGH, target, recv_len);
+    got++;
+  }
+
+  if (got && ctx->channel_list[slot].new_data != NULL) {
+    ctx->channel_list[slot].new_data(slot);
+  }
+
+  return got;
+}
+
+// Whether |ch| may have anything for us, from the rings' heads only. Quiet
+// slots are skipped by the poll loop and full scans without going through
+// the read path.
+static inline int nbb_slot_pending(struct channel* ch)
+{
+  int i;
+
+  if(!nbb_ring_empty(ch->read, ch->read_data) || ch->spill_reading ||
+     (ch->read->spill_state & NBB_SPILL_ACTIVE)) {
+    return 1;
+  }
+
+  if(ch->high_read == NULL) {
+    return 0;
+  }
+  if(!nbb_ring_empty(ch->high_read, ch->high_read_data)) {
+    return 1;
+  }
+  for(i = 0;i < NBB_COALESCE_SLOTS;i++) {
+    if(ch->high_read->coalesce[i].state != NBB_SLOT_EMPTY) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Read one item from |slot| and dispatch it, after everything on the high
+// priority lane. |recv| may be NULL outside of the signal handler, see
+// nbb_recv_target(). Returns the number of items read.
+static int nbb_recv_slot(struct nbb_context* ctx, int slot, char* recv, size_t recv_max_len)
+{
+  size_t recv_len = 0;
+  int is_new_conn_msg = 0;
+  unsigned short flags;
+  int got;
+
+  got = nbb_recv_high(ctx, slot, recv, recv_max_len);
+  recv = nbb_recv_target(ctx, slot, recv, recv_max_len);
+
+  // Use re-entrant version of nbb_read_item
+  if(nbb_ring_read(slot, NBB_LANE_NORMAL, (void*) recv, &recv_len, recv_max_len, &flags) != OK) {
+    return got;
+  }
+
+  // Copy the payload straight out of the arena, then give the space back
+  if(flags & NBB_ITEM_BULK) {
+    struct bulk_arena* arena = ctx->channel_list[slot].read_bulk;
+    struct bulk_handle handle;
+
+    assert(arena != NULL && recv_len == sizeof(handle));
+    memcpy(&handle, recv, sizeof(handle));
+    nbb_flush_shm(slot, (char*) nbb_bulk_data(arena) + handle.offset, handle.size);
+    nbb_record(slot, NBB_RECORD_RECEIVED, NBB_LANE_NORMAL,
+               (char*) nbb_bulk_data(arena) + handle.offset, handle.size);
+    __sync_synchronize();
+    arena->tail = handle.end;
+
+    if (ctx->channel_list[slot].new_data != NULL) {
+      ctx->channel_list[slot].new_data(slot);
+    }
+    return got + 1;
+  }
+
+  if (memcmp(recv, NEW_CONN_NOTIFY_MSG, NEW_CONN_NOTIFY_MSG_LEN) == 0) {
+    // We have enough buffer for this null byte
+    recv[recv_len] = '\0';
+
+    char* tmp = NULL;
+    int pid;
+
+    strtok(recv, " ");
+    tmp = strtok(NULL, " ");
+    pid = atoi(tmp);
+    if(nbb_directory_attach(ctx, slot, pid)) {
+      PRINTF("***NBB***: Stale connection on slot %d from pid %d\n", slot, pid);
+      return 1;
+    }
+    ctx->connected_nodes[slot].pid = pid;
+    tmp = strtok(NULL, " ");
+    //ctx->connected_nodes[slot].name = (char*)malloc(strlen(tmp) * sizeof(char));
+    assert(strlen(tmp) + 1 <= MAX_NAME_SIZE);
+    strcpy(ctx->connected_nodes[slot].name, tmp);
+    nbb_watch_peer(ctx, slot, ctx->connected_nodes[slot].pid);
+
+    PRINTF("***NBB***: New connection on slot %d from client_name: %s with pid: %d\n", slot, ctx->connected_nodes[slot].name, ctx->connected_nodes[slot].pid);
+
+    // Whatever is buffered came from the previous owner of the channel
+    ctx->delay_buffers[slot].len = 0;
+
+    is_new_conn_msg = 1;
+  }
+
+  if (!is_new_conn_msg) {
+    nbb_flush_shm(slot, recv, recv_len);
+    nbb_record(slot, NBB_RECORD_RECEIVED, NBB_LANE_NORMAL, recv, recv_len);
+  }
+
+  /*
+  PRINTF("** Received %zu bytes: ", recv_len);
+  int z;
+  for(z=0; z<recv_len; z++) {
+    PRINTF("%02x", recv[z]);
+  }
+  PRINTF(" from shm id %d slot %d\n", (int) ctx->channel_list[slot].read_id, slot);
+  */
+
+  // Notify of new connection on slot
+  if (is_new_conn_msg && ctx->channel_list[slot].new_conn != NULL) {
+    ctx->channel_list[slot].new_conn(slot, ctx->channel_list[slot].arg);
+  }
+
+  // We only have new data when the msg is "real data" (not our initial msg).
+  // Notify event of new available data on slot
+  if (!is_new_conn_msg && ctx->channel_list[slot].new_data != NULL) {
+    ctx->channel_list[slot].new_data(slot);
+  }
+
+  return 1;
+}
+
+// Read everything pending on |slot_id| after a signal, into |recv| in the
+// signal handler, and return the number of items
+static int nbb_recv_signalled(struct nbb_context* ctx, int slot_id, char* recv)
+{
+  int got = 0;
+  int n;
+
+  // Polled channels are read by nbb_poll_loop only
+  if(!ctx->channel_list[slot_id].in_use || ctx->channel_list[slot_id].busy_poll ||
+     !nbb_slot_pending(&ctx->channel_list[slot_id])) {
+    return 0;
+  }
+
+  // Keep one byte spare to null terminate the new connection message.
+  // Drain the slot: signals merge, and a batching writer rings once for
+  // many items.
+  while((n = nbb_recv_slot(ctx, slot_id, recv, signal_handler_buffer_size - 1)) > 0) {
+    got += n;
+  }
+  return got;
+}
+
+void nbb_recv_data(int signum)
+{
+  struct nbb_context* ctx = nbb_ctx();
+  int i;
+
+  // Since i = 0 is already reserved for nameserver
+  for(i = 1;i < SERVICE_MAX_CHANNELS;i++) {
+    nbb_recv_signalled(ctx, i, ctx->signal_handler_buffer);
+  }
+}
+
+static void nbb_signal_handler(int signum, siginfo_t* info, void* ucontext)
+{
+  struct nbb_context* ctx = nbb_ctx();
+  int slot_id = info->si_value.sival_int;
+
+  PRINTF("***NBB***: Inside signal handler\n");
+
+  // A process-wide signal for a context another thread reads through
+  // nbb_signal_fd(). Hand it over rather than race with that thread.
+  if(ctx->signal_fd_open) {
+    syscall(SYS_tgkill, getpid(), ctx->signal_fd_tid, NBB_SIGNAL);
+    return;
+  }
+
+  // Queued by nbb_notify() to this thread. Anything else, kill() after a
+  // queue overflow or our own raise(), doesn't say which channel fired.
+  if(info->si_code == SI_QUEUE && slot_id > NAMESERVER_SLOT && slot_id < SERVICE_MAX_CHANNELS) {
+    nbb_recv_signalled(ctx, slot_id, ctx->signal_handler_buffer);
+    return;
+  }
+  nbb_recv_data(signum);
+}
+
+// The handler stays installed for the life of the process
+static void nbb_install_signal_handler()
+{
+  static int installed = 0;
+  struct sigaction action;
+
+  if(!__sync_bool_compare_and_swap(&installed, 0, 1)) {
+    return;
+  }
+
+  memset(&action, 0, sizeof(action));
+  action.sa_sigaction = nbb_signal_handler;
+  action.sa_flags = SA_SIGINFO | SA_RESTART;
+  sigemptyset(&action.sa_mask);
+
+  if(sigaction(NBB_SIGNAL, &action, NULL) == -1) {
+    PRINTF("! nbb_install_signal_handler(): sigaction failed\n");
+    installed = 0;
+  }
+}
+
+int nbb_signal_fd()
+{
+  struct nbb_context* ctx = nbb_ctx();
+  sigset_t mask;
+  int fd;
+
+  if(ctx->signal_fd_open) {
+    return ctx->signal_fd;
+  }
+
+  sigemptyset(&mask);
+  sigaddset(&mask, NBB_SIGNAL);
+
+  fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  if(fd == -1) {
+    PRINTF("! nbb_signal_fd(): signalfd failed, errno %d\n", errno);
+    return -1;
+  }
+
+  // The handler still serves every other thread. Blocked first, so it
+  // never sees this context open on this thread.
+  nbb_install_signal_handler();
+  pthread_sigmask(SIG_BLOCK, &mask, NULL);
+  ctx->signal_fd = fd;
+  ctx->signal_fd_tid = nbb_gettid();
+  __sync_synchronize();
+  ctx->signal_fd_open = 1;
+
+  return fd;
+}
+
+// Signals per read() of the signalfd
+#define NBB_SIGNAL_BATCH 64
+
+int nbb_dispatch_signals()
+{
+  struct nbb_context* ctx = nbb_ctx();
+  struct signalfd_siginfo info[NBB_SIGNAL_BATCH];
+  char signalled[SERVICE_MAX_CHANNELS];
+  int scan = 0;
+  int got = 0;
+  ssize_t size;
+  int i, n;
+
+  if(!ctx->signal_fd_open) {
+    PRINTF("! nbb_dispatch_signals(): no signal fd, see nbb_signal_fd()\n");
+    return -1;
+  }
+
+  // Take everything queued so far and note each slot once
+  memset(signalled, 0, sizeof(signalled));
+  do {
+    size = read(ctx->signal_fd, info, sizeof(info));
+    n = size > 0 ? size / sizeof(info[0]) : 0;
+
+    for(i = 0;i < n;i++) {
+      int slot_id = info[i].ssi_int;
+
+      // Same as in nbb_signal_handler()
+      if(info[i].ssi_code == SI_QUEUE && slot_id > NAMESERVER_SLOT && slot_id < SERVICE_MAX_CHANNELS) {
+        signalled[slot_id] = 1;
+      }
+      else {
+        scan = 1;
+      }
+    }
+  } while(n == NBB_SIGNAL_BATCH || (size == -1 && errno == EINTR));
+
+  for(i = 1;i < SERVICE_MAX_CHANNELS;i++) {
+    if(scan || signalled[i]) {
+      got += nbb_recv_signalled(ctx, i, NULL);
+    }
+  }
+
+  return got;
+}
+
+void nbb_close_signal_fd()
+{
+  struct nbb_context* ctx = nbb_ctx();
+  sigset_t mask;
+
+  if(!ctx->signal_fd_open) {
+    return;
+  }
+
+  ctx->signal_fd_open = 0;
+  close(ctx->signal_fd);
+
+  // Whatever is still queued goes to the handler, which then scans
+  sigemptyset(&mask);
+  sigaddset(&mask, NBB_SIGNAL);
+  pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
+  raise(NBB_SIGNAL);
+}
+
+// Keeps the signal handler, which opens and announces connections, out of
+// the channel table while we change it
+static void nbb_block_signal(sigset_t* old)
+{
+  sigset_t mask;
+
+  sigemptyset(&mask);
+  sigaddset(&mask, NBB_SIGNAL);
+  pthread_sigmask(SIG_BLOCK, &mask, old);
+}
+
+static void nbb_add_peer_fd(struct nbb_context* ctx, int slot_id)
+{
+  struct epoll_event ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.u32 = slot_id;
+  if(epoll_ctl(ctx->peer_epoll_fd, EPOLL_CTL_ADD, ctx->channel_list[slot_id].peer_fd, &ev) == -1) {
+    PRINTF("! nbb_add_peer_fd(): epoll_ctl failed for slot %d, errno %d\n", slot_id, errno);
+  }
+}
+
+// Peer liveness: a slot holds a pidfd for the process at its other end,
+// which polls readable once that process is gone. Called whenever we learn
+// who that is, possibly from the signal handler.
+static void nbb_watch_peer(struct nbb_context* ctx, int slot_id, int pid)
+{
+  struct channel* ch = &ctx->channel_list[slot_id];
+  int saved_errno = errno;
+
+  if(ch->peer_fd_open) {
+    close(ch->peer_fd);
+    ch->peer_fd_open = 0;
+  }
+  ch->peer_dead = 0;
+
+#ifdef SYS_pidfd_open
+  ch->peer_fd = syscall(SYS_pidfd_open, pid, 0);
+  if(ch->peer_fd != -1) {
+    ch->peer_fd_open = 1;
+    if(ctx->peer_epoll_open) {
+      nbb_add_peer_fd(ctx, slot_id);
+    }
+  }
+  // Gone already. Without pidfds (ENOSYS) we fall back to kill().
+  else if(errno == ESRCH) {
+    ch->peer_dead = 1;
+  }
+#endif
+
+  errno = saved_errno;
+}
+
+int nbb_peer_fd()
+{
+  struct nbb_context* ctx = nbb_ctx();
+  sigset_t old;
+  int i;
+
+  if(ctx->peer_epoll_open) {
+    return ctx->peer_epoll_fd;
+  }
+
+#ifndef SYS_pidfd_open
+  PRINTF("! nbb_peer_fd(): no pidfd support\n");
+  return -1;
+#endif
+
+  ctx->peer_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if(ctx->peer_epoll_fd == -1) {
+    PRINTF("! nbb_peer_fd(): epoll_create1 failed, errno %d\n", errno);
+    return -1;
+  }
+
+  // No slot may get its pidfd between the scan and the flag
+  nbb_block_signal(&old);
+  for(i = NAMESERVER_SLOT + 1;i < SERVICE_MAX_CHANNELS;i++) {
+    if(ctx->channel_list[i].in_use && ctx->channel_list[i].peer_fd_open) {
+      nbb_add_peer_fd(ctx, i);
+    }
+  }
+  ctx->peer_epoll_open = 1;
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  return ctx->peer_epoll_fd;
+}
+
+static int nbb_peer_dead(struct nbb_context* ctx, int slot_id)
+{
+  struct channel* ch = &ctx->channel_list[slot_id];
+  int pid = ctx->connected_nodes[slot_id].pid;
+  struct pollfd pfd;
+
+  // Not in use, or a service's channel waiting for its next client
+  if(!ch->in_use || pid <= 0) {
+    return 0;
+  }
+
+  if(ch->peer_dead) {
+    return 1;
+  }
+
+  if(ch->peer_fd_open) {
+    pfd.fd = ch->peer_fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    return poll(&pfd, 1, 0) == 1;
+  }
+
+  return kill(pid, 0) == -1 && errno == ESRCH;
+}
+
+// A producer that died halfway through a write leaves the ring looking
+// busy forever. Roll back to its last complete message.
+static void nbb_abandon_producer(struct buffer* buf)
+{
+  int i;
+
+  if(buf->update_counter & 1) {
+    buf->update_counter = buf->last_update_counter;
+  }
+  buf->spill_state = 0;
+  for(i = 0;i < NBB_COALESCE_SLOTS;i++) {
+    __sync_bool_compare_and_swap(&buf->coalesce[i].state, NBB_SLOT_WRITING, NBB_SLOT_EMPTY);
+  }
+}
+
+// A service keeps its channels for the next client the nameserver hands
+// them to, once it has seen this one die. What the dead client left in
+// our rings is dropped when the next one announces itself, like on any
+// reused channel; what we left in its rings, when the next one opens them.
+static void nbb_reset_channel(struct nbb_context* ctx, int slot_id)
+{
+  struct channel* ch = &ctx->channel_list[slot_id];
+
+  if(ch->peer_fd_open) {
+    close(ch->peer_fd);
+    ch->peer_fd_open = 0;
+  }
+  ch->peer_dead = 0;
+
+  if(ch->write_spill) {
+    nbb_spill_release(ch);
+  }
+  // Nobody is going to end the client's spill, or remove its segment
+  if(ch->read_spill) {
+    nbb_shm_unmap(ch->read_spill, NBB_SEGMENT_SHM_SIZE(ch->read_spill->size));
+    ch->read_spill = NULL;
+  }
+  nbb_shm_unlink(ch->read_id + NBB_SPILL_ID_OFFSET);
+  ch->spill_reading = 0;
+  ch->spill_reserved = 0;
+
+  nbb_abandon_producer(ch->read);
+  if(ch->high_read) {
+    nbb_abandon_producer(ch->high_read);
+  }
+  ch->unsignalled = 0;
+
+  // The next client starts out with a small delay buffer again
+  free(ctx->delay_buffers[slot_id].content);
+  memset(&ctx->delay_buffers[slot_id], 0, sizeof(struct delay_buffer));
+  memset(&ctx->connected_nodes[slot_id], 0, sizeof(struct connected_node));
+
+  nbb_directory_detach(ctx, slot_id);
+}
+
+int nbb_reap_dead_peers()
+{
+  struct nbb_context* ctx = nbb_ctx();
+  cb_disconnect_func peer_gone;
+  sigset_t old;
+  int reaped = 0;
+  int i;
+
+  nbb_block_signal(&old);
+  for(i = NAMESERVER_SLOT + 1;i < SERVICE_MAX_CHANNELS;i++) {
+    if(!nbb_peer_dead(ctx, i)) {
+      continue;
+    }
+
+    PRINTF("***NBB***: Peer %d on slot %d is gone\n", ctx->connected_nodes[i].pid, i);
+    peer_gone = ctx->channel_list[i].peer_gone;
+
+    // Whatever it didn't read, or we didn't, is of no use to anybody
+    if(ctx->channel_list[i].is_creator) {
+      nbb_reset_channel(ctx, i);
+    }
+    else {
+      nbb_close_channel(i);
+    }
+
+    if(peer_gone != NULL) {
+      peer_gone(i);
+    }
+    reaped++;
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  return reaped;
+}
+
+static inline void nbb_cpu_relax()
+{
+#if defined(__i386__) || defined(__x86_64__)
+  __builtin_ia32_pause();
+#elif defined(__arm__) || defined(__aarch64__)
+  __asm__ __volatile__("yield" ::: "memory");
+#else
+  __sync_synchronize();
+#endif
+}
+
+int nbb_set_busy_poll(int slot_id, int enable)
+{
+  struct nbb_context* ctx = nbb_ctx();
+
+  assert(slot_id > NAMESERVER_SLOT && slot_id < SERVICE_MAX_CHANNELS);
+
+  if(!ctx->channel_list[slot_id].in_use) {
+    PRINTF("! nbb_set_busy_poll(): slot %d not in use\n", slot_id);
+    return -1;
+  }
+
+  // Stop the signal handler first, then the producers
+  ctx->channel_list[slot_id].busy_poll = enable;
+  __sync_synchronize();
+  ctx->channel_list[slot_id].read->reader_polls = enable;
+
+  // Producers didn't signal while we were polling, pick up what's left
+  if(!enable) {
+    __sync_synchronize();
+    raise(NBB_SIGNAL);
+  }
+
+  return 0;
+}
+
+void nbb_set_busy_poll_owner(const char* owner, int enable)
+{
+  struct nbb_context* ctx = nbb_ctx();
+  int i;
+
+  assert(owner != NULL);
+
+  for(i = 1;i < SERVICE_MAX_CHANNELS;i++) {
+    if(ctx->channel_list[i].in_use && ctx->channel_list[i].owner &&
+       !strcmp(owner, ctx->channel_list[i].owner)) {
+      nbb_set_busy_poll(i, enable);
+    }
+  }
+}
+
+int nbb_poll_loop(int spin_budget, int cpu, volatile int* stop)
+{
+  struct nbb_context* ctx = nbb_ctx();
+  int idle = 0;
+  int i;
+  int got;
+
+  assert(stop != NULL && spin_budget >= 0);
+
+  if(cpu >= 0) {
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if(sched_setaffinity(0, sizeof(set), &set) == -1) {
+      PRINTF("! nbb_poll_loop(): can't pin to cpu %d\n", cpu);
+      return -1;
+    }
+  }
+
+  while(!*stop) {
+    got = 0;
+    for(i = 1;i < SERVICE_MAX_CHANNELS;i++) {
+      if(ctx->channel_list[i].in_use && ctx->channel_list[i].busy_poll &&
+         nbb_slot_pending(&ctx->channel_list[i])) {
+        got += nbb_recv_slot(ctx, i, ctx->poll_buffer, signal_handler_buffer_size - 1);
+      }
+    }
+
+    if(got) {
+      idle = 0;
+    }
+    else if(idle < spin_budget) {
+      idle++;
+      nbb_cpu_relax();
+    }
+    else {
+      // Out of budget, let whoever shares the cpu run
+      sched_yield();
+    }
+  }
+
+  return 0;
+}
+
+// POSIX shm backend. Segment |shm_id| (a channel id, or one of the
+// NAMESERVER_* ids) lives in /dev/shm under NBB_SHM_PREFIX<shm_id>.
+static int shm_flags = NBB_SHM_POPULATE;
+static int ring_format = NBB_RING_ITEMS;
+
+void nbb_set_shm_flags(int flags)
+{
+  shm_flags = flags;
+}
+
+void nbb_set_ring_format(int format)
+{
+  assert(format == NBB_RING_ITEMS || format == NBB_RING_CELLS);
+  ring_format = format;
+}
+
+static void nbb_shm_name(int shm_id, char* name)
+{
+  sprintf(name, "%s%d", NBB_SHM_PREFIX, shm_id);
+}
+
+// The creator always gets a fresh, zeroed object: a stale one left by a
+// crashed process is unlinked first, and whoever still maps it keeps
+// their own copy. Returns NULL if the segment doesn't exist (attach) or
+// can't be created. Attaching with a *|size| of 0 maps the whole segment
+// and returns its size there.
+static void* nbb_shm_map_flags(int shm_id, size_t* size, int is_ipc_create, int flags)
+{
+  char name[sizeof(NBB_SHM_PREFIX) + 12];
+  int fd;
+  int mmap_flags = MAP_SHARED;
+  struct stat st;
+  void* shm;
+
+  nbb_shm_name(shm_id, name);
+
+  if(is_ipc_create) {
+    shm_unlink(name);
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0666);
+    if(fd >= 0 && ftruncate(fd, *size) == -1) {
+      close(fd);
+      shm_unlink(name);
+      fd = -1;
+    }
+  }
+  else {
+    fd = shm_open(name, O_RDWR, 0);
+  }
+
+  if(fd < 0) {
+    PRINTF("! nbb_shm_map(): shm_open %s\n", name);
+    return NULL;
+  }
+
+  if(*size == 0) {
+    // Not even its header yet if the creator hasn't sized it
+    if(fstat(fd, &st) == -1 || st.st_size < PAGE_SIZE) {
+      PRINTF("! nbb_shm_map(): can't size %s\n", name);
+      close(fd);
+      return NULL;
+    }
+    *size = st.st_size;
+  }
+
+#ifdef MAP_POPULATE
+  if(flags & NBB_SHM_POPULATE) {
+    mmap_flags |= MAP_POPULATE;
+  }
+#endif
+
+  shm = mmap(NULL, *size, PROT_READ | PROT_WRITE, mmap_flags, fd, 0);
+  close(fd);
+
+  if(shm == MAP_FAILED) {
+    PRINTF("! nbb_shm_map(): mmap %s\n", name);
+    return NULL;
+  }
+
+#ifdef MADV_HUGEPAGE
+  // Only worth it for segments spanning whole huge pages, and only takes
+  // effect with /sys/kernel/mm/transparent_hugepage/shmem_enabled=advise
+  if((flags & NBB_SHM_HUGEPAGE) && *size >= NBB_HUGEPAGE_SIZE) {
+    madvise(shm, *size, MADV_HUGEPAGE);
+  }
+#endif
+
+  return shm;
+}
+
+void* nbb_shm_map(int shm_id, size_t size, int is_ipc_create)
+{
+  return nbb_shm_map_flags(shm_id, &size, is_ipc_create, shm_flags);
+}
+
+void nbb_shm_unmap(void* shm, size_t size)
+{
+  munmap(shm, size);
+}
+
+int nbb_shm_unlink(int shm_id)
+{
+  char name[sizeof(NBB_SHM_PREFIX) + 12];
+
+  nbb_shm_name(shm_id, name);
+  return shm_unlink(name);
+}
+
+// Map one direction of a channel.
+//
+// The creator (the service, at nbb_init_service() time) zeroes the whole
+// segment, which also pre-faults every page, fills in the header and
+// publishes it with the magic. Everybody else just attaches to the
+// already-initialized segment and must not write to it, or it would
+// clobber what the other side already wrote.
+static struct buffer* nbb_map_buffer(int shm_id, int is_ipc_create, int format)
+{
+  unsigned char* shm;
+  struct buffer* buf;
+
+  if((shm = (unsigned char*) nbb_shm_map(shm_id, NBB_BUFFER_SHM_SIZE, is_ipc_create)) == NULL) {
+    return NULL;
+  }
+
+  buf = (struct buffer*) shm;
+
+  if(is_ipc_create) {
+    // Fresh objects are zero'd out already, touch them to fault them in
+    memset(shm, 0, NBB_BUFFER_SHM_SIZE);
+    buf->data_size = PAGE_SIZE;
+    buf->data_offset = PAGE_SIZE;
+    buf->format = format;
+    __sync_synchronize();
+    buf->magic = NBB_BUFFER_MAGIC;
+  }
+  else if(buf->magic != NBB_BUFFER_MAGIC) {
+    PRINTF("! nbb_map_buffer(): segment %d not initialized\n", shm_id);
+    nbb_shm_unmap(shm, NBB_BUFFER_SHM_SIZE);
+    return NULL;
+  }
+
+  return buf;
+}
+
+// Data size of a bulk arena or spill segment we create, |default_size|
+// unless huge pages were asked for. Both must be powers of two.
+static size_t nbb_segment_data_size(size_t default_size)
+{
+  return (shm_flags & NBB_SHM_HUGEPAGE) ? NBB_HUGEPAGE_SIZE : default_size;
+}
+
+// Map the bulk arena that goes with ring |shm_id|. Same rules as
+// nbb_map_buffer(), except that it's never pre-faulted: most channels never
+// carry a bulk payload, and tmpfs only backs the pages that get written.
+static struct bulk_arena* nbb_map_bulk(int shm_id, int is_ipc_create)
+{
+  struct bulk_arena* arena;
+  size_t data_size = nbb_segment_data_size(NBB_BULK_ARENA_SIZE);
+  size_t size = is_ipc_create ? NBB_SEGMENT_SHM_SIZE(data_size) : 0;
+
+  arena = (struct bulk_arena*) nbb_shm_map_flags(shm_id + NBB_BULK_ID_OFFSET,
+      &size, is_ipc_create, shm_flags & ~NBB_SHM_POPULATE);
+  if(arena == NULL) {
+    return NULL;
+  }
+
+  if(is_ipc_create) {
+    arena->size = data_size;
+    __sync_synchronize();
+    arena->magic = NBB_BULK_MAGIC;
+  }
+  else if(arena->magic != NBB_BULK_MAGIC || NBB_SEGMENT_SHM_SIZE(arena->size) != size) {
+    PRINTF("! nbb_map_bulk(): arena %d not initialized\n", shm_id);
+    nbb_shm_unmap(arena, size);
+    return NULL;
+  }
+
+  return arena;
+}
+
+static inline unsigned char* nbb_bulk_data(struct bulk_arena* arena)
+{
+  return (unsigned char*) arena + PAGE_SIZE;
+}
+
+// Map the spill segment of ring |shm_id|. Created by the producer when the
+// ring fills up, attached by the consumer when it gets there.
+static struct spill_ring* nbb_map_spill(int shm_id, int is_ipc_create)
+{
+  struct spill_ring* spill;
+  size_t data_size = nbb_segment_data_size(NBB_SPILL_SIZE);
+  size_t size = is_ipc_create ? NBB_SEGMENT_SHM_SIZE(data_size) : 0;
+
+  spill = (struct spill_ring*) nbb_shm_map_flags(shm_id + NBB_SPILL_ID_OFFSET,
+      &size, is_ipc_create, shm_flags & ~NBB_SHM_POPULATE);
+  if(spill == NULL) {
+    return NULL;
+  }
+
+  if(is_ipc_create) {
+    spill->size = data_size;
+    __sync_synchronize();
+    spill->magic = NBB_SPILL_MAGIC;
+  }
+  else if(spill->magic != NBB_SPILL_MAGIC || NBB_SEGMENT_SHM_SIZE(spill->size) != size) {
+    PRINTF("! nbb_map_spill(): segment %d not initialized\n", shm_id);
+    nbb_shm_unmap(spill, size);
+    return NULL;
+  }
+
+  return spill;
+}
+
+static inline unsigned char* nbb_spill_data(struct spill_ring* spill)
+{
+  return (unsigned char*) spill + PAGE_SIZE;
+}
+
+// Unmap everything nbb_open_channel() mapped into |ch|, NULLs are skipped
+static void nbb_unmap_channel(struct channel* ch)
+{
+  if(ch->read) {
+    nbb_shm_unmap(ch->read, NBB_BUFFER_SHM_SIZE);
+  }
+  if(ch->write) {
+    nbb_shm_unmap(ch->write, NBB_BUFFER_SHM_SIZE);
+  }
+  if(ch->high_read) {
+    nbb_shm_unmap(ch->high_read, NBB_BUFFER_SHM_SIZE);
+  }
+  if(ch->high_write) {
+    nbb_shm_unmap(ch->high_write, NBB_BUFFER_SHM_SIZE);
+  }
+  if(ch->read_bulk) {
+    nbb_shm_unmap(ch->read_bulk, NBB_SEGMENT_SHM_SIZE(ch->read_bulk->size));
+  }
+  if(ch->write_bulk) {
+    nbb_shm_unmap(ch->write_bulk, NBB_SEGMENT_SHM_SIZE(ch->write_bulk->size));
+  }
+  if(ch->read_spill) {
+    nbb_shm_unmap(ch->read_spill, NBB_SEGMENT_SHM_SIZE(ch->read_spill->size));
+  }
+  if(ch->write_spill) {
+    nbb_shm_unmap(ch->write_spill, NBB_SEGMENT_SHM_SIZE(ch->write_spill->size));
+  }
+}
+
+static int nbb_unlink_channel(int shm_read_id, int shm_write_id)
+{
+  int ret = 0;
+
+  ret |= nbb_shm_unlink(shm_read_id);
+  ret |= nbb_shm_unlink(shm_write_id);
+  // The nameserver channel has neither, these just fail there
+  nbb_shm_unlink(shm_read_id + NBB_HIGH_ID_OFFSET);
+  nbb_shm_unlink(shm_write_id + NBB_HIGH_ID_OFFSET);
+  nbb_shm_unlink(shm_read_id + NBB_BULK_ID_OFFSET);
+  nbb_shm_unlink(shm_write_id + NBB_BULK_ID_OFFSET);
+  // Only there while a spill segment is linked in
+  nbb_shm_unlink(shm_read_id + NBB_SPILL_ID_OFFSET);
+  nbb_shm_unlink(shm_write_id + NBB_SPILL_ID_OFFSET);
+
+  return ret ? -1 : 0;
+}
+
+// Map both directions of every lane and the bulk arenas into |ch|.
+// The nameserver channel only has the plain rings.
+static int nbb_map_channel(struct channel* ch, int shm_read_id, int shm_write_id,
+                           int is_ipc_create, int is_nameserver)
+{
+	// note that we use SERVICE_TEST_WRITE, not READ, since the service's
+	// read is the client's write
+  int format = is_nameserver ? NBB_RING_ITEMS : ring_format;
+
+  if((ch->read = nbb_map_buffer(shm_read_id, is_ipc_create, format)) == NULL ||
+     (ch->write = nbb_map_buffer(shm_write_id, is_ipc_create, format)) == NULL) {
+    return -1;
+  }
+
+  if(is_nameserver) {
+    return 0;
+  }
+
+  if((ch->high_read = nbb_map_buffer(shm_read_id + NBB_HIGH_ID_OFFSET, is_ipc_create, format)) == NULL ||
+     (ch->high_write = nbb_map_buffer(shm_write_id + NBB_HIGH_ID_OFFSET, is_ipc_create, format)) == NULL ||
+     (ch->read_bulk = nbb_map_bulk(shm_read_id, is_ipc_create)) == NULL ||
+     (ch->write_bulk = nbb_map_bulk(shm_write_id, is_ipc_create)) == NULL) {
+    return -1;
+  }
+
+  return 0;
+}
+
+// A reused channel may still hold items for whoever had it before us.
+// Skip them; the ack counters and the arena's tail are ours to move as
+// the consumer.
+static void nbb_skip_stale_items(struct buffer* buf)
+{
+  int i;
+
+  if(!(buf->last_update_counter & 1)) {
+    buf->ack_counter = buf->last_update_counter;
+    buf->last_ack_counter = buf->last_update_counter;
+  }
+  if(buf->format == NBB_RING_CELLS) {
+    nbb_cell_release(buf, (unsigned char*) buf + buf->data_offset, buf->cell_tail,
+                     buf->cell_head - buf->cell_tail);
+  }
+  buf->cell_tail = buf->cell_head;
+  buf->recv_msgs = buf->sent_msgs;
+  buf->recv_bytes = buf->sent_bytes;
+  buf->spill_state = 0;
+  for(i = 0;i < NBB_COALESCE_SLOTS;i++) {
+    buf->coalesce[i].state = NBB_SLOT_EMPTY;
+  }
+}
+
+int nbb_open_channel(const char* owner, int shm_read_id, int shm_write_id, int is_ipc_create)
+{
+  struct nbb_context* ctx = nbb_ctx();
+  int free_slot;
+  struct channel ch;
+
+  if((shm_read_id == NAMESERVER_WRITE && shm_write_id == NAMESERVER_READ) ||
+     (shm_read_id == NAMESERVER_READ && shm_write_id == NAMESERVER_WRITE)) {
+    free_slot = NAMESERVER_SLOT;
+  }
+  else {
+    free_slot = nbb_free_channel_slot();
+  }
+
+  if(free_slot == -1) {
+	  PRINTF("! nbb_open_channel(): no free_slot\n");
+    return -1;
+  }
+
+  memset(&ch, 0, sizeof(ch));
+  if(nbb_map_channel(&ch, shm_read_id, shm_write_id, is_ipc_create,
+                     free_slot == NAMESERVER_SLOT)) {
+    nbb_unmap_channel(&ch);
+    if(is_ipc_create) {
+      nbb_unlink_channel(shm_read_id, shm_write_id);
+    }
+    return -1;
+  }
+
+  if(!is_ipc_create) {
+    nbb_skip_stale_items(ch.read);
+    if(ch.high_read) {
+      nbb_skip_stale_items(ch.high_read);
+    }
+    if(ch.read_bulk) {
+      ch.read_bulk->tail = ch.read_bulk->head;
+    }
+  }
+
+  // The nameserver's buffers are shared by every client, so it keeps
+  // getting process-wide signals. Everybody else names the reading thread.
+  // Producers look at the bulk lane's ring only.
+  if(free_slot != NAMESERVER_SLOT) {
+    ch.read->reader_tid = nbb_gettid();
+    ch.read->reader_slot = free_slot;
+    ch.read->reader_polls = 0;
+  }
+
+	ch.read_data = (unsigned char*) ch.read + ch.read->data_offset;
+  ch.read_id = shm_read_id;
+
+	ch.write_data = (unsigned char*) ch.write + ch.write->data_offset;
+  ch.write_id = shm_write_id;
+
+  if(ch.high_read) {
+    ch.high_read_data = (unsigned char*) ch.high_read + ch.high_read->data_offset;
+    ch.high_write_data = (unsigned char*) ch.high_write + ch.high_write->data_offset;
+  }
+
+  ch.in_use = 1;
+  ch.is_creator = (is_ipc_create != 0);
+
+  if(owner) {
+    ch.owner = (char*) malloc(strlen(owner) + 1);
+    strcpy(ch.owner, owner);
+  }
+
+  ctx->channel_list[free_slot] = ch;
+  nbb_record_open();
+
+  memset(&ctx->delay_buffers[free_slot], 0, sizeof(struct delay_buffer));
+  ctx->delay_buffers[free_slot].content = (char*) calloc(1<<20, sizeof(char));
+  assert(ctx->delay_buffers[free_slot].content);
+  ctx->delay_buffers[free_slot].capacity = 1<<20;
+
+  return free_slot;
+}
+
+int nbb_close_channel(int index)
+{
+  struct nbb_context* ctx = nbb_ctx();
+  int ret = 0;
+
+  assert(index >= 0 && index < SERVICE_MAX_CHANNELS);
+
+  if(!ctx->channel_list[index].in_use) {
+    return -1;
+  }
+
+  // Let the next client have this channel
+  if(ctx->channel_list[index].claimed_channel) {
+    nbb_directory_release(ctx->connected_nodes[index].name, ctx->channel_list[index].claimed_channel);
+    ctx->channel_list[index].claimed_channel = 0;
+  }
+
+  // Our spill segment is ours to remove, whoever created the channel
+  if(ctx->channel_list[index].write_spill) {
+    nbb_shm_unlink(ctx->channel_list[index].write_id + NBB_SPILL_ID_OFFSET);
+  }
+  if(ctx->channel_list[index].peer_fd_open) {
+    close(ctx->channel_list[index].peer_fd);
+  }
+
+  nbb_unmap_channel(&ctx->channel_list[index]);
+
+  // Segments belong to whoever created them (the service). The memory
+  // itself goes away once the peer unmaps too.
+  if(ctx->channel_list[index].is_creator) {
+    ret = nbb_unlink_channel(ctx->channel_list[index].read_id,
+                             ctx->channel_list[index].write_id);
+  }
+
+  free(ctx->channel_list[index].owner);
+  memset(&ctx->channel_list[index], 0, sizeof(struct channel));
+
+  free(ctx->delay_buffers[index].content);
+  memset(&ctx->delay_buffers[index], 0, sizeof(struct delay_buffer));
+  memset(&ctx->connected_nodes[index], 0, sizeof(struct connected_node));
+
+  return ret;
+}
+
+int nbb_free_channel_slot()
+{
+  struct nbb_context* ctx = nbb_ctx();
+  int i;
+
+  // Slot 0 is reserved for the nameserver, even if we never talk to it
+  for(i = NAMESERVER_SLOT + 1;i < SERVICE_MAX_CHANNELS;i++) {
+    if(!ctx->channel_list[i].in_use) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+/* Reads as many bytes up to size as are available
+ * Return value is the number of bytes read.
+ */
+int nbb_read_bytes(int slot, char* buf, int size)
+{
+  struct nbb_context* ctx = nbb_ctx();
+  assert(slot >= 0 && buf != NULL && size >= 0);
+
+  delay_buffer_t* delay_buffer = &(ctx->delay_buffers[slot]);
+  assert(delay_buffer->capacity >= delay_buffer->len);
+
+  // Attempt to read 0 bytes or buffer has nothing to read
+  if (size == 0 || delay_buffer->content == NULL || delay_buffer->len == 0) {
+    return 0;
+  }
+
+  // Read minimum of the requested length and available data
+  if(size > delay_buffer->len) {
+    size = delay_buffer->len;
+  }
+
+  // Read |size| bytes into |buf| and update statistics
+  nbb_copy(buf, delay_buffer->content, size);
+  ctx->channel_list[slot].read_count += size;
+
+  // Move remaining data (if any) into the front of buffer
+  int new_len = delay_buffer->len - size;
+  if (new_len > 0) {
+    memmove(delay_buffer->content, delay_buffer->content + size, new_len);
+  }
+  delay_buffer->len = new_len;
+
+  return size;
+}
+
+int nbb_bytes_available(int slot)
+{
+  struct nbb_context* ctx = nbb_ctx();
+  assert(slot >= 0 && slot < SERVICE_MAX_CHANNELS);
+  return ctx->delay_buffers[slot].len;
+}
+
+int nbb_bytes_read(int slot)
+{
+  struct nbb_context* ctx = nbb_ctx();
+  assert(slot >= 0 && slot < SERVICE_MAX_CHANNELS);
+  return ctx->channel_list[slot].read_count;
+}
+
+int nbb_bytes_written(int slot)
+{
+  struct nbb_context* ctx = nbb_ctx();
+  assert(slot >= 0 && slot < SERVICE_MAX_CHANNELS);
+  return ctx->channel_list[slot].write_count;
+}
+
+// Room left in |buf| for normal writes. Item rings can't say how
+// fragmented their data region is, so this may be more than fits in one
+// message; cell rings count whole cells.
+static unsigned int nbb_ring_room(struct buffer* buf)
+{
+  unsigned int used;
+
+  if(buf->format == NBB_RING_CELLS) {
+    used = buf->cell_head - buf->cell_tail;
+    return used < (unsigned int) NBB_NUM_CELLS(buf) ?
+           (NBB_NUM_CELLS(buf) - used) * NBB_CELL_SIZE : 0;
+  }
+
+  if(nbb_ring_full(buf)) {
+    return 0;
+  }
+  used = buf->sent_bytes - buf->recv_bytes;
+  return used < buf->data_size ? buf->data_size - used : 0;
+}
+
+int nbb_get_credit(int slot_id, struct nbb_credit* credit)
+{
+  struct nbb_context* ctx = nbb_ctx();
+  assert(slot_id > NAMESERVER_SLOT && slot_id < SERVICE_MAX_CHANNELS);
+  assert(credit != NULL);
+
+  struct channel* ch = &ctx->channel_list[slot_id];
+  struct buffer* buf = ch->write;
+
+  if(!ch->in_use) {
+    return -1;
+  }
+
+  credit->pending_msgs = buf->sent_msgs - buf->recv_msgs;
+  credit->pending_bytes = buf->sent_bytes - buf->recv_bytes;
+  credit->progress = buf->recv_msgs;
+  // Nothing goes to the ring while a spill segment is in use
+  credit->room = ch->write_spill && !ch->spill_draining ? 0 : nbb_ring_room(buf);
+
+  if(ch->high_write) {
+    credit->pending_msgs += ch->high_write->sent_msgs - ch->high_write->recv_msgs;
+    credit->pending_bytes += ch->high_write->sent_bytes - ch->high_write->recv_bytes;
+    credit->progress += ch->high_write->recv_msgs;
+  }
+  if(ch->write_spill) {
+    credit->pending_bytes += ch->write_spill->head - ch->write_spill->tail;
+    credit->progress += ch->write_spill->tail;
+  }
+  if(ch->write_bulk) {
+    credit->pending_bytes += ch->write_bulk->head - ch->write_bulk->tail;
+  }
+
+  return 0;
+}
+
+void nbb_flush_shm(int slot, char* array_to_flush, int size)
+{
+  struct nbb_context* ctx = nbb_ctx();
+  assert(slot >= 0 && slot < SERVICE_MAX_CHANNELS);
+  assert(array_to_flush != NULL && size >= 0);
+
+  if (size == 0)
+    return;
+
+  delay_buffer_t* buffer = &(ctx->delay_buffers[slot]);
+
+  // Read in place, see nbb_recv_target()
+  if (array_to_flush == buffer->content + buffer->len) {
+    buffer->len += size;
+    return;
+  }
+
+  nbb_delay_reserve(buffer, size);
+
+  // Append new data to the end (or beginning if it's the first flush)
+  nbb_copy(buffer->content + buffer->len, array_to_flush, size);
+  buffer->len += size;
+}
+
+// Make room for |size| more bytes at the end of |buffer|
+static void nbb_delay_reserve(delay_buffer_t* buffer, int size)
+{
+  int new_size = buffer->len + size;
+
+  // Grow the buffer if exceeding current capacity
+  if (new_size > buffer->capacity) {
+    // Initial capacity (2 * MAX_MSG_LEN)
+    if (buffer->capacity == 0) {
+      buffer->capacity = MAX_MSG_LEN;
+    }
+    int new_buffer_capacity = 2 * buffer->capacity < new_size ?
+        new_size :
+        2 * buffer->capacity;
+
+    buffer->content = (char *) realloc(buffer->content, new_buffer_capacity);
+    buffer->capacity = new_buffer_capacity;
+  }
+}
+
+// Copy kernels, see nbb_copy() in nbb.h
+static void nbb_copy_plain(void* dst, const void* src, size_t size)
+{
+  memcpy(dst, src, size);
+}
+
+// Up to NBB_COPY_INLINE_MAX bytes. Overlapping moves from both ends cover
+// every length with a couple of loads and stores and no loop.
+static inline void nbb_copy_small(void* dst, const void* src, size_t size)
+{
+  unsigned char* d = (unsigned char*) dst;
+  const unsigned char* s = (const unsigned char*) src;
+
+  if(size >= 32) {
+    uint64_t a, b, c, e, f, g, h, i;
+    memcpy(&a, s, 8); memcpy(&b, s + 8, 8); memcpy(&c, s + 16, 8); memcpy(&e, s + 24, 8);
+    memcpy(&f, s + size - 32, 8); memcpy(&g, s + size - 24, 8);
+    memcpy(&h, s + size - 16, 8); memcpy(&i, s + size - 8, 8);
+    memcpy(d, &a, 8); memcpy(d + 8, &b, 8); memcpy(d + 16, &c, 8); memcpy(d + 24, &e, 8);
+    memcpy(d + size - 32, &f, 8); memcpy(d + size - 24, &g, 8);
+    memcpy(d + size - 16, &h, 8); memcpy(d + size - 8, &i, 8);
+  }
+  else if(size >= 8) {
+    uint64_t a, b, c, e;
+    memcpy(&a, s, 8); memcpy(&b, s + (size >= 16 ? 8 : size - 8), 8);
+    memcpy(&c, s + (size >= 16 ? size - 16 : 0), 8); memcpy(&e, s + size - 8, 8);
+    memcpy(d, &a, 8); memcpy(d + (size >= 16 ? 8 : size - 8), &b, 8);
+    memcpy(d + (size >= 16 ? size - 16 : 0), &c, 8); memcpy(d + size - 8, &e, 8);
+  }
+  else if(size >= 4) {
+    uint32_t a, b;
+    memcpy(&a, s, 4); memcpy(&b, s + size - 4, 4);
+    memcpy(d, &a, 4); memcpy(d + size - 4, &b, 4);
+  }
+  else {
+    while(size--) {
+      *d++ = *s++;
+    }
+  }
+}
+
+#if defined(__i386__) || defined(__x86_64__)
+// Tails of the streaming copies
+__attribute__((target("sse2")))
+static void nbb_copy_sse2(void* dst, const void* src, size_t size)
+{
+  unsigned char* d = (unsigned char*) dst;
+  const unsigned char* s = (const unsigned char*) src;
+  size_t i;
+
+  for(i = 0;i + 64 <= size;i += 64) {
+    __m128i a = _mm_loadu_si128((const __m128i*) (s + i));
+    __m128i b = _mm_loadu_si128((const __m128i*) (s + i + 16));
+    __m128i c = _mm_loadu_si128((const __m128i*) (s + i + 32));
+    __m128i e = _mm_loadu_si128((const __m128i*) (s + i + 48));
+    _mm_storeu_si128((__m128i*) (d + i), a);
+    _mm_storeu_si128((__m128i*) (d + i + 16), b);
+    _mm_storeu_si128((__m128i*) (d + i + 32), c);
+    _mm_storeu_si128((__m128i*) (d + i + 48), e);
+  }
+  nbb_copy_small(d + i, s + i, size - i);
+}
+
+__attribute__((target("avx2")))
+static void nbb_copy_avx2(void* dst, const void* src, size_t size)
+{
+  unsigned char* d = (unsigned char*) dst;
+  const unsigned char* s = (const unsigned char*) src;
+  size_t i;
+
+  for(i = 0;i + 128 <= size;i += 128) {
+    __m256i a = _mm256_loadu_si256((const __m256i*) (s + i));
+    __m256i b = _mm256_loadu_si256((const __m256i*) (s + i + 32));
+    __m256i c = _mm256_loadu_si256((const __m256i*) (s + i + 64));
+    __m256i e = _mm256_loadu_si256((const __m256i*) (s + i + 96));
+    _mm256_storeu_si256((__m256i*) (d + i), a);
+    _mm256_storeu_si256((__m256i*) (d + i + 32), b);
+    _mm256_storeu_si256((__m256i*) (d + i + 64), c);
+    _mm256_storeu_si256((__m256i*) (d + i + 96), e);
+  }
+  nbb_copy_sse2(d + i, s + i, size - i);
+}
+
+// Non-temporal stores need an aligned destination: copy up to the first
+// 16-byte boundary normally, stream the bulk, then copy the tail.
+__attribute__((target("sse2")))
+static void nbb_copy_stream_sse2(void* dst, const void* src, size_t size)
+{
+  unsigned char* d = (unsigned char*) dst;
+  const unsigned char* s = (const unsigned char*) src;
+  size_t head = (16 - ((uintptr_t) d & 15)) & 15;
+  size_t i;
+
+  nbb_copy_small(d, s, head);
+  for(i = head;i + 64 <= size;i += 64) {
+    __m128i a = _mm_loadu_si128((const __m128i*) (s + i));
+    __m128i b = _mm_loadu_si128((const __m128i*) (s + i + 16));
+    __m128i c = _mm_loadu_si128((const __m128i*) (s + i + 32));
+    __m128i e = _mm_loadu_si128((const __m128i*) (s + i + 48));
+    _mm_stream_si128((__m128i*) (d + i), a);
+    _mm_stream_si128((__m128i*) (d + i + 16), b);
+    _mm_stream_si128((__m128i*) (d + i + 32), c);
+    _mm_stream_si128((__m128i*) (d + i + 48), e);
+  }
+  nbb_copy_sse2(d + i, s + i, size - i);
+  // Streaming stores aren't ordered with the counter stores that publish them
+  _mm_sfence();
+}
+
+__attribute__((target("avx2")))
+static void nbb_copy_stream_avx2(void* dst, const void* src, size_t size)
+{
+  unsigned char* d = (unsigned char*) dst;
+  const unsigned char* s = (const unsigned char*) src;
+  size_t head = (32 - ((uintptr_t) d & 31)) & 31;
+  size_t i;
+
+  nbb_copy_small(d, s, head);
+  for(i = head;i + 128 <= size;i += 128) {
+    __m256i a = _mm256_loadu_si256((const __m256i*) (s + i));
+    __m256i b = _mm256_loadu_si256((const __m256i*) (s + i + 32));
+    __m256i c = _mm256_loadu_si256((const __m256i*) (s + i + 64));
+    __m256i e = _mm256_loadu_si256((const __m256i*) (s + i + 96));
+    _mm256_stream_si256((__m256i*) (d + i), a);
+    _mm256_stream_si256((__m256i*) (d + i + 32), b);
+    _mm256_stream_si256((__m256i*) (d + i + 64), c);
+    _mm256_stream_si256((__m256i*) (d + i + 96), e);
+  }
+  nbb_copy_avx2(d + i, s + i, size - i);
+  _mm_sfence();
+}
+#endif
+
+enum {
+  COPY_UNINITIALIZED = 0,
+  COPY_PLAIN,
+  COPY_KERNELS,
+};
+static volatile int copy_mode = COPY_UNINITIALIZED;
+static void (*copy_stream)(void*, const void*, size_t) = nbb_copy_plain;
+
+// Runs on the first copy. Racing callers pick the same kernels, and only
+// look at the pointers once the mode says they're set.
+static void nbb_copy_init()
+{
+  const char* mode = getenv("NBB_COPY");
+
+  if(mode && !strcmp(mode, "memcpy")) {
+    copy_mode = COPY_PLAIN;
+    return;
+  }
+
+#if defined(__i386__) || defined(__x86_64__)
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2")) {
+    copy_stream = nbb_copy_stream_avx2;
+  }
+  else if(__builtin_cpu_supports("sse2")) {
+    copy_stream = nbb_copy_stream_sse2;
+  }
+#endif
+  __sync_synchronize();
+  copy_mode = COPY_KERNELS;
+}
+
+void nbb_copy(void* dst, const void* src, size_t size)
+{
+  if(copy_mode == COPY_UNINITIALIZED) {
+    nbb_copy_init();
+  }
+  if(copy_mode == COPY_PLAIN) {
+    memcpy(dst, src, size);
+  }
+  else if(size <= NBB_COPY_INLINE_MAX) {
+    nbb_copy_small(dst, src, size);
+  }
+  else {
+    // glibc already picks an SSE2/AVX2/ERMS memcpy for this cpu
+    memcpy(dst, src, size);
+  }
+}
+
+void nbb_copy_to_shm(void* dst, const void* src, size_t size)
 {
-  assert(slot_id >= 0 && slot_id < SERVICE_MAX_CHANNELS && "Invalid slot id");
-  assert(owner != NULL && "Invalid owner");
-
-  if (channel_list[slot_id].owner != NULL) {
-    free(channel_list[slot_id].owner);
+  if(copy_mode == COPY_UNINITIALIZED) {
+    nbb_copy_init();
   }
+  if(copy_mode == COPY_KERNELS && size >= NBB_COPY_STREAM_MIN) {
+    copy_stream(dst, src, size);
+  }
+  else {
+    nbb_copy(dst, src, size);
+  }
+}
 
-  channel_list[slot_id].owner = (char *) malloc(sizeof(char) * (strlen(owner) + 1));
-  assert(channel_list[slot_id].owner != NULL && "malloc failed");
-
-  strcpy(channel_list[slot_id].owner, owner);
-  PRINTF("***nbb_change_owner***: Changed owner for slot %d to '%s'\n", slot_id, owner);
+static struct buffer* nbb_write_ring(struct channel* ch, int lane, unsigned char** data_buf)
+{
+  if(lane == NBB_LANE_HIGH && ch->high_write) {
+    *data_buf = ch->high_write_data;
+    return ch->high_write;
+  }
+  *data_buf = ch->write_data;
+  return ch->write;
 }
 
-int nbb_write_bytes(int slot_id, const char* msg, size_t msg_len)
+// Elastic channels, producer side. The ring's write position when a spill
+// segment is linked in marks where the consumer switches over to it, and
+// an end marker in the segment where it switches back. Nothing goes to the
+// ring in between, so both together stay in order.
+
+// Room for a record of |size| bytes in our spill segment, NULL if it's
+// full. nbb_spill_commit() publishes it.
+static unsigned char* nbb_spill_alloc(struct channel* ch, size_t size)
 {
-  assert(msg != NULL);
+  struct spill_ring* spill = ch->write_spill;
+  unsigned int head = spill->head;
+  unsigned int pos = head & (spill->size - 1);
+  unsigned int need = NBB_SPILL_RECORD_SIZE(size);
+  unsigned int skip = 0;
+
+  if(pos + need > spill->size) {
+    skip = spill->size - pos;
+  }
 
-  if (msg_len == 0) {
-    PRINTF("! nbb_send(): nothing to send (0 length passed in)\n");
-    return 0;
+  if(spill->size - (head - spill->tail) < skip + need) {
+    return NULL;
   }
 
-  assert(slot_id >= 0 && slot_id < SERVICE_MAX_CHANNELS && "Process not found");
+  // Records never wrap, the consumer skips to the start instead
+  if(skip) {
+    struct spill_record* pad = (struct spill_record*) (nbb_spill_data(spill) + pos);
 
-  int ret;
-  ret = nbb_insert_item(slot_id, msg, msg_len);
-  if(ret == OK) {
-    kill(connected_nodes[slot_id].pid, NBB_SIGNAL);
-  } else {
-      return ret;
+    pad->size = 0;
+    pad->flags = NBB_ITEM_PAD;
   }
 
-  return 0;
+  ch->spill_at = head + skip;
+  return nbb_spill_data(spill) + (ch->spill_at & (spill->size - 1)) + sizeof(struct spill_record);
 }
 
-int nbb_send(const char* destination, const char* msg, size_t msg_len)
+static void nbb_spill_commit(struct channel* ch, size_t size, unsigned short flags)
 {
-  int i;
+  struct spill_ring* spill = ch->write_spill;
+  struct spill_record* rec =
+      (struct spill_record*) (nbb_spill_data(spill) + (ch->spill_at & (spill->size - 1)));
+
+  rec->size = size;
+  rec->flags = flags;
+  __sync_synchronize();
+  spill->head = ch->spill_at + NBB_SPILL_RECORD_SIZE(size);
+}
 
-  // Since i = 0 is already reserved for nameserver
-  for(i = 1; i < SERVICE_MAX_CHANNELS;i++) {
-    if(channel_list[i].in_use && connected_nodes[i].name &&
-       !strcmp(destination, connected_nodes[i].name)) {
-      break;
-    }
+static int nbb_spill_insert(struct channel* ch, const void* ptr_to_item, size_t size,
+                            unsigned short flags)
+{
+  unsigned char* dst = nbb_spill_alloc(ch, size);
+
+  if(dst == NULL) {
+    return BUFFER_FULL;
   }
+  nbb_copy_to_shm(dst, ptr_to_item, size);
+  nbb_spill_commit(ch, size, flags);
 
-  return nbb_write_bytes(i, msg, msg_len);
+  return OK;
 }
 
-/* Called when the service gets new client data */
-void nbb_recv_data(int signum)
+static void* nbb_spill_reserve(struct channel* ch, size_t size)
 {
-  int i;
-  char* recv = signal_handler_buffer;
-  size_t recv_max_len = signal_handler_buffer_size;
-  size_t recv_len = 0;
-  int retval = -1;
-  int is_new_conn_msg = 0;
-
-  // Attempt to debug Qt. XXX: Remove when done.
-  PRINTF("***NBB***: Inside signal handler\n");
+  unsigned char* dst = nbb_spill_alloc(ch, size);
 
-  // Since i = 0 is already reserved for nameserver
-  for(i = 1;channel_list[i].in_use && i < SERVICE_MAX_CHANNELS;i++) {
-    // Use re-entrant version of nbb_read_item
-    retval = nbb_read_item_r(i, (void*) recv, &recv_len, recv_max_len);
+  ch->spill_reserved = (dst != NULL);
+  return dst;
+}
 
-    if(retval == OK) {
-      if (memcmp(recv, NEW_CONN_NOTIFY_MSG, NEW_CONN_NOTIFY_MSG_LEN) == 0) {
-        // We have enough buffer for this null byte
-        recv[recv_len] = '\0';
+static void nbb_spill_release(struct channel* ch)
+{
+  nbb_shm_unlink(ch->write_id + NBB_SPILL_ID_OFFSET);
+  nbb_shm_unmap(ch->write_spill, NBB_SEGMENT_SHM_SIZE(ch->write_spill->size));
+  ch->write_spill = NULL;
+  ch->spill_draining = 0;
+}
 
-        char* tmp = NULL;
+// Whether normal lane writes to |ch| go to the spill segment. Once the
+// consumer has emptied it, which means it's also done with the ring up to
+// where the segment was linked in, we mark the end and go back to the
+// ring, and let go of the segment when the consumer has read the marker.
+static int nbb_spill_writing(struct channel* ch)
+{
+  struct spill_ring* spill = ch->write_spill;
 
-        strtok(recv, " ");
-        tmp = strtok(NULL, " ");
-        connected_nodes[i].pid = atoi(tmp);
-        tmp = strtok(NULL, " ");
-        //connected_nodes[i].name = (char*)malloc(strlen(tmp) * sizeof(char));
-        assert(strlen(tmp) + 1 <= MAX_NAME_SIZE);
-        strcpy(connected_nodes[i].name, tmp);
+  if(spill == NULL) {
+    return 0;
+  }
 
-        PRINTF("***NBB***: New connection on slot %d from client_name: %s with pid: %d\n", i, connected_nodes[i].name, connected_nodes[i].pid);
+  if(ch->spill_draining) {
+    if(!(ch->write->spill_state & NBB_SPILL_ACTIVE)) {
+      nbb_spill_release(ch);
+    }
+    return 0;
+  }
 
-        is_new_conn_msg = 1;
-      }
+  if(spill->tail != spill->head) {
+    return 1;
+  }
 
-      if (!is_new_conn_msg) {
-        nbb_flush_shm(i, recv, recv_len);
-      }
+  // Always fits, the segment is empty
+  nbb_spill_alloc(ch, 0);
+  nbb_spill_commit(ch, 0, NBB_ITEM_SPILL_END);
+  ch->spill_draining = 1;
 
-      /*
-      PRINTF("** Received %zu bytes: ", recv_len);
-      int z;
-      for(z=0; z<recv_len; z++) {
-        PRINTF("%02x", recv[z]);
-      }
-      PRINTF(" from shm id %d slot %d\n", (int) channel_list[i].read_id, i);
-      */
+  return 0;
+}
 
-      // Notify of new connection on slot i
-      if (is_new_conn_msg && channel_list[i].new_conn != NULL) {
-        channel_list[i].new_conn(i, channel_list[i].arg);
-      }
+// |buf|, the normal lane's ring, is full: carry on in a spill segment if
+// |ch| is elastic
+static int nbb_spill_open(struct channel* ch, struct buffer* buf)
+{
+  unsigned int state = buf->spill_state;
 
-      // We only have new data when the msg is "real data" (not our initial msg).
-      // Notify event of new available data on slot i
-      if (!is_new_conn_msg && channel_list[i].new_data != NULL) {
-        channel_list[i].new_data(i);
-      }
+  if(!ch->elastic) {
+    return -1;
+  }
 
-      recv_len = 0;
+  // Past the end marker but the consumer hasn't got to it yet: have it
+  // come back to the segment from here, right after the marker
+  if(ch->write_spill) {
+    if((state & NBB_SPILL_ACTIVE) && __sync_bool_compare_and_swap(&buf->spill_state, state,
+                                         NBB_SPILL_ACTIVE | nbb_ring_write_pos(buf))) {
+      ch->spill_draining = 0;
+      return 0;
     }
+    nbb_spill_release(ch);
+  }
 
+  if((ch->write_spill = nbb_map_spill(ch->write_id, 1)) == NULL) {
+    return -1;
   }
 
-  signal(NBB_SIGNAL, nbb_recv_data);
+  PRINTF("** Ring %d full, spilling at %d\n", ch->write_id, nbb_ring_write_pos(buf));
+  __sync_synchronize();
+  buf->spill_state = NBB_SPILL_ACTIVE | nbb_ring_write_pos(buf);
+
+  return 0;
 }
 
-int nbb_open_channel(const char* owner, int shm_read_id, int shm_write_id, int is_ipc_create)
+// Consumer side, once it got to where the spill segment comes in. Reads
+// the next record like nbb_ring_read(). At the end marker it clears
+// spill_reading and returns BUFFER_EMPTY for the caller to carry on with
+// the ring, letting go of the segment unless the producer already needs
+// it again further on.
+static int nbb_spill_read(struct channel* ch, struct buffer* buf, void* item, size_t* size,
+                          size_t max_size, unsigned short* flags)
 {
-	int shmid;
-	unsigned char * shm;
-  int free_slot;
+  struct spill_ring* spill = ch->read_spill;
+  struct spill_record* rec;
+  unsigned int tail, state;
 
-  if(shm_read_id == NAMESERVER_WRITE && shm_write_id == NAMESERVER_READ) {
-    free_slot = 0;
-  }
-  else {
-    free_slot = nbb_free_channel_slot();
+  if(spill == NULL && (spill = ch->read_spill = nbb_map_spill(ch->read_id, 0)) == NULL) {
+    return -1;
   }
 
-  if(free_slot == -1) {
-	  PRINTF("! nbb_open_channel(): no free_slot\n");
-    return -1;
+  while(1) {
+    tail = spill->tail;
+    if(tail == spill->head) {
+      return BUFFER_EMPTY;
+    }
+    __sync_synchronize();
+
+    rec = (struct spill_record*) (nbb_spill_data(spill) + (tail & (spill->size - 1)));
+    if(!(rec->flags & NBB_ITEM_PAD)) {
+      break;
+    }
+    spill->tail = tail + spill->size - (tail & (spill->size - 1));
   }
 
-	// Allocate 4 pages, 1 meta + 1 data for each buffer
-	// Read buffer
-	// note that we use SERVICE_TEST_WRITE, not READ, since the service's
-	// read is the client's write
-	if((shmid = shmget(shm_read_id, PAGE_SIZE*2, is_ipc_create | 0666)) < 0) {
-		PRINTF("shmget");
-		return -1;
-	}
-	if((shm = (unsigned char *) shmat(shmid, NULL, 0)) == (unsigned char*) -1) {
-		PRINTF("shmat");
-		return -1;
-	}
-	// Make sure the memory is zero'd out
-	memset(shm, 0, PAGE_SIZE*2);
-
-	channel_list[free_slot].read = (struct buffer*) shm;
-	channel_list[free_slot].read->data_size = PAGE_SIZE;
-	channel_list[free_slot].read->data_offset = PAGE_SIZE;
-	channel_list[free_slot].read_data = (unsigned char*) shm+PAGE_SIZE;
-  channel_list[free_slot].read_id = shm_read_id;
-  channel_list[free_slot].read_count = 0;
-
-	// Write buffer. Same note as above about swapping read/write
-	shmid = -1;
-	shm = (unsigned char*) -1;
-	if((shmid = shmget(shm_write_id, PAGE_SIZE*2, is_ipc_create | 0666)) < 0) {
-		PRINTF("shmget");
-		return -1;
-	}
-	if((shm = (unsigned char *) shmat(shmid, NULL, 0)) == (unsigned char*) -1) {
-		PRINTF("shmat");
-		return -1;
-	}
-	// Make sure the memory is zero'd out
-	memset(shm, 0, PAGE_SIZE*2);
-
-	channel_list[free_slot].write = (struct buffer*) (shm);
-	channel_list[free_slot].write->data_size = PAGE_SIZE;
-	channel_list[free_slot].write->data_offset = PAGE_SIZE;
-	channel_list[free_slot].write_data = (unsigned char*) shm+PAGE_SIZE;
-  channel_list[free_slot].write_id = shm_write_id;
-  channel_list[free_slot].write_count = 0;
-
-  channel_list[free_slot].in_use = 1;
+  if(rec->flags & NBB_ITEM_SPILL_END) {
+    ch->spill_reading = 0;
+    state = buf->spill_state;
 
-  if(owner) {
-    channel_list[free_slot].owner = (char*) malloc(strlen(owner) + 1);
-    strcpy(channel_list[free_slot].owner, owner);
+    if(NBB_SPILL_POS(state) == nbb_ring_read_pos(buf) &&
+       __sync_bool_compare_and_swap(&buf->spill_state, state, 0)) {
+      nbb_shm_unmap(spill, NBB_SEGMENT_SHM_SIZE(spill->size));
+      ch->read_spill = NULL;
+    }
+    else {
+      spill->tail = tail + NBB_SPILL_RECORD_SIZE(0);
+    }
+    return BUFFER_EMPTY;
   }
 
-  memset(&delay_buffers[free_slot], 0, sizeof(struct delay_buffer));
-  delay_buffers[free_slot].content = (char*) calloc(1<<20, sizeof(char));
-  assert(delay_buffers[free_slot].content);
-  delay_buffers[free_slot].capacity = 1<<20;
+  // Make sure we have enough buffer size for the message
+  assert(rec->size <= max_size);
+  nbb_copy(item, rec + 1, rec->size);
+  *size = rec->size;
+  *flags = rec->flags;
 
-  return free_slot;
+  __sync_synchronize();
+  spill->tail = tail + NBB_SPILL_RECORD_SIZE(*size);
+
+  return OK;
 }
 
-//TODO: Most probably buggy
-int nbb_close_channel(int index)
+int nbb_set_elastic(int slot_id, int enable)
 {
-  assert(index >= 0 && index < SERVICE_MAX_CHANNELS);
+  struct nbb_context* ctx = nbb_ctx();
 
-  shmdt((char*)channel_list[index].read);
-  if(shmctl(channel_list[index].read_id, IPC_RMID, 0) == -1) {
-    return -1;
-  }
+  assert(slot_id > NAMESERVER_SLOT && slot_id < SERVICE_MAX_CHANNELS);
 
-  shmdt((char*)channel_list[index].write);
-  if(shmctl(channel_list[index].write_id, IPC_RMID, 0) == -1) {
+  if(!ctx->channel_list[slot_id].in_use) {
+    PRINTF("! nbb_set_elastic(): slot %d not in use\n", slot_id);
     return -1;
   }
 
-  channel_list[index].in_use = 0;
+  // A segment that's already linked in drains as usual
+  ctx->channel_list[slot_id].elastic = enable;
   return 0;
 }
 
-int nbb_free_channel_slot()
+static int nbb_ring_insert(int channel_id, int lane, const void* ptr_to_item, size_t size,
+                           unsigned short flags)
 {
-  int i;
+  struct nbb_context* ctx = nbb_ctx();
+  assert(channel_id >= 0 && channel_id < SERVICE_MAX_CHANNELS);
+  assert(ptr_to_item != NULL);
 
-  for(i = 0;i < SERVICE_MAX_CHANNELS;i++) {
-    if(!channel_list[i].in_use) {
-      return i;
+	struct channel* ch = &ctx->channel_list[channel_id];
+	unsigned char *data_buf;
+	struct buffer *buf = nbb_write_ring(ch, lane, &data_buf);
+	int item_offset;
+	int spilling = (lane == NBB_LANE_NORMAL && nbb_spill_writing(ch));
+	int ret = OK;
+
+  if(spilling) {
+    ret = nbb_spill_insert(ch, ptr_to_item, size, flags);
+  }
+  else if(buf->format == NBB_RING_CELLS) {
+    struct nbb_cell* cell = nbb_cell_alloc(buf, data_buf, size, &ch->cell_tail_cache[lane]);
+
+    if(cell == NULL) {
+      ret = BUFFER_FULL;
+    }
+    else {
+      nbb_copy_to_shm(cell->payload, ptr_to_item, size);
+      nbb_cell_commit(buf, cell, size, flags);
     }
   }
+  else if((ret = nbb_ring_alloc(buf, size, 1, &item_offset)) == OK) {
+	  // Update our new item in items[], say that we're writing
+    buf->update_counter = buf->last_update_counter + 1;
 
-  return -1;
+	  // Copy the item into the buffer's shm data region at offset
+	  nbb_copy_to_shm(data_buf+item_offset, ptr_to_item, size);
+
+    nbb_ring_commit(buf, item_offset, size, flags);
+  }
+
+  // An elastic channel carries on in a spill segment
+  if(ret != OK && !spilling && lane == NBB_LANE_NORMAL && nbb_spill_open(ch, buf) == 0) {
+    ret = nbb_spill_insert(ch, ptr_to_item, size, flags);
+  }
+  if(ret != OK) {
+    return ret;
+  }
+
+  // Bulk handles are counted by nbb_write_bulk()
+  if(!flags && memcmp(NEW_CONN_NOTIFY_MSG, ptr_to_item, sizeof(NEW_CONN_NOTIFY_MSG))) {
+    ctx->channel_list[channel_id].write_count += (size - 1); // Excluding '\0'
+  }
+
+  return OK;
 }
 
-/* Reads as many bytes up to size as are available
- * Return value is the number of bytes read.
- */
-int nbb_read_bytes(int slot, char* buf, int size)
+void* nbb_reserve(int slot_id, int lane, size_t size)
 {
-  assert(slot >= 0 && buf != NULL && size >= 0);
+  struct nbb_context* ctx = nbb_ctx();
+  assert(slot_id > NAMESERVER_SLOT && slot_id < SERVICE_MAX_CHANNELS);
 
-  delay_buffer_t* delay_buffer = &(delay_buffers[slot]);
-  assert(delay_buffer->capacity >= delay_buffer->len);
+  struct channel* ch = &ctx->channel_list[slot_id];
+  unsigned char *data_buf;
+  struct buffer *buf;
+  int item_offset;
 
-  // Attempt to read 0 bytes or buffer has nothing to read
-  if (size == 0 || delay_buffer->content == NULL || delay_buffer->len == 0) {
-    return 0;
+  if(!ch->in_use || size == 0 || size > NBB_RESERVE_MAX_SIZE) {
+    PRINTF("! nbb_reserve(): can't reserve %zu bytes on slot %d\n", size, slot_id);
+    return NULL;
   }
 
-  assert(delay_buffer->content != NULL && delay_buffer->len > 0);
+  buf = nbb_write_ring(ch, lane, &data_buf);
 
-  // Read minimum of the requested length and available data
-  if(size > delay_buffer->len) {
-    size = delay_buffer->len;
+  if(lane == NBB_LANE_NORMAL && nbb_spill_writing(ch)) {
+    return nbb_spill_reserve(ch, size);
   }
 
-  // Read |size| bytes into |buf| and update statistics
-  memcpy(buf, delay_buffer->content, size);
-  channel_list[slot].read_count += size;
+  if(buf->format == NBB_RING_CELLS) {
+    struct nbb_cell* cell = nbb_cell_alloc(buf, data_buf, size, &ch->cell_tail_cache[lane]);
 
-  // Move remaining data (if any) into the front of buffer
-  int new_len = delay_buffer->len - size;
-  if (new_len > 0) {
-    memmove(delay_buffer->content, delay_buffer->content + size, new_len);
+    if(cell) {
+      return cell->payload;
+    }
   }
-  delay_buffer->len = new_len;
+  else {
+    assert(!(buf->update_counter & 1) && "Reservation already open");
 
-  return size;
-}
+    if(nbb_ring_alloc(buf, size, NBB_RESERVE_ALIGN, &item_offset) == OK) {
+      // The consumer stops at an odd update counter until we publish
+      buf->update_counter = buf->last_update_counter + 1;
+      buf->items[((buf->last_update_counter/2)%BUFFER_SIZE)].offset = item_offset;
 
-int nbb_bytes_available(int slot)
-{
-  assert(slot >= 0 && slot < SERVICE_MAX_CHANNELS);
-  return delay_buffers[slot].len;
-}
+      return data_buf + item_offset;
+    }
+  }
 
-int nbb_bytes_read(int slot)
-{
-  assert(slot >= 0 && slot < SERVICE_MAX_CHANNELS);
-  return channel_list[slot].read_count;
+  // Same as nbb_ring_insert()
+  if(lane == NBB_LANE_NORMAL && nbb_spill_open(ch, buf) == 0) {
+    return nbb_spill_reserve(ch, size);
+  }
+  return NULL;
 }
 
-int nbb_bytes_written(int slot)
+int nbb_publish(int slot_id, int lane, size_t size)
 {
-  assert(slot >= 0 && slot < SERVICE_MAX_CHANNELS);
-  return channel_list[slot].write_count;
-}
+  struct nbb_context* ctx = nbb_ctx();
+  assert(slot_id > NAMESERVER_SLOT && slot_id < SERVICE_MAX_CHANNELS);
 
-void nbb_flush_shm(int slot, char* array_to_flush, int size)
-{
-  assert(slot >= 0 && slot < SERVICE_MAX_CHANNELS);
-  assert(array_to_flush != NULL && size >= 0);
+  struct channel* ch = &ctx->channel_list[slot_id];
+  unsigned char *data_buf;
+  struct buffer *buf = nbb_write_ring(ch, lane, &data_buf);
+  unsigned char* msg;
 
-  if (size == 0)
-    return;
+  assert(size > 0 && size <= NBB_RESERVE_MAX_SIZE);
 
-  delay_buffer_t* buffer = &(delay_buffers[slot]);
-  int new_size = buffer->len + size;
+  if(lane == NBB_LANE_NORMAL && ch->spill_reserved) {
+    msg = nbb_spill_data(ch->write_spill) + (ch->spill_at & (ch->write_spill->size - 1)) +
+          sizeof(struct spill_record);
+    nbb_spill_commit(ch, size, 0);
+    ch->spill_reserved = 0;
+  }
+  else if(buf->format == NBB_RING_CELLS) {
+    struct nbb_cell* cell = nbb_cell_at(buf, data_buf, buf->cell_head);
 
-  // Grow the buffer if exceeding current capacity
-  if (new_size > buffer->capacity) {
-    // Initial capacity (2 * MAX_MSG_LEN)
-    if (buffer->capacity == 0) {
-      buffer->capacity = MAX_MSG_LEN;
-    }
-    int new_buffer_capacity = 2 * buffer->capacity < new_size ?
-        new_size :
-        2 * buffer->capacity;
+    msg = cell->payload;
+    nbb_cell_commit(buf, cell, size, 0);
+  }
+  else {
+    int item_offset = buf->items[((buf->last_update_counter/2)%BUFFER_SIZE)].offset;
 
-    buffer->content = (char *) realloc(buffer->content, new_buffer_capacity);
-    buffer->capacity = new_buffer_capacity;
+    assert((buf->update_counter & 1) && "No reservation to publish");
+    msg = data_buf + item_offset;
+    __sync_synchronize();
+    nbb_ring_commit(buf, item_offset, size, 0);
   }
+  ch->write_count += (size - 1); // Like nbb_ring_insert()
 
+  nbb_record(slot_id, NBB_RECORD_SENT, lane, (char*) msg, size);
+  nbb_doorbell(ctx, slot_id, size, lane);
 
-  // Append new data to the end (or beginning if it's the first flush)
-  memcpy(buffer->content + buffer->len, array_to_flush, size);
-  buffer->len = new_size;
+  return 0;
 }
 
 int nbb_insert_item(int channel_id, const void* ptr_to_item, size_t size)
 {
-  assert(channel_id >= 0 && channel_id < SERVICE_MAX_CHANNELS);
-  assert(ptr_to_item != NULL && size >= 0);
+  return nbb_ring_insert(channel_id, NBB_LANE_NORMAL, ptr_to_item, size, 0);
+}
 
-	struct buffer *buf = channel_list[channel_id].write;
-	unsigned char *data_buf = channel_list[channel_id].write_data;
+// Copy |size| bytes into the write arena of |slot_id| and pass a handle to
+// them through the ring. Payloads are never split, so one that doesn't fit
+// before the end of the arena starts over at its beginning.
+static int nbb_write_bulk(int slot_id, const char* msg, size_t size)
+{
+  struct nbb_context* ctx = nbb_ctx();
+  struct bulk_arena* arena = ctx->channel_list[slot_id].write_bulk;
+  struct bulk_handle handle;
+  unsigned int head = arena->head;
+  unsigned int pos = head & (arena->size - 1);
+  unsigned int skip = 0;
+  int ret;
 
-  unsigned short temp_ac = buf->ack_counter;
+  if(size > arena->size) {
+    PRINTF("! nbb_write_bulk(): %zu bytes don't fit in the arena\n", size);
+    return -1;
+  }
 
-  assert(channel_id >= 0 && channel_id < SERVICE_MAX_CHANNELS);
-  assert(ptr_to_item != NULL && size >= 0);
+  if(pos + size > arena->size) {
+    skip = arena->size - pos;
+  }
 
-  if (buf->last_update_counter - temp_ac == 2 * BUFFER_SIZE) {
+  if(arena->size - (head - arena->tail) < skip + size) {
     return BUFFER_FULL;
   }
 
-  if (buf->last_update_counter - temp_ac == (2 * BUFFER_SIZE) - 1) {
-    return BUFFER_FULL_CONSUMER_READING;
-  }
+  handle.offset = (pos + skip) & (arena->size - 1);
+  handle.size = size;
+  handle.end = head + skip + size;
 
-  // Check if there is space in the data region for new item
-  // This works by checking how far the previous item extends,
-  // and then if our size will fit in the remaining space
-  //
-  // If it doesn't fit at the end, check at the head of the list too.
-  struct channel_item* prev_item =
-				&(buf->items[(((buf->last_update_counter/2)-1)%BUFFER_SIZE)]);
+  nbb_copy_to_shm(nbb_bulk_data(arena) + handle.offset, msg, size);
 
-	int item_offset;
+  // Claim the space before the consumer can see the handle and release it
+  __sync_synchronize();
+  arena->head = handle.end;
 
-	if(buf->last_update_counter == 0) {
-		item_offset = 0;
-	}
-	else if((prev_item->offset+prev_item->size+size) <  buf->data_size) {
-		item_offset = prev_item->offset + prev_item->size;
-	}
-	// Check if there's space at the head of the list for our item instead
-	// This is done by checking the offset of the
-	// oldest unread item (at the ack counter)
-	else if(buf->items[((buf->last_ack_counter)/2)%BUFFER_SIZE].offset > size) {
-		item_offset = 0;
-	}
-	// Couldn't fit at the end or the beginning. Sad.
-	else {
-		PRINTF("else...\n");
-		PRINTF("poff: %d psize: %d size: %zu bsize: %d\n", prev_item->offset,
-					prev_item->size, size, buf->data_size);
-		return BUFFER_FULL;
-	}
-
-	// Update our new item in items[], say that we're writing
-  buf->update_counter = buf->last_update_counter + 1;
-
-	// Copy the item into the buffer's shm data region at offset
-	memcpy(data_buf+item_offset, ptr_to_item, size);
-
-	// Set the offset based on our above calculations
-	buf->items[((buf->last_update_counter/2)%BUFFER_SIZE)].offset = item_offset;
-	buf->items[((buf->last_update_counter/2)%BUFFER_SIZE)].size = size;
-
-  // Done writing
-  buf->update_counter = buf->last_update_counter + 2;
-
-  buf->last_update_counter = buf->update_counter;
-
-  if(memcmp(NEW_CONN_NOTIFY_MSG, ptr_to_item, sizeof(NEW_CONN_NOTIFY_MSG))) {
-    channel_list[channel_id].write_count += (size - 1); // Excluding '\0'
+  ret = nbb_ring_insert(slot_id, NBB_LANE_NORMAL, &handle, sizeof(handle), NBB_ITEM_BULK);
+  if(ret != OK) {
+    // Nobody saw the handle, so nobody can have released past |head|
+    arena->head = head;
+    return ret;
   }
 
+  ctx->channel_list[slot_id].write_count += (size - 1); // Same as nbb_insert_item
+
   return OK;
 }
 
 int nbb_read_item(int channel_id, void** ptr_to_item, size_t* size)
 {
-	struct buffer *buf = channel_list[channel_id].read;
-	unsigned char *data_buf = channel_list[channel_id].read_data;
-  unsigned short temp_uc = buf->update_counter;
-
+  struct nbb_context* ctx = nbb_ctx();
   assert(channel_id >= 0 && channel_id < SERVICE_MAX_CHANNELS);
   assert(ptr_to_item != NULL && size != NULL);
 
+	struct buffer *buf = ctx->channel_list[channel_id].read;
+	unsigned char *data_buf = ctx->channel_list[channel_id].read_data;
+  unsigned short temp_uc = buf->update_counter;
+
   *ptr_to_item = NULL;
   *size = 0;
 
-  if(channel_id < 0) {
-    PRINTF("! nbb_read_item(): invalid channel_id %d\n", channel_id);
-    return -1;
-  }
+  if(buf->format == NBB_RING_CELLS) {
+    unsigned short flags;
+    int ret;
 
-  if(size < 0) {
-    PRINTF("! nbb_read_item(): invalid size %lu\n", *size);
-    return -1;
+    *ptr_to_item = malloc(buf->data_size);
+    if((ret = nbb_cell_read(buf, data_buf, *ptr_to_item, size, buf->data_size, &flags)) != OK) {
+      free(*ptr_to_item);
+      *ptr_to_item = NULL;
+    }
+    return ret;
   }
 
   if (temp_uc == buf->last_ack_counter) {
@@ -714,73 +2984,75 @@ int nbb_read_item(int channel_id, void** ptr_to_item, size_t* size)
 
   buf->ack_counter = buf->last_ack_counter + 2;
   buf->last_ack_counter = buf->ack_counter;
+  buf->recv_msgs++;
+  buf->recv_bytes += *size;
 
   return OK;
 }
 
 // nbb_read_item_r is the re-entrant version of nbb_read_item.
-// This version has no malloc() and uses global data for ptr_to_item;
-// therefore, it must be used only in the signal handler
-static int nbb_read_item_r(int channel_id, void* item, size_t* size, size_t max_size)
+// This version has no malloc() and copies into the caller's buffer, so it
+// can be used from the signal handler and by the nameserver.
+static int nbb_ring_read(int channel_id, int lane, void* item, size_t* size, size_t max_size,
+                         unsigned short* flags)
 {
-	struct buffer *buf = channel_list[channel_id].read;
-	unsigned char *data_buf = channel_list[channel_id].read_data;
-  unsigned short temp_uc = buf->update_counter;
-
+  struct nbb_context* ctx = nbb_ctx();
   assert(channel_id >= 0 && channel_id < SERVICE_MAX_CHANNELS);
   assert(item != NULL && size != NULL && max_size > 0);
 
-  *size = 0;
+	struct buffer *buf = ctx->channel_list[channel_id].read;
+	unsigned char *data_buf = ctx->channel_list[channel_id].read_data;
 
-  if(channel_id < 0) {
-    printf("! nbb_read_item(): invalid channel_id %d\n", channel_id);
-    return -1;
+  if(lane == NBB_LANE_HIGH) {
+    buf = ctx->channel_list[channel_id].high_read;
+    data_buf = ctx->channel_list[channel_id].high_read_data;
   }
 
-  if(size < 0) {
-    printf("! nbb_read_item(): invalid size %lu\n", *size);
-    return -1;
-  }
+  *size = 0;
 
-  if (temp_uc == buf->last_ack_counter) {
-    return BUFFER_EMPTY; 
-  }
+  // Elastic channels: the spill segment comes before whatever was written
+  // to the ring after it was linked in
+  if(lane == NBB_LANE_NORMAL) {
+    struct channel* ch = &ctx->channel_list[channel_id];
+    unsigned int spill_state = buf->spill_state;
+    int ret;
 
-  if ((temp_uc - buf->last_ack_counter) == 1) {
-    return BUFFER_EMPTY_PRODUCER_INSERTING;
+    if(!ch->spill_reading) {
+      ch->spill_reading = (spill_state & NBB_SPILL_ACTIVE) &&
+                          NBB_SPILL_POS(spill_state) == nbb_ring_read_pos(buf);
+    }
+    if(ch->spill_reading) {
+      __sync_synchronize();
+      ret = nbb_spill_read(ch, buf, item, size, max_size, flags);
+      if(ch->spill_reading) {
+        return ret;
+      }
+    }
   }
 
-  buf->ack_counter = buf->last_ack_counter + 1;
-
-  // Copy out the value to malloc'd mem in our address space
-  struct channel_item* tmp = 
-				&(buf->items[((buf->last_ack_counter / 2) % BUFFER_SIZE)]);
-
-  // Copy to this item
-  // Make sure we have enough buffer size for the message and null byte
-  assert(tmp->size < max_size);
-  memcpy(item, data_buf+tmp->offset, tmp->size);
-	*size = tmp->size;
+  return nbb_ring_consume(buf, data_buf, item, size, max_size, flags);
+}
 
-  buf->ack_counter = buf->last_ack_counter + 2;
-  buf->last_ack_counter = buf->ack_counter;
+int nbb_read_item_r(int channel_id, void* item, size_t* size, size_t max_size)
+{
+  unsigned short flags;
 
-  return OK;
+  return nbb_ring_read(channel_id, NBB_LANE_NORMAL, item, size, max_size, &flags);
 }
 
-volatile handle_events_func handler_func;
-
 int nbb_set_handle_events(handle_events_func newfunc) {
-    handler_func = newfunc;
-    PRINTF("==== nbb_set_handle_events %p %p\n", &handler_func, handler_func);
+  struct nbb_context* ctx = nbb_ctx();
+    ctx->handler_func = newfunc;
+    PRINTF("==== nbb_set_handle_events %p %p\n", ctx, ctx->handler_func);
 
     return 0;
 }
 
 int nbb_handle_events() {
-    if(handler_func != NULL) {
-        PRINTF("==== nbb_handle_events calling %p %p\n", &handler_func, handler_func);
-        return handler_func();
+  struct nbb_context* ctx = nbb_ctx();
+    if(ctx->handler_func != NULL) {
+        PRINTF("==== nbb_handle_events calling %p %p\n", ctx, ctx->handler_func);
+        return ctx->handler_func();
     } else {
         PRINTF("==== nbb_handle_events called, but no function set!\n");
     }
@@ -793,3 +3065,110 @@ void nbb_print_timestamp(char* str) {
     unsigned long long nsec = ts.tv_nsec + (1000000000*ts.tv_sec);
     fprintf(stderr, "Timestamp %s: %lld\n", str, nsec);
 }
+
+// Traffic capture, see NBB_RECORD in nbb.h
+static int record_fd = -1;
+static int record_opened = 0;
+static long long record_start;
+static char record_owners[NBB_RECORD_MAX_OWNERS][MAX_NAME_SIZE];
+static int record_num_owners = 0;
+
+
+// Called whenever a channel is opened, so outside of signal handlers
+static void nbb_record_open()
+{
+  const char* path = getenv("NBB_RECORD");
+  const char* owners = getenv("NBB_RECORD_OWNERS");
+  char name[PATH_MAX];
+  struct nbb_record_header header;
+  const char* pid_spec;
+
+  if(!__sync_bool_compare_and_swap(&record_opened, 0, 1) || path == NULL || !*path) {
+    return;
+  }
+
+  if((pid_spec = strstr(path, "%p")) != NULL) {
+    snprintf(name, sizeof(name), "%.*s%d%s", (int) (pid_spec - path), path,
+             getpid(), pid_spec + 2);
+  }
+  else {
+    snprintf(name, sizeof(name), "%s", path);
+  }
+
+  while(owners && *owners && record_num_owners < NBB_RECORD_MAX_OWNERS) {
+    size_t len = strcspn(owners, ",");
+
+    if(len > 0 && len < MAX_NAME_SIZE) {
+      memcpy(record_owners[record_num_owners], owners, len);
+      record_owners[record_num_owners++][len] = '\0';
+    }
+    owners += len + (owners[len] == ',');
+  }
+
+  int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+  if(fd == -1) {
+    PRINTF("! nbb_record_open(): can't open %s\n", name);
+    return;
+  }
+
+  memset(&header, 0, sizeof(header));
+  header.magic = NBB_RECORD_MAGIC;
+  header.version = NBB_RECORD_VERSION;
+  header.pid = getpid();
+  if(write(fd, &header, sizeof(header)) != sizeof(header)) {
+    close(fd);
+    return;
+  }
+
+  record_start = nbb_now_nsec();
+  __sync_synchronize();
+  record_fd = fd;
+}
+
+// One writev() per record: O_APPEND keeps records from different threads
+// and from the signal handler whole, and nothing here allocates.
+static void nbb_record(int slot, int direction, int lane, const char* msg, size_t size)
+{
+  struct nbb_context* ctx = nbb_ctx();
+  static const char pad[8];
+  struct nbb_record rec;
+  struct iovec iov[3];
+  int i;
+
+  if(record_fd < 0) {
+    return;
+  }
+
+  if(record_num_owners) {
+    const char* owner = ctx->channel_list[slot].owner;
+
+    for(i = 0;i < record_num_owners;i++) {
+      if(owner && !strcmp(owner, record_owners[i])) {
+        break;
+      }
+    }
+    if(i == record_num_owners) {
+      return;
+    }
+  }
+
+  rec.nsec = nbb_now_nsec() - record_start;
+  rec.size = size;
+  rec.slot = slot;
+  rec.direction = direction;
+  rec.lane = lane;
+
+  iov[0].iov_base = &rec;
+  iov[0].iov_len = sizeof(rec);
+  iov[1].iov_base = (void*) msg;
+  iov[1].iov_len = size;
+  iov[2].iov_base = (void*) pad;
+  iov[2].iov_len = NBB_RECORD_ALIGN(size) - size;
+
+  // We may be interrupting someone who's about to look at errno
+  int saved_errno = errno;
+  if(writev(record_fd, iov, 3) == -1) {
+    PRINTF("! nbb_record(): write failed, errno %d\n", errno);
+  }
+  errno = saved_errno;
+}
@@ -27,11 +27,8 @@ extern "C" {
 #include <signal.h>
 
 #include <sys/ipc.h>
-#include <sys/shm.h>
-#include <sys/sem.h>
 
 #include <sys/stat.h>
-#include <semaphore.h>
 
 #include "constants.h"
 
@@ -41,6 +38,8 @@ extern "C" {
   #define PRINTF(...)
 #endif
 
+#define NBB_BUFFER_MAGIC 0x4e424242
+
 // BUFFER_SIZE is limited to ~32,767 since it has to be represented by an unsigned short / 2
 #define BUFFER_SIZE (256 * 4)
 #define NUM_ITEMS 500000
@@ -48,6 +47,54 @@ extern "C" {
 // This should be dynamic in the future
 #define PAGE_SIZE (4096 * 4) // This should probably be found programatically
 
+// Each direction of a channel is one segment: header page(s) + data
+#define NBB_BUFFER_SHM_SIZE (PAGE_SIZE * 2)
+
+// Shared memory segments are POSIX shm objects named NBB_SHM_PREFIX<id>
+#define NBB_SHM_PREFIX "/nbb-"
+
+// Payloads above NBB_BULK_THRESHOLD bytes don't go through the ring's data
+// region. They're copied into a per-direction bulk arena and the ring only
+// carries a small handle, so big writes don't hold up the event stream.
+// A payload can be at most the arena's size, NBB_BULK_ARENA_SIZE unless
+// huge pages were asked for (see NBB_HUGEPAGE_SIZE).
+#define NBB_BULK_THRESHOLD 2048
+#define NBB_BULK_ARENA_SIZE (1 << 20) // Must be a power of two
+#define NBB_BULK_MAGIC 0x4e424241
+// Arena shm ids are the ring's id plus this
+#define NBB_BULK_ID_OFFSET 10000
+
+// Every channel has two lanes, each with its own pair of rings. The
+// receiver drains the high priority lane before taking anything off the
+// normal one, so a backlog there doesn't delay what's sent on the fast
+// lane. Lanes only preserve order among their own items: a writer using
+// both must make every write a complete message. High priority payloads
+// above NBB_BULK_THRESHOLD go on the normal lane.
+enum {
+  NBB_LANE_NORMAL = 0,
+  NBB_LANE_HIGH,
+};
+// High priority rings' shm ids are the normal ring's id plus this
+#define NBB_HIGH_ID_OFFSET 20000
+
+// Elastic channels, see nbb_set_elastic(). When the normal lane's ring is
+// full, the producer links in a spill segment and writes there until the
+// consumer has caught up with it, then goes back to the ring and lets the
+// segment go. Never pre-faulted, so it only costs what a backlog fills.
+#define NBB_SPILL_SIZE (1 << 20) // Must be a power of two
+#define NBB_SPILL_MAGIC 0x4e424253
+// Spill segments' shm ids are the ring's id plus this
+#define NBB_SPILL_ID_OFFSET 30000
+// Buffers' spill_state: the ring position, plus this while it's in use
+#define NBB_SPILL_ACTIVE (1 << 16)
+#define NBB_SPILL_POS(state) ((unsigned short) (state))
+
+// Bulk arenas and spill segments have a header page before their data.
+// With NBB_SHM_HUGEPAGE their creator gives them a whole huge page of data
+// instead of the default size; whoever attaches goes by the header.
+#define NBB_HUGEPAGE_SIZE (2 * 1024 * 1024)
+#define NBB_SEGMENT_SHM_SIZE(data_size) (PAGE_SIZE + (data_size))
+
 // For connected_node struct
 // This applies to service name, client name, and so on...
 // We hardcode the name size so that we don't have to malloc() in signal handler
@@ -81,6 +128,10 @@ void nbb_set_cb_new_connection(const char* owner, cb_new_conn_func func, void* a
 typedef void (*cb_new_data_func)(int slot_id);
 void nbb_set_cb_new_data(const char* owner, cb_new_data_func func);
 
+// Peer died, see nbb_reap_dead_peers(). The slot is already dealt with.
+typedef void (*cb_disconnect_func)(int slot_id);
+void nbb_set_cb_disconnect(const char* owner, cb_disconnect_func func);
+
 // Allow process to change owner for channel slot
 void nbb_set_owner(int slot_id, const char *owner);
 
@@ -89,6 +140,96 @@ struct connected_node {
   char name[MAX_NAME_SIZE];
 };
 
+// Nameserver protocol. Requests and replies are fixed-layout structs sent
+// as a single NBB item, so neither side has to format or parse strings.
+struct ns_request {
+  int type;           // NS_REGISTER_SERVICE, NS_CONNECT_CLIENT or NS_ACTIVATE_SERVICE
+  int pid;
+  int num_channels;   // Only meaningful for NS_REGISTER_SERVICE
+  char name[MAX_NAME_SIZE];
+};
+
+struct ns_reply {
+  int status;         // NS_OK or one of the NS_* errors
+  int pid;            // Service pid for NS_CONNECT_CLIENT
+  int num_channels;   // Number of valid entries in channel_ids
+  int channel_ids[SERVICE_MAX_CHANNELS];
+};
+
+// Only the used part of channel_ids[] goes over the wire
+#define NS_REPLY_SIZE(n) (sizeof(struct ns_reply) - \
+    (SERVICE_MAX_CHANNELS - (n)) * sizeof(int))
+
+// Service directory. The nameserver publishes every registered service in
+// a read-mostly shm segment so that clients can resolve a service and
+// claim one of its channels without talking to the nameserver.
+#define NBB_DIRECTORY_ENTRIES 512 // Must be a power of 2
+#define NBB_DIRECTORY_MAGIC 0x4e424244
+
+// Directory (and nameserver registry) entry state. Removed entries stay
+// as tombstones so that lookups keep probing past them.
+enum {
+  SERVICE_EMPTY = 0,
+  SERVICE_IN_USE,
+  SERVICE_REMOVED,
+};
+
+// Everything but |busy_map| and |client_pids| is written only by the
+// nameserver and protected by |seq| (odd while an update is in progress).
+// Clients claim channel_ids[i] by a CAS of their pid into client_pids[i],
+// so that the nameserver can always reclaim channels of clients that died
+// without releasing them. Bit i of |busy_map| is set after that and
+// cleared before the pid, it only saves scanning the pids.
+//
+// Bit i of |attached_map| is the service's: set while it holds state for
+// the client on channel i, cleared once it reset the channel after that
+// client is gone. Nobody claims the channel while it's set, so the reset
+// can't hit the next client, however late the service notices.
+struct nbb_directory_entry {
+  volatile unsigned int seq;
+  int state;
+  unsigned int hash;
+  int pid;
+  int num_channels;
+  int channel_ids[SERVICE_MAX_CHANNELS];
+  volatile unsigned int busy_map;
+  volatile int client_pids[SERVICE_MAX_CHANNELS];
+  volatile unsigned int attached_map;
+  char name[MAX_NAME_SIZE];
+};
+
+struct nbb_directory {
+  unsigned int magic;
+  int nameserver_pid;
+
+  // The nameserver channel is a single producer/consumer pair, so only one
+  // registration may be in flight. Holds the pid of the registering
+  // service, 0 when free. Client connects never take it.
+  volatile int registration_lock;
+
+  struct nbb_directory_entry entries[NBB_DIRECTORY_ENTRIES];
+};
+
+// Map the directory into our address space (created by the nameserver)
+struct nbb_directory* nbb_get_directory(int is_ipc_create);
+
+// Hash used to index the directory
+unsigned int nbb_hash_name(const char* name);
+
+// Claim a free channel of |service_name|. Returns the channel id and
+// stores the service's pid, or returns -1 with |status| set to NS_*.
+int nbb_directory_claim(const char* service_name, int* service_pid, int* status);
+
+// Give back a channel obtained from nbb_directory_claim()
+void nbb_directory_release(const char* service_name, int channel_id);
+
+// Claim a free one of the first |num_channels| channels of |entry| for
+// |pid|. Returns its index, or -1 if they're all taken.
+int nbb_directory_claim_index(struct nbb_directory_entry* entry, int num_channels, int pid);
+
+// Give back channel |index| of |entry| if |pid| still holds it
+void nbb_directory_release_index(struct nbb_directory_entry* entry, int index, int pid);
+
 // Simple channel abstraction
 struct channel {
 	struct buffer *read;
@@ -101,18 +242,150 @@ struct channel {
   int write_id;
   int write_count;
 
+  // High priority lane, NULL on the nameserver channel
+  struct buffer *high_read;
+  unsigned char* high_read_data;
+  struct buffer *high_write;
+  unsigned char* high_write_data;
+
+  // Bulk arenas, NULL on the nameserver channel
+  struct bulk_arena* read_bulk;
+  struct bulk_arena* write_bulk;
+
+  // Elastic channels, see nbb_set_elastic(). Spill segments are mapped
+  // while in use only.
+  int elastic;
+  struct spill_ring* read_spill;
+  struct spill_ring* write_spill;
+  int spill_draining;          // End marker written, writing to the ring again
+  int spill_reading;           // Consumer: reading the spill up to its end marker
+  int spill_reserved;          // nbb_reserve() handed out spill space...
+  unsigned int spill_at;       // ...for a record at this position
+
   char* owner;
   cb_new_conn_func new_conn;
   cb_new_data_func new_data;
+  cb_disconnect_func peer_gone;
   void* arg;
 
   int in_use;
+  int is_creator;      // We created the shm segments and remove them on close
+  int claimed_channel; // Directory channel id claimed by us, 0 if none
+  unsigned int cell_tail_cache[2]; // Last cell_tail seen, per write lane
+
+  // Doorbell batching, see nbb_set_batching()
+  size_t batch_bytes;           // 0 wakes the reader on every write
+  long long batch_nsec;
+  size_t unsignalled;           // Bytes written since the reader was woken
+  long long unsignalled_since;
+  volatile int busy_poll; // Read by nbb_poll_loop instead of the signal handler
+
+  // Peer liveness, see nbb_peer_fd()
+  int peer_fd_open;
+  int peer_fd;         // pidfd of the process at the other end
+  int peer_dead;       // Signalling it failed with ESRCH
 };
 
 // Store offset within data region and size of message
 struct channel_item {
 	unsigned short offset;
 	unsigned short size;
+	unsigned short flags;
+};
+
+// channel_item flags
+enum {
+  NBB_ITEM_BULK = 1 << 0, // The item is a struct bulk_handle
+  NBB_ITEM_PAD = 1 << 1,  // Cell rings, spill segments: skip to the start
+  NBB_ITEM_SPILL_END = 1 << 2, // Spill segments: back to the ring from here
+};
+
+// Out-of-band payloads for one direction of a channel, allocated in ring
+// order: the producer appends at head and the consumer gives space back at
+// tail once it copied a payload out. Both are running byte counts.
+struct bulk_arena {
+	unsigned int magic;
+	unsigned int size;
+	// Producer and consumer each own a cache line
+	char pad0[64 - 2 * sizeof(unsigned int)];
+	volatile unsigned int head;
+	char pad1[64 - sizeof(unsigned int)];
+	volatile unsigned int tail;
+};
+
+struct bulk_handle {
+	unsigned int offset; // Into the arena's data
+	unsigned int size;
+	unsigned int end;    // Value of tail once this payload is released
+};
+
+// Spill segment of an elastic channel: a byte ring of records, data at
+// PAGE_SIZE, same head/tail rules as the bulk arena
+struct spill_ring {
+	unsigned int magic;
+	unsigned int size;
+	char pad0[64 - 2 * sizeof(unsigned int)];
+	volatile unsigned int head;
+	char pad1[64 - sizeof(unsigned int)];
+	volatile unsigned int tail;
+};
+
+// Payload follows, records start NBB_SPILL_ALIGN aligned and never wrap
+struct spill_record {
+	unsigned int size;
+	unsigned short flags;
+	unsigned short reserved;
+};
+#define NBB_SPILL_ALIGN 8
+#define NBB_SPILL_RECORD_SIZE(size) \
+	((sizeof(struct spill_record) + (size) + NBB_SPILL_ALIGN - 1) & ~(NBB_SPILL_ALIGN - 1))
+
+// Coalescing slots, on the high priority lane only. A coalesced write for
+// |key| (say, pointer motion for one window) replaces the unread one the
+// slot still holds for that key instead of being appended, so a slow reader
+// only ever sees the latest state. A slot is delivered where it would have
+// been in the ring: |ring_pos| is the ring's update counter when it was
+// filled, and it's only overwritten while nothing went through the ring
+// since. One filled while the reader was already taking the ring item at
+// |ring_pos| comes right after that item instead. Anything that must not
+// be dropped goes through the ring.
+#define NBB_COALESCE_SLOTS 4
+#define NBB_COALESCE_MAX_SIZE 128
+
+// coalesce_slot states, moved with a CAS by either side
+enum {
+  NBB_SLOT_EMPTY = 0,
+  NBB_SLOT_WRITING,
+  NBB_SLOT_READY,
+  NBB_SLOT_READING,
+};
+
+struct coalesce_slot {
+	volatile unsigned int state;
+	unsigned int key;
+	unsigned int seq;         // Orders slots at the same ring position
+	unsigned short ring_pos;
+	unsigned short size;
+	char data[NBB_COALESCE_MAX_SIZE];
+};
+
+// Ring formats, see nbb_set_ring_format()
+enum {
+  NBB_RING_ITEMS = 0, // items[] descriptors pointing into the data region
+  NBB_RING_CELLS,     // The data region is an array of struct nbb_cell
+};
+
+// Cell rings keep a message's header and payload together: it takes as
+// many consecutive cache-line sized cells as it needs, starting with this
+// header. A small event is a single line for both sides to touch.
+#define NBB_CELL_SIZE 64
+#define NBB_CELL_HEADER_SIZE 8
+
+struct nbb_cell {
+	volatile unsigned int seq; // Position + 1 once the message is complete
+	unsigned short size;
+	unsigned short flags;
+	unsigned char payload[NBB_CELL_SIZE - NBB_CELL_HEADER_SIZE];
 };
 
 // This is for a unidirectional buffer
@@ -129,6 +402,44 @@ struct buffer {
 	unsigned short data_offset;
 	unsigned short data_size;
 
+	// Set to NBB_BUFFER_MAGIC by the creator once the buffer is initialized.
+	// Attaching sides never write the header, they only check this.
+	unsigned int magic;
+
+	// Thread reading this buffer, written by the consumer when it opens the
+	// channel. Producers signal that thread instead of the whole process.
+	volatile int reader_tid;
+	// The reader's slot for this channel, queued with its signal so the
+	// handler goes straight to it
+	volatile int reader_slot;
+	// Set while the reader busy-polls this buffer, producers don't signal
+	volatile int reader_polls;
+
+	// NBB_RING_ITEMS or NBB_RING_CELLS, set by the creator
+	unsigned int format;
+
+	// Elastic channels: while NBB_SPILL_ACTIVE is set, whatever comes after
+	// ring position NBB_SPILL_POS() is in the spill segment, up to its next
+	// end marker. Set by the producer, cleared by the consumer once it read
+	// the marker. A producer that needs the segment again before that moves
+	// the position instead; both are a CAS, so they can't cross.
+	volatile unsigned int spill_state;
+
+	// Running counts, each side's on its own cache line: the producer owns
+	// cell_head and the sent counts, the consumer cell_tail and the recv
+	// ones. The cell counts are for cell rings only, the message and byte
+	// counts are kept for both formats, see nbb_get_credit().
+	volatile unsigned int cell_head __attribute__((aligned(64)));
+	volatile unsigned int sent_msgs;
+	volatile unsigned int sent_bytes;
+	volatile unsigned int cell_tail __attribute__((aligned(64)));
+	volatile unsigned int recv_msgs;
+	volatile unsigned int recv_bytes;
+
+	// Written by the producer only
+	unsigned int coalesce_seq;
+	struct coalesce_slot coalesce[NBB_COALESCE_SLOTS];
+
 	// Array of objs within data region
 	struct channel_item items[BUFFER_SIZE];
 };
@@ -148,7 +459,27 @@ int nbb_init_service(int num_channels, const char* name);
 int nbb_connect_service(const char* client_name, const char* service_name);
 
 // Communicate with the nameserver
-int nbb_nameserver_connect(const char* request, char** ret, int* ret_len);
+int nbb_nameserver_connect(const struct ns_request* request, struct ns_reply* reply);
+
+// Shared memory backend options, see nbb_set_shm_flags()
+enum {
+  NBB_SHM_POPULATE = 1 << 0,  // Pre-fault mappings (MAP_POPULATE), default
+  NBB_SHM_HUGEPAGE = 1 << 1,  // Huge page sized bulk arenas and spill segments
+};
+
+// Applies to segments mapped from now on
+void nbb_set_shm_flags(int flags);
+
+// Format of the rings of channels created from now on, NBB_RING_ITEMS by
+// default. Whoever attaches follows the creator's choice. The nameserver
+// channel always uses items.
+void nbb_set_ring_format(int format);
+
+// Map / unmap / remove shared segment |shm_id| of |size| bytes.
+// |is_ipc_create| creates a fresh, zero-filled segment.
+void* nbb_shm_map(int shm_id, size_t size, int is_ipc_create);
+void nbb_shm_unmap(void* shm, size_t size);
+int nbb_shm_unlink(int shm_id);
 
 // Open & close channels
 int nbb_open_channel(const char* owner, int shm_read_id, int shm_write_id, int is_ipc_create);
@@ -161,7 +492,8 @@ int nbb_send(const char* service_name, const char* msg, size_t msg_len);
 // Returns the index of the free slot, if it is full, returns -1
 int nbb_free_channel_slot();
 
-// Data is available from client, called via interrupt
+// Reads everything pending on every signal-driven channel. The signal
+// handler falls back to it when a signal doesn't say which slot fired.
 void nbb_recv_data(int signum);
 
 // Flush stuffs in shm to intermediate buffer to allow finer granularity
@@ -172,6 +504,96 @@ int nbb_read_bytes(int slot, char* buf, int size);
 
 // Write number of bytes to slot slot_id
 int nbb_write_bytes(int slot_id, const char* msg, size_t msg_len);
+int nbb_write_bytes_lane(int slot_id, const char* msg, size_t msg_len, int lane);
+
+// Zero-copy writes. nbb_reserve() returns room for a message of up to
+// |size| bytes right in the ring of |lane|, aligned to NBB_RESERVE_ALIGN, or
+// NULL if the lane is full. nbb_publish() hands the first |size| bytes of
+// it to the reader. Only one reservation per slot and lane may be open,
+// and nothing else may be written to that lane until it's published.
+#define NBB_RESERVE_ALIGN 8
+#define NBB_RESERVE_MAX_SIZE NBB_BULK_THRESHOLD
+void* nbb_reserve(int slot_id, int lane, size_t size);
+int nbb_publish(int slot_id, int lane, size_t size);
+
+// Doorbell batching. With |max_bytes| > 0, normal lane writes to |slot_id|
+// don't wake the reader until |max_bytes| are pending, nbb_flush() is
+// called or |max_usec| passed since the first of them, whichever comes
+// first. High priority writes always wake it at once, for everything
+// pending. Deadlines are checked on every write to the slot and by
+// nbb_flush_expired(), which an event loop should call whenever the fd
+// returned by nbb_batch_timer_fd() becomes readable. Without that, a
+// batch can wait for the next write. All of it is per context.
+int nbb_set_batching(int slot_id, size_t max_bytes, int max_usec);
+// Returns 1 if the reader was woken, 0 if nothing was pending
+int nbb_flush(int slot_id);
+// Returns the number of slots flushed
+int nbb_flush_expired();
+int nbb_batch_timer_fd();
+
+// Elastic channels. With |enable|, a normal lane write to |slot_id| that
+// finds the ring full goes to a spill segment instead of failing, see
+// NBB_SPILL_SIZE; writes only fail once that is full too. The reader needs
+// nothing special. Off by default, set on the writing side.
+int nbb_set_elastic(int slot_id, int enable);
+
+// Synchronous consumption. nbb_signal_fd() blocks NBB_SIGNAL in the
+// calling thread and returns a signalfd for it; that thread's event loop
+// watches it and calls nbb_dispatch_signals() when it's readable, which
+// drains every slot the queued signals name, once each, and runs their
+// callbacks right there instead of in the signal handler. Items are read
+// straight into the delay buffers, without the handler's bounce buffer.
+// Per context, like everything else: only that thread may read the fd.
+// Threads it creates afterwards inherit the blocked signal, so any that
+// use NBB through the signal handler must unblock it.
+int nbb_signal_fd();
+// Returns the number of items read
+int nbb_dispatch_signals();
+// Back to the signal handler, e.g. if the fd couldn't be watched
+void nbb_close_signal_fd();
+
+// Peer liveness. Every connected slot watches the process at its other end
+// through a pidfd. nbb_peer_fd() returns an fd that becomes readable once
+// any peer of this context has died; the event loop then calls
+// nbb_reap_dead_peers(), which frees those slots and runs their disconnect
+// callbacks. A service's slot is reset for its next client, a client's is
+// closed. The nameserver hands the channel out again only once both it and
+// the service noticed, so a service that never reaps keeps it.
+// Without pidfd support there is no fd, but nbb_reap_dead_peers() still
+// finds dead peers with kill().
+int nbb_peer_fd();
+// Returns the number of slots reaped
+int nbb_reap_dead_peers();
+
+// Flow control, for the writing side of a slot. Both sides of every ring
+// keep running counts in its header, so finding out how far the reader is
+// behind takes a few loads, no syscalls and no locks. Coalesced messages
+// aren't counted, they replace each other anyway.
+struct nbb_credit {
+  unsigned int pending_msgs;  // Written to either lane's ring, not read yet
+  unsigned int pending_bytes; // Same, plus what waits in the spill segment and bulk arena
+  unsigned int progress;      // Changes whenever the reader takes anything out
+  unsigned int room;          // Bytes the normal lane's ring can still take
+};
+// Returns -1 if |slot_id| isn't in use
+int nbb_get_credit(int slot_id, struct nbb_credit* credit);
+
+// Write a whole message on the high priority lane that supersedes the
+// previous unread one with the same |key|, see struct coalesce_slot. Falls
+// back to a plain high priority write if it can't be coalesced.
+int nbb_write_coalesced(int slot_id, unsigned int key, const char* msg, size_t msg_len);
+
+// Copies used for every transfer, picked by size and cpu features: an
+// inline copy up to NBB_COPY_INLINE_MAX bytes, memcpy() above that.
+// nbb_copy_to_shm() is for data only the peer will read: from
+// NBB_COPY_STREAM_MIN bytes on it uses SSE2 or AVX2 non-temporal stores,
+// which don't pull the lines into our cache, and fences before returning
+// so the data is visible before the caller publishes it. NBB_COPY=memcpy in the
+// environment switches back to plain memcpy() for comparison.
+#define NBB_COPY_INLINE_MAX 64
+#define NBB_COPY_STREAM_MIN (64 * 1024)
+void nbb_copy(void* dst, const void* src, size_t size);
+void nbb_copy_to_shm(void* dst, const void* src, size_t size);
 
 // Simple utility functions that should be self-explanatory
 int nbb_bytes_available(int slot);
@@ -182,15 +604,80 @@ int nbb_bytes_written(int slot);
 int nbb_insert_item(int channel_id, const void* ptr_to_item, size_t size);
 int nbb_read_item(int channel_id, void** ptr_to_item, size_t* size);
 
+// Same as nbb_read_item, but copies into caller-provided storage of
+// |max_size| bytes instead of malloc()ing. Safe to use in signal handlers.
+int nbb_read_item_r(int channel_id, void* item, size_t* size, size_t max_size);
+
 // Called by event dispatcher to make the sockets check the NBB for new events
 typedef int(*handle_events_func)(void);
-extern volatile handle_events_func handler_func;
 
 int nbb_handle_events();
 int nbb_set_handle_events(handle_events_func);
 
+// Busy-poll delivery. A channel switched to busy-poll is no longer read by
+// the signal handler and its peer stops signalling us; instead the thread
+// running nbb_poll_loop() on the same context watches its counters and runs
+// the new_conn/new_data callbacks itself, without any syscall on the hot
+// path. When idle it spins |spin_budget| times with a cpu relax hint, then
+// yields. |cpu| >= 0 pins the calling thread there. Returns when *|stop| is
+// set. Channels stay in busy-poll mode after the loop returns, switch them
+// back if nobody is going to poll them.
+int nbb_set_busy_poll(int slot_id, int enable);
+void nbb_set_busy_poll_owner(const char* owner, int enable);
+int nbb_poll_loop(int spin_budget, int cpu, volatile int* stop);
+
+// Per-thread endpoints. Slot ids, callbacks and the event handler belong to
+// a context, and every call uses the context attached to the calling thread
+// (a process-wide default one if none was attached). A thread that wants its
+// own channels creates a context, attaches it, and then opens or connects as
+// usual; its peers will signal that thread only.
+typedef struct nbb_context nbb_context_t;
+
+nbb_context_t* nbb_context_new();
+// Closes all channels still open in |ctx|. Must not be the default context.
+void nbb_context_free(nbb_context_t* ctx);
+// Attach |ctx| to the calling thread, NULL goes back to the default context.
+void nbb_context_attach(nbb_context_t* ctx);
+nbb_context_t* nbb_context_current();
+
 void nbb_print_timestamp(char* str);
 
+// Traffic capture. With NBB_RECORD=<file> in the environment every message
+// written or received on our channels is appended to <file> ("%p" in the
+// name becomes our pid), restricted to channels whose owner is listed in
+// NBB_RECORD_OWNERS=<owner>[,<owner>...] if that is set. nbb_replay plays
+// a capture back into a live service or client.
+//
+// The file is a struct nbb_record_header followed by records, each a
+// struct nbb_record and |size| bytes of payload, padded to 8 bytes so the
+// whole file can be walked in place through mmap().
+#define NBB_RECORD_MAGIC 0x4e424252
+#define NBB_RECORD_VERSION 1
+#define NBB_RECORD_MAX_OWNERS 16
+#define NBB_RECORD_ALIGN(n) (((n) + 7) & ~7)
+
+enum {
+  NBB_RECORD_SENT = 0,
+  NBB_RECORD_RECEIVED,
+};
+
+struct nbb_record_header {
+  unsigned int magic;
+  unsigned int version;
+  int pid;
+  unsigned int pad;
+};
+
+struct nbb_record {
+  long long nsec;        // Since the capture started, CLOCK_MONOTONIC
+  unsigned int size;
+  unsigned short slot;
+  unsigned char direction;
+  unsigned char lane;
+};
+
+// Ring fast path, static inline
+#include "nbb_ring.h"
 
 #endif // NBB_H
 
@@ -0,0 +1,222 @@
+#include "nbb.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+// Plays a capture taken with NBB_RECORD (see nbb.h) back into a live
+// process. Connecting to a service (-s) feeds it what the recorded process
+// sent, e.g. a QWS client's commands into a server; registering a service
+// (-S) and waiting for a client feeds that client what the recorded process
+// sent, e.g. a server's events into a QWS client. Replies are read and
+// dropped. Messages go out at the recorded pace unless -f is given.
+
+static volatile int peer_slot = -1;
+
+static void on_new_connection(int slot_id, void *arg)
+{
+    peer_slot = slot_id;
+}
+
+static void on_data(int slot_id)
+{
+    char buf[1<<14];
+
+    while(nbb_read_bytes(slot_id, buf, sizeof(buf)) > 0)
+        ;
+}
+
+static long long now_nsec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_nsec + (1000000000LL * ts.tv_sec);
+}
+
+static void sleep_until(long long nsec)
+{
+    struct timespec ts;
+
+    ts.tv_sec = nsec / 1000000000LL;
+    ts.tv_nsec = nsec % 1000000000LL;
+    // Our own NBB signals interrupt the sleep
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+static const char* direction_name(int direction)
+{
+    return direction == NBB_RECORD_SENT ? "sent" : "received";
+}
+
+void usage()
+{
+    printf("./nbb_replay [-d] [-f] [-r] [-c <recorded slot>] [-n <client name>]\n"
+           "             [-s <service to connect to> | -S <service to register>] <capture file>\n"
+           "  -d  dump the records instead of replaying them\n"
+           "  -f  replay as fast as possible instead of at the recorded pace\n"
+           "  -r  replay the received messages instead of the sent ones\n"
+           "  -c  only replay messages of this slot in the recording process\n");
+    return;
+}
+
+int main(int argc, char** argv)
+{
+    const char* connect_to = NULL;
+    const char* serve_as = NULL;
+    const char* client_name = "nbb_replay";
+    int dump = 0;
+    int fast = 0;
+    int direction = NBB_RECORD_SENT;
+    int only_slot = -1;
+    int opt;
+    int fd;
+    int ret;
+    struct stat st;
+    char* map;
+    const struct nbb_record_header* header;
+    size_t pos;
+    long long start, elapsed;
+    long long first = -1;
+    long long messages = 0, bytes = 0;
+
+    while((opt = getopt(argc, argv, "dfrc:n:s:S:")) != -1) {
+        switch (opt) {
+            case 'd':
+                dump = 1;
+                break;
+            case 'f':
+                fast = 1;
+                break;
+            case 'r':
+                direction = NBB_RECORD_RECEIVED;
+                break;
+            case 'c':
+                only_slot = atoi(optarg);
+                break;
+            case 'n':
+                client_name = optarg;
+                break;
+            case 's':
+                connect_to = optarg;
+                break;
+            case 'S':
+                serve_as = optarg;
+                break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    if(optind != argc - 1 || (!dump && !connect_to == !serve_as)) {
+        usage();
+        return 1;
+    }
+
+    if((fd = open(argv[optind], O_RDONLY)) == -1 || fstat(fd, &st) == -1) {
+        perror(argv[optind]);
+        return -1;
+    }
+    if(st.st_size < (off_t) sizeof(*header)) {
+        printf("%s: not a capture\n", argv[optind]);
+        return -1;
+    }
+
+    map = (char*) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(map == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    close(fd);
+
+    header = (const struct nbb_record_header*) map;
+    if(header->magic != NBB_RECORD_MAGIC || header->version != NBB_RECORD_VERSION) {
+        printf("%s: not a capture, or a different version\n", argv[optind]);
+        return -1;
+    }
+
+    if(!dump) {
+        if(serve_as) {
+            if(nbb_init_service(1, serve_as)) {
+                printf("Error initializing as service, failing!\n");
+                return -1;
+            }
+            nbb_set_cb_new_connection(serve_as, on_new_connection, NULL);
+            nbb_set_cb_new_data(serve_as, on_data);
+
+            printf("Waiting for a client of %s...\n", serve_as);
+            while(peer_slot < 0) {
+                pause();
+            }
+        }
+        else {
+            if((peer_slot = nbb_connect_service(client_name, connect_to)) < 0) {
+                printf("Error getting channel!\n");
+                return -1;
+            }
+            nbb_set_cb_new_data(client_name, on_data);
+        }
+    }
+
+    start = now_nsec();
+
+    for(pos = sizeof(*header); pos + sizeof(struct nbb_record) <= (size_t) st.st_size;
+        pos += sizeof(struct nbb_record) + NBB_RECORD_ALIGN(((struct nbb_record*) (map + pos))->size)) {
+        const struct nbb_record* rec = (const struct nbb_record*) (map + pos);
+        const char* payload = (const char*) (rec + 1);
+
+        // A capture cut short by a crash
+        if(pos + sizeof(*rec) + rec->size > (size_t) st.st_size) {
+            break;
+        }
+
+        if(dump) {
+            printf("%lld.%09lld %-8s slot %2d lane %d size %u\n",
+                rec->nsec / 1000000000LL, rec->nsec % 1000000000LL,
+                direction_name(rec->direction), rec->slot, rec->lane, rec->size);
+            continue;
+        }
+
+        if(rec->direction != direction || (only_slot >= 0 && rec->slot != only_slot)) {
+            continue;
+        }
+
+        // Skip whatever idle time came before the first message
+        if(first < 0) {
+            first = rec->nsec;
+            start = now_nsec();
+        }
+        if(!fast) {
+            sleep_until(start + rec->nsec - first);
+        }
+
+        // Let the peer catch up rather than dropping anything, but a closed
+        // peer or a payload that can never fit won't get any better. A peer
+        // that dies with its ring full shows up as closed once reaped.
+        while((ret = nbb_write_bytes_lane(peer_slot, payload, rec->size, rec->lane)) != 0) {
+            if(ret != BUFFER_FULL && ret != BUFFER_FULL_CONSUMER_READING) {
+                printf("Error %d replaying %s message: slot %d lane %d size %u\n",
+                    ret, direction_name(rec->direction), rec->slot, rec->lane, rec->size);
+                munmap(map, st.st_size);
+                return 1;
+            }
+            sched_yield();
+            nbb_reap_dead_peers();
+        }
+
+        messages++;
+        bytes += rec->size;
+    }
+
+    if(!dump) {
+        elapsed = now_nsec() - start;
+        printf("replayed %lld %s messages, %lld bytes in %lld usec (%lld msgs/s)\n",
+            messages, direction_name(direction), bytes, elapsed / 1000,
+            elapsed ? messages * 1000000000LL / elapsed : 0);
+    }
+
+    munmap(map, st.st_size);
+    return 0;
+}
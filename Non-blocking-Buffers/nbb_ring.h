@@ -0,0 +1,275 @@
+#ifndef NBB_RING_H
+#define NBB_RING_H
+
+// Ring fast path, for both ring formats: full/empty tests, reserve and
+// publish on the producer side, consume on the consumer side. These work
+// on one struct buffer and touch nothing but the ring, so they're static
+// inline here for callers to build their hot loops from. Everything that
+// needs the channel, a syscall or another segment (doorbells, the bulk
+// arena, spill segments, capture) stays in nbb.c.
+//
+// Each ring has one producer and one consumer; the producer side calls
+// must not race with each other, nor must the consumer side ones.
+
+#include <assert.h>
+
+#include "nbb.h"
+
+// Cell rings (NBB_RING_CELLS). A message takes consecutive cells and never
+// wraps, the producer pads out the end of the ring instead. A cell is ready
+// once its seq is its position + 1, so the consumer never reads cell_head,
+// and the producer only rereads cell_tail when its cached copy says full.
+#define NBB_NUM_CELLS(buf) ((buf)->data_size / NBB_CELL_SIZE)
+
+static inline unsigned int nbb_cells_for(size_t size)
+{
+  return (size + NBB_CELL_HEADER_SIZE + NBB_CELL_SIZE - 1) / NBB_CELL_SIZE;
+}
+
+static inline struct nbb_cell* nbb_cell_at(struct buffer* buf, unsigned char* data_buf,
+                                           unsigned int pos)
+{
+  return (struct nbb_cell*) data_buf + (pos % NBB_NUM_CELLS(buf));
+}
+
+// Positions the coalescing slots and spill segments are ordered by
+static inline unsigned short nbb_ring_write_pos(struct buffer* buf)
+{
+  return buf->format == NBB_RING_CELLS ? buf->cell_head : buf->last_update_counter;
+}
+
+static inline unsigned short nbb_ring_read_pos(struct buffer* buf)
+{
+  return buf->format == NBB_RING_CELLS ? buf->cell_tail : buf->last_ack_counter;
+}
+
+// Consumer side: nothing to consume. A message still being written counts
+// as nothing yet, a cell ring's end padding as something.
+static inline int nbb_ring_empty(struct buffer* buf, unsigned char* data_buf)
+{
+  if(buf->format == NBB_RING_CELLS) {
+    return nbb_cell_at(buf, data_buf, buf->cell_tail)->seq != buf->cell_tail + 1;
+  }
+  return (unsigned short) (buf->update_counter - buf->last_ack_counter) <= 1;
+}
+
+// Producer side: not even room for the smallest message. A write may still
+// fail when this is false, see nbb_ring_alloc() and nbb_cell_alloc().
+static inline int nbb_ring_full(struct buffer* buf)
+{
+  if(buf->format == NBB_RING_CELLS) {
+    return buf->cell_head - buf->cell_tail >= (unsigned int) NBB_NUM_CELLS(buf);
+  }
+  return (unsigned short) (buf->last_update_counter - buf->ack_counter) >= 2 * BUFFER_SIZE - 1;
+}
+
+// Room for |size| bytes at cell_head, NULL if the ring is full
+static inline struct nbb_cell* nbb_cell_alloc(struct buffer* buf, unsigned char* data_buf,
+                                              size_t size, unsigned int* tail_cache)
+{
+  unsigned int cells = NBB_NUM_CELLS(buf);
+  unsigned int n = nbb_cells_for(size);
+  unsigned int head = buf->cell_head;
+  unsigned int pad = (head % cells) + n > cells ? cells - (head % cells) : 0;
+
+  if(head + pad + n - *tail_cache > cells) {
+    *tail_cache = buf->cell_tail;
+    if(n > cells || head + pad + n - *tail_cache > cells) {
+      return NULL;
+    }
+  }
+
+  if(pad) {
+    struct nbb_cell* skip = nbb_cell_at(buf, data_buf, head);
+
+    skip->size = 0;
+    skip->flags = NBB_ITEM_PAD;
+    __sync_synchronize();
+    skip->seq = head + 1;
+    buf->cell_head = head + pad;
+  }
+
+  return nbb_cell_at(buf, data_buf, head + pad);
+}
+
+// Consumer side, once the |n| cells of the message at |pos| are copied
+// out. Past the first one they hold payload where seq would be, which could
+// pass for a ready message when the consumer gets there on a later lap
+// before the producer does. Make them look like consumed first cells.
+static inline void nbb_cell_release(struct buffer* buf, unsigned char* data_buf,
+                                    unsigned int pos, unsigned int n)
+{
+  unsigned int i;
+
+  for(i = 1; i < n; i++) {
+    nbb_cell_at(buf, data_buf, pos + i)->seq = pos + i + 1;
+  }
+}
+
+static inline void nbb_cell_commit(struct buffer* buf, struct nbb_cell* cell, size_t size,
+                                   unsigned short flags)
+{
+  unsigned int head = buf->cell_head;
+
+  cell->size = size;
+  cell->flags = flags;
+  __sync_synchronize();
+  cell->seq = head + 1;
+  buf->cell_head = head + nbb_cells_for(size);
+  buf->sent_msgs++;
+  buf->sent_bytes += size;
+}
+
+static inline int nbb_cell_read(struct buffer* buf, unsigned char* data_buf, void* item,
+                                size_t* size, size_t max_size, unsigned short* flags)
+{
+  unsigned int tail = buf->cell_tail;
+  struct nbb_cell* cell = nbb_cell_at(buf, data_buf, tail);
+
+  if(cell->seq != tail + 1) {
+    return BUFFER_EMPTY;
+  }
+
+  if(cell->flags & NBB_ITEM_PAD) {
+    tail += NBB_NUM_CELLS(buf) - (tail % NBB_NUM_CELLS(buf));
+    buf->cell_tail = tail;
+    cell = nbb_cell_at(buf, data_buf, tail);
+    if(cell->seq != tail + 1) {
+      return BUFFER_EMPTY;
+    }
+  }
+  __sync_synchronize();
+
+  // Make sure we have enough buffer size for the message
+  assert((size_t) cell->size <= max_size);
+  nbb_copy(item, cell->payload, cell->size);
+  *size = cell->size;
+  *flags = cell->flags;
+  nbb_cell_release(buf, data_buf, tail, nbb_cells_for(cell->size));
+
+  __sync_synchronize();
+  buf->cell_tail = tail + nbb_cells_for(cell->size);
+  buf->recv_msgs++;
+  buf->recv_bytes += *size;
+
+  return OK;
+}
+
+// Item rings (NBB_RING_ITEMS). The counters go up by two per item and are
+// odd while an item is being written or read. Find room for |size| bytes
+// in |buf|'s data region, at an offset that's a multiple of |align|, and
+// store it in *|item_offset|.
+static inline int nbb_ring_alloc(struct buffer* buf, size_t size, size_t align, int* item_offset)
+{
+  unsigned short temp_ac = buf->ack_counter;
+  unsigned short used = buf->last_update_counter - temp_ac;
+
+  if (used == 2 * BUFFER_SIZE) {
+    return BUFFER_FULL;
+  }
+
+  if (used == (2 * BUFFER_SIZE) - 1) {
+    return BUFFER_FULL_CONSUMER_READING;
+  }
+
+  // Check if there is space in the data region for new item
+  // This works by checking how far the previous item extends,
+  // and then if our size will fit in the remaining space
+  //
+  // If it doesn't fit at the end, check at the head of the list too.
+  struct channel_item* prev_item =
+				&(buf->items[((buf->last_update_counter/2)+BUFFER_SIZE-1)%BUFFER_SIZE]);
+	size_t prev_end = (prev_item->offset + prev_item->size + align - 1) & ~(align - 1);
+	// Oldest unread item, at the ack counter. Unread data runs from it to
+	// prev_end, through the end of the region if we already wrapped.
+	size_t oldest = buf->items[((buf->last_ack_counter)/2)%BUFFER_SIZE].offset;
+
+	// Nothing left unread, so the whole data region is ours. The slot at the
+	// ack counter is stale in this case and can't be used to decide.
+	if(used == 0) {
+		*item_offset = 0;
+	}
+	// Wrapped: the only room is between our last item and the oldest one
+	else if((size_t) prev_item->offset < oldest) {
+		if(prev_end + size >= oldest) {
+			return BUFFER_FULL;
+		}
+		*item_offset = prev_end;
+	}
+	else if((prev_end+size) < (size_t) buf->data_size) {
+		*item_offset = prev_end;
+	}
+	// Check if there's space at the head of the list for our item instead
+	else if(oldest > size) {
+		*item_offset = 0;
+	}
+	// Couldn't fit at the end or the beginning. Sad.
+	else {
+		return BUFFER_FULL;
+	}
+
+  return OK;
+}
+
+// Make the item at the update counter visible to the consumer
+static inline void nbb_ring_commit(struct buffer* buf, int item_offset, size_t size,
+                                   unsigned short flags)
+{
+	struct channel_item* it = &buf->items[((buf->last_update_counter/2)%BUFFER_SIZE)];
+
+	// Set the offset based on our above calculations
+	it->offset = item_offset;
+	it->size = size;
+	it->flags = flags;
+
+  // Done writing
+  buf->update_counter = buf->last_update_counter + 2;
+
+  buf->last_update_counter = buf->update_counter;
+  buf->sent_msgs++;
+  buf->sent_bytes += size;
+}
+
+static inline int nbb_item_read(struct buffer* buf, unsigned char* data_buf, void* item,
+                                size_t* size, size_t max_size, unsigned short* flags)
+{
+  unsigned short temp_uc = buf->update_counter;
+  struct channel_item* tmp;
+
+  if (temp_uc == buf->last_ack_counter) {
+    return BUFFER_EMPTY;
+  }
+
+  if ((unsigned short) (temp_uc - buf->last_ack_counter) == 1) {
+    return BUFFER_EMPTY_PRODUCER_INSERTING;
+  }
+
+  buf->ack_counter = buf->last_ack_counter + 1;
+
+  // Make sure we have enough buffer size for the message
+  tmp = &(buf->items[((buf->last_ack_counter / 2) % BUFFER_SIZE)]);
+  assert((size_t) tmp->size <= max_size);
+  nbb_copy(item, data_buf+tmp->offset, tmp->size);
+	*size = tmp->size;
+  *flags = tmp->flags;
+
+  buf->ack_counter = buf->last_ack_counter + 2;
+  buf->last_ack_counter = buf->ack_counter;
+  buf->recv_msgs++;
+  buf->recv_bytes += *size;
+
+  return OK;
+}
+
+// Copy the next message out of |buf| into |item|, of at most |max_size|
+// bytes. Returns OK, or BUFFER_EMPTY(_PRODUCER_INSERTING) if there's none.
+static inline int nbb_ring_consume(struct buffer* buf, unsigned char* data_buf, void* item,
+                                   size_t* size, size_t max_size, unsigned short* flags)
+{
+  if(buf->format == NBB_RING_CELLS) {
+    return nbb_cell_read(buf, data_buf, item, size, max_size, flags);
+  }
+  return nbb_item_read(buf, data_buf, item, size, max_size, flags);
+}
+
+#endif // NBB_RING_H
@@ -0,0 +1,104 @@
+#ifndef NBB_TYPED_H
+#define NBB_TYPED_H
+
+// Typed channels for fixed-layout messages, C++ only.
+//
+// nbb::TypedChannel<T> moves plain structs over an NBB slot without any
+// serialization: send() builds a batch of them right in the ring through
+// nbb_reserve()/nbb_publish(), and receive() copies whole elements out of
+// what the receive path queued for the slot. Both sides must agree on T,
+// so only use it between binaries built from the same definition.
+//
+//   struct Motion { int window; int x, y; int time; };
+//   nbb::TypedChannel<Motion> motion(slot);
+//   motion.send(samples, n);
+//   ...
+//   n = motion.receive(samples, max);
+
+#include "nbb.h"
+
+namespace nbb {
+
+#define NBB_STATIC_ASSERT(cond, name) \
+    typedef char nbb_static_assert_##name[(cond) ? 1 : -1]
+
+template <typename T, int Lane = NBB_LANE_NORMAL>
+class TypedChannel
+{
+    // Copied byte by byte across processes, so no constructors, no
+    // pointers to follow and nothing wider than a ring item may be aligned
+    NBB_STATIC_ASSERT(__is_pod(T), type_must_be_pod);
+    NBB_STATIC_ASSERT(sizeof(T) <= NBB_RESERVE_MAX_SIZE, type_too_large);
+    NBB_STATIC_ASSERT(__alignof__(T) <= NBB_RESERVE_ALIGN, type_alignment_too_large);
+
+public:
+    // Most elements that go out as one ring item
+    enum { MaxBatch = NBB_RESERVE_MAX_SIZE / sizeof(T) };
+
+    explicit TypedChannel(int slot) : m_slot(slot) {}
+
+    int slot() const { return m_slot; }
+
+    // Send |count| elements, MaxBatch per ring item. Returns how many went
+    // out, fewer than |count| if the ring filled up.
+    size_t send(const T* items, size_t count)
+    {
+        size_t sent = 0;
+
+        while (sent < count) {
+            size_t n = count - sent < (size_t) MaxBatch ? count - sent : (size_t) MaxBatch;
+            T* slot = reserve(n);
+
+            if (!slot)
+                break;
+            for (size_t i = 0; i < n; i++)
+                slot[i] = items[sent + i];
+            publish(n);
+            sent += n;
+        }
+        return sent;
+    }
+
+    bool send(const T& item) { return send(&item, 1) == 1; }
+
+    // Room for |count| elements in the ring, NULL if it's full. Fill it in
+    // and publish() it before writing anything else to this lane.
+    T* reserve(size_t count)
+    {
+        return static_cast<T*>(nbb_reserve(m_slot, Lane, count * sizeof(T)));
+    }
+
+    void publish(size_t count)
+    {
+        nbb_publish(m_slot, Lane, count * sizeof(T));
+    }
+
+    // Number of whole elements waiting to be received
+    size_t available() const
+    {
+        return nbb_bytes_available(m_slot) / sizeof(T);
+    }
+
+    // Copy up to |max| elements into |items|, returns how many
+    size_t receive(T* items, size_t max)
+    {
+        size_t n = available();
+
+        if (n > max)
+            n = max;
+        if (n == 0)
+            return 0;
+        return nbb_read_bytes(m_slot, reinterpret_cast<char*>(items), n * sizeof(T)) / sizeof(T);
+    }
+
+    bool receive(T& item) { return receive(&item, 1) == 1; }
+
+private:
+    int m_slot;
+};
+
+#undef NBB_STATIC_ASSERT
+
+} // namespace nbb
+
+#endif // NBB_TYPED_H
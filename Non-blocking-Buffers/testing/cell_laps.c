@@ -0,0 +1,209 @@
+#include "../nbb.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+// Sends messages of mixed cell counts through a cell ring for many laps,
+// with the producer and a busy-polling consumer on separate threads, and
+// checks that every one arrives whole and in order. Past its first cell a
+// message leaves payload where the next lap looks for a cell's seq, so the
+// producer plants exactly the seq the consumer would accept there on the
+// following lap. The producer pauses now and then to let the consumer catch
+// up to the head, where such a cell would be taken for a message. The
+// nameserver must be up.
+
+#define SERVICE_NAME "cell_laps"
+#define CLIENT_NAME "cell_laps_client"
+#define MAX_CELLS 5
+#define MAGIC 0x6c617073
+
+struct header {
+    unsigned int magic;
+    unsigned int index;
+    unsigned int size;
+    unsigned int sum;
+};
+
+static long long messages = 200000;
+
+static volatile int ready = 0;
+static volatile int done = 0;
+static volatile int failed = 0;
+
+static unsigned int next_index = 0;
+static char stream[2 * MAX_CELLS * NBB_CELL_SIZE];
+static size_t stream_len = 0;
+
+static unsigned int checksum(const char* data, size_t len)
+{
+    unsigned int sum = 0;
+    size_t i;
+
+    for(i = 0; i < len; i++) {
+        sum = sum * 31 + (unsigned char) data[i];
+    }
+    return sum;
+}
+
+static void fail(const char* what, const struct header* hdr)
+{
+    printf("FAIL: %s (expected %u, magic %x index %u size %u)\n",
+           what, next_index, hdr->magic, hdr->index, hdr->size);
+    failed = 1;
+    done = 1;
+}
+
+// The high priority lane keeps messages whole, but reads may return
+// several at once
+static void on_data(int slot_id)
+{
+    struct header hdr;
+    int size;
+
+    while((size = nbb_read_bytes(slot_id, stream + stream_len,
+                                 sizeof(stream) - stream_len)) > 0) {
+        stream_len += size;
+
+        while(stream_len >= sizeof(hdr)) {
+            memcpy(&hdr, stream, sizeof(hdr));
+            if(hdr.magic != MAGIC || hdr.index != next_index ||
+               hdr.size < sizeof(hdr) || hdr.size > MAX_CELLS * NBB_CELL_SIZE) {
+                fail("bad message", &hdr);
+                return;
+            }
+            if(stream_len < hdr.size) {
+                break;
+            }
+            if(checksum(stream + sizeof(hdr), hdr.size - sizeof(hdr)) != hdr.sum) {
+                fail("corrupt payload", &hdr);
+                return;
+            }
+            next_index++;
+            stream_len -= hdr.size;
+            memmove(stream, stream + hdr.size, stream_len);
+        }
+    }
+
+    if(next_index == messages) {
+        done = 1;
+    }
+}
+
+static void* run_consumer(void* arg)
+{
+    nbb_context_attach(nbb_context_new());
+    nbb_set_ring_format(NBB_RING_CELLS);
+    if(nbb_init_service(1, SERVICE_NAME)) {
+        printf("Error initializing as service, failing!\n");
+        exit(-1);
+    }
+    nbb_set_cb_new_data(SERVICE_NAME, on_data);
+    nbb_set_busy_poll_owner(SERVICE_NAME, 1);
+
+    ready = 1;
+    nbb_poll_loop(100, -1, &done);
+    return NULL;
+}
+
+void usage()
+{
+    printf("./cell_laps [-n <messages>]\n");
+    return;
+}
+
+int main(int argc, char** argv)
+{
+    char msg[MAX_CELLS * NBB_CELL_SIZE];
+    struct header* hdr = (struct header*) msg;
+    unsigned int cells = PAGE_SIZE / NBB_CELL_SIZE;
+    unsigned int head = 0;
+    unsigned int n, i;
+    size_t size, off;
+    long long count;
+    int opt;
+    int slot;
+    pthread_t consumer;
+
+    while((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+            case 'n':
+                messages = atoll(optarg);
+                break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    if(messages <= 0) {
+        usage();
+        return 1;
+    }
+
+    pthread_create(&consumer, NULL, run_consumer, NULL);
+    while(!ready) {
+        usleep(1000);
+    }
+
+    nbb_context_attach(nbb_context_new());
+    if((slot = nbb_connect_service(CLIENT_NAME, SERVICE_NAME)) < 0) {
+        printf("Error getting channel!\n");
+        return -1;
+    }
+
+    srand(1);
+    for(count = 0; count < messages && !done; count++) {
+        n = 1 + rand() % MAX_CELLS;
+        size = n * NBB_CELL_SIZE - NBB_CELL_HEADER_SIZE - rand() % (NBB_CELL_SIZE / 2);
+        if(size < sizeof(*hdr)) {
+            size = sizeof(*hdr);
+        }
+
+        // Where nbb_cell_alloc() will put it
+        if((head % cells) + n > cells) {
+            head += cells - (head % cells);
+        }
+
+        for(off = sizeof(*hdr); off < size; off++) {
+            msg[off] = (char) (count + off);
+        }
+        // Each inner cell's seq and size, as the next lap would accept them
+        for(i = 1; i < n; i++) {
+            unsigned int trap[2] = { head + i + cells + 1, sizeof(*hdr) };
+
+            off = i * NBB_CELL_SIZE - NBB_CELL_HEADER_SIZE;
+            if(off + sizeof(trap) <= size) {
+                memcpy(msg + off, trap, sizeof(trap));
+            }
+        }
+        head += n;
+
+        hdr->magic = MAGIC;
+        hdr->index = count;
+        hdr->size = size;
+        hdr->sum = checksum(msg + sizeof(*hdr), size - sizeof(*hdr));
+
+        while(nbb_write_bytes_lane(slot, msg, size, NBB_LANE_HIGH) && !done) {
+            sched_yield();
+        }
+        if(count % 64 == 0) {
+            usleep(100);
+        }
+    }
+
+    for(i = 0; i < 1000 && !done; i++) {
+        usleep(1000);
+    }
+    if(!done) {
+        printf("FAIL: only %u of %lld messages delivered\n", next_index, messages);
+        failed = 1;
+        done = 1;
+    }
+    pthread_join(consumer, NULL);
+
+    printf("laps: %u messages: %u\n", head / cells, next_index);
+    printf("%s\n", failed ? "FAILED" : "OK");
+
+    return failed;
+}
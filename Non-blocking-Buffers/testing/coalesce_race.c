@@ -0,0 +1,230 @@
+#include "../nbb.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+// Races coalesced writes against high priority ring writes, with the
+// producer and a busy-polling consumer on separate threads. Checks that
+// ring messages arrive complete and in order, that each key's coalesced
+// messages never go backwards, and that the last one of every key is
+// delivered, i.e. no coalescing slot got stuck behind the ring. Run it
+// with -c for cell rings; the nameserver must be up.
+
+#define SERVICE_NAME "coalesce_race"
+#define CLIENT_NAME "coalesce_race_client"
+#define KEYS 2
+
+enum {
+    KIND_RING = 1,
+    KIND_MOTION,
+    KIND_END,
+};
+
+struct record {
+    unsigned int kind;
+    unsigned int key;
+    unsigned int seq;
+    unsigned int pad;
+};
+
+static long long messages = 1000000;
+
+static volatile int ready = 0;
+static volatile int done = 0;
+static volatile int failed = 0;
+static volatile int ended = 0;
+
+// Written by the producer before its end record
+static unsigned int last_sent[KEYS];
+
+static unsigned int next_ring = 0;
+static unsigned int last_seen[KEYS];
+static long long motion_seen = 0;
+
+static void fail(const char* what, const struct record* rec)
+{
+    printf("FAIL: %s (kind %u key %u seq %u)\n", what, rec->kind, rec->key, rec->seq);
+    failed = 1;
+    done = 1;
+}
+
+static void on_data(int slot_id)
+{
+    struct record recs[256];
+    int size, i, n;
+
+    while((size = nbb_read_bytes(slot_id, (char*) recs, sizeof(recs))) > 0) {
+        if(size % sizeof(struct record)) {
+            printf("FAIL: read %d bytes, not whole records\n", size);
+            failed = 1;
+            done = 1;
+            return;
+        }
+        n = size / sizeof(struct record);
+
+        for(i = 0; i < n; i++) {
+            struct record* rec = &recs[i];
+
+            switch (rec->kind) {
+                case KIND_RING:
+                    if(rec->seq != next_ring) {
+                        fail("ring message out of order", rec);
+                        return;
+                    }
+                    next_ring++;
+                    break;
+                case KIND_MOTION:
+                    if(rec->key >= KEYS || rec->seq <= last_seen[rec->key]) {
+                        fail("coalesced message went backwards", rec);
+                        return;
+                    }
+                    last_seen[rec->key] = rec->seq;
+                    motion_seen++;
+                    break;
+                case KIND_END:
+                    ended = 1;
+                    break;
+                default:
+                    fail("garbage record", rec);
+                    return;
+            }
+        }
+    }
+
+    if(ended) {
+        for(i = 0; i < KEYS; i++) {
+            if(last_seen[i] != last_sent[i]) {
+                return;
+            }
+        }
+        done = 1;
+    }
+}
+
+static void* run_consumer(void* arg)
+{
+    int cells = *(int*) arg;
+
+    nbb_context_attach(nbb_context_new());
+    if(cells) {
+        nbb_set_ring_format(NBB_RING_CELLS);
+    }
+    if(nbb_init_service(1, SERVICE_NAME)) {
+        printf("Error initializing as service, failing!\n");
+        exit(-1);
+    }
+    nbb_set_cb_new_data(SERVICE_NAME, on_data);
+    nbb_set_busy_poll_owner(SERVICE_NAME, 1);
+
+    ready = 1;
+    nbb_poll_loop(100, -1, &done);
+    return NULL;
+}
+
+static void send_record(int slot, const struct record* rec)
+{
+    int ret;
+
+    do {
+        if(rec->kind == KIND_MOTION) {
+            ret = nbb_write_coalesced(slot, rec->key, (const char*) rec, sizeof(*rec));
+        }
+        else {
+            ret = nbb_write_bytes_lane(slot, (const char*) rec, sizeof(*rec), NBB_LANE_HIGH);
+        }
+        if(ret) {
+            sched_yield();
+        }
+    } while(ret && !done);
+}
+
+void usage()
+{
+    printf("./coalesce_race [-c] [-n <messages>]\n");
+    return;
+}
+
+int main(int argc, char** argv)
+{
+    int cells = 0;
+    int opt;
+    int slot;
+    int i;
+    unsigned int ring = 0;
+    long long n;
+    struct record rec;
+    pthread_t consumer;
+
+    while((opt = getopt(argc, argv, "cn:")) != -1) {
+        switch (opt) {
+            case 'c':
+                cells = 1;
+                break;
+            case 'n':
+                messages = atoll(optarg);
+                break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    if(messages <= 0) {
+        usage();
+        return 1;
+    }
+
+    pthread_create(&consumer, NULL, run_consumer, &cells);
+    while(!ready) {
+        usleep(1000);
+    }
+
+    nbb_context_attach(nbb_context_new());
+    if((slot = nbb_connect_service(CLIENT_NAME, SERVICE_NAME)) < 0) {
+        printf("Error getting channel!\n");
+        return -1;
+    }
+
+    memset(&rec, 0, sizeof(rec));
+    for(n = 0; n < messages && !done; n++) {
+        if(n % 4 == 0) {
+            rec.kind = KIND_RING;
+            rec.key = 0;
+            rec.seq = ring++;
+        }
+        else {
+            rec.kind = KIND_MOTION;
+            rec.key = n % KEYS;
+            rec.seq = n + 1;
+            last_sent[rec.key] = rec.seq;
+        }
+        send_record(slot, &rec);
+    }
+
+    rec.kind = KIND_END;
+    rec.seq = 0;
+    __sync_synchronize();
+    send_record(slot, &rec);
+
+    // Whatever is still missing by now is stuck
+    for(i = 0; i < 1000 && !done; i++) {
+        usleep(1000);
+    }
+    if(!done) {
+        printf("FAIL: coalesced messages never delivered, last seen");
+        for(i = 0; i < KEYS; i++) {
+            printf(" %u/%u", last_seen[i], last_sent[i]);
+        }
+        printf("\n");
+        failed = 1;
+        done = 1;
+    }
+    pthread_join(consumer, NULL);
+
+    printf("format: %s ring messages: %u coalesced delivered: %lld of %lld\n",
+           cells ? "cells" : "items", next_ring, motion_seen, messages - ring);
+    printf("%s\n", failed ? "FAILED" : "OK");
+
+    return failed;
+}
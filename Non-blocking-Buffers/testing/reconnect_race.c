@@ -0,0 +1,162 @@
+#include "../nbb.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// A client dies, the nameserver notices, and a new client tries to take
+// its channel before the service has reaped the old one. The service's
+// reset would roll back whatever the new client is in the middle of, so
+// the channel must stay out of reach until then. Checks that the new
+// client can't connect before the reap, and that everything it sends
+// afterwards arrives intact. The nameserver must be up.
+
+#define SERVICE_NAME "reconnect_race"
+#define CLIENT_NAME "reconnect_race_client"
+#define MESSAGES 1000
+#define MESSAGE_SIZE 16
+
+static volatile int conns = 0;
+static volatile long long received = 0;
+static volatile int corrupt = 0;
+
+static void on_conn(int slot_id, void* arg)
+{
+    conns++;
+}
+
+static void on_data(int slot_id)
+{
+    char buf[4096];
+    int size, i;
+
+    while((size = nbb_read_bytes(slot_id, buf, sizeof(buf))) > 0) {
+        for(i = 0; i < size; i++) {
+            if(buf[i] != (char) ((received + i) % 251)) {
+                corrupt = 1;
+            }
+        }
+        received += size;
+    }
+}
+
+// Connect, retrying while the channel is taken, and send the test stream.
+// Exits with 0 once everything is written.
+static pid_t client(int send)
+{
+    char msg[MESSAGE_SIZE];
+    long long pos = 0;
+    int slot = -1;
+    int tries = 0;
+    int n, i;
+    pid_t pid = fork();
+
+    if(pid != 0) {
+        return pid;
+    }
+
+    while((slot = nbb_connect_service(CLIENT_NAME, SERVICE_NAME)) < 0 && tries++ < 200) {
+        usleep(25000);
+    }
+    if(slot < 0) {
+        _exit(1);
+    }
+    if(!send) {
+        pause();
+    }
+
+    for(n = 0; n < MESSAGES; n++) {
+        for(i = 0; i < MESSAGE_SIZE; i++) {
+            msg[i] = (char) ((pos + i) % 251);
+        }
+        while(nbb_write_bytes(slot, msg, sizeof(msg)) != 0) {
+            sched_yield();
+        }
+        pos += MESSAGE_SIZE;
+    }
+    _exit(0);
+}
+
+static void wait_for(volatile int* value, int expected, int msec)
+{
+    while(*value < expected && msec-- > 0) {
+        usleep(1000);
+    }
+}
+
+void usage()
+{
+    printf("./reconnect_race\n");
+    return;
+}
+
+int main(int argc, char** argv)
+{
+    pid_t first, second;
+    int status;
+    int i;
+
+    if(argc > 1) {
+        usage();
+        return 1;
+    }
+
+    if(nbb_init_service(1, SERVICE_NAME)) {
+        printf("Error initializing as service, failing!\n");
+        return -1;
+    }
+    nbb_set_cb_new_connection(SERVICE_NAME, on_conn, NULL);
+    nbb_set_cb_new_data(SERVICE_NAME, on_data);
+
+    first = client(0);
+    wait_for(&conns, 1, 5000);
+    if(conns != 1) {
+        printf("FAIL: first client never connected\n");
+        kill(first, SIGKILL);
+        return 1;
+    }
+    kill(first, SIGKILL);
+    waitpid(first, NULL, 0);
+
+    // Give the nameserver's sweep time to notice, and don't reap yet
+    for(i = 0; i < 2500; i++) {
+        usleep(1000);
+    }
+
+    second = client(1);
+    for(i = 0; i < 1000; i++) {
+        usleep(1000);
+    }
+    if(conns != 1) {
+        printf("FAIL: second client got the channel before the service reaped the first\n");
+        kill(second, SIGKILL);
+        return 1;
+    }
+
+    if(nbb_reap_dead_peers() != 1) {
+        printf("FAIL: first client wasn't reaped\n");
+        kill(second, SIGKILL);
+        return 1;
+    }
+
+    while(waitpid(second, &status, 0) == -1 && errno == EINTR);
+    if(!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        printf("FAIL: second client never connected after the reap\n");
+        return 1;
+    }
+
+    for(i = 0; i < 5000 && received < MESSAGES * MESSAGE_SIZE; i++) {
+        usleep(1000);
+    }
+
+    printf("connections: %d received: %lld of %d bytes\n",
+           conns, received, MESSAGES * MESSAGE_SIZE);
+    if(conns != 2 || received != MESSAGES * MESSAGE_SIZE || corrupt) {
+        printf("FAILED\n");
+        return 1;
+    }
+    printf("OK\n");
+
+    return 0;
+}
@@ -56,8 +56,6 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <dlfcn.h>
-#include <cassert>
 #include <unistd.h>
 
 // VxWorks doesn't correctly set the _POSIX_... options
@@ -109,124 +107,12 @@ static void initThreadPipeFD(int fd)
 }
 #endif
 
-//======================= NBB HACK =======================
-typedef int (*handle_events_func)(void);
-static handle_events_func nbb_handle_events;
-
-// Dynamically load |sym| from |lib|
-static void *get_dl_symbol(const char *lib, const char *sym)
-{
-    assert(lib != 0 && sym != 0);
-
-    void *handle = dlopen(lib, RTLD_LAZY);
-    if (!handle) {
-        printf("%s\n", dlerror());
-        assert(false && "dlopen failed");
-    }
-
-    // Clear any existing error
-    dlerror();
-
-    void *lib_sym = dlsym(handle, sym);
-    char *error = dlerror();
-    if (error != NULL) {
-        printf("%s\n", error);
-        assert(false && "dlsym failed");
-    }
-
-    dlclose(handle);
-
-    return lib_sym;
-}
-
-// Function to call from signal handler for self-pipe trick
-// XXX: This will be referenced by dlopen()/dlsym() in libGui
-// since we need to call this function in the signal handler in libGui.
-
-#define READ_END 0
-#define WRITE_END 1
-static int self_pipe[2];
-static bool self_pipe_initialized = false;
-
-typedef void(*self_pipe_func)(void);
-Q_CORE_EXPORT self_pipe_func signal_self_pipe_func;
-
-Q_CORE_EXPORT void signal_self_pipe(void)
-{
-    //qDebug() << "signal_self_pipe called.";
-    assert(self_pipe_initialized);
-
-    char c = 1;
-    int ret;
-
-    // In case we get interrupted by a signal, we should restart this write()
-    // since we rely on it to emit Qt signals
-    do {
-        ret = write(self_pipe[WRITE_END], &c, sizeof(char));
-    } while (ret < 0 && errno == EINTR);
-
-    // Not sure when write() returns 0... It shouldn't in any cases.
-    assert(ret != 0);
-
-    if (ret < 0) {
-        // write() would block... This means we are writing too much to the
-        // pipe (sending too many signals) but haven't consume them yet.
-        // Shouldn't happen in our case...
-        if (errno == EAGAIN) {
-            printf("***%s: Warning: Exceeded the pipe buffer capacity...\n",
-                __func__);
-            assert(false);
-        }
-        // Otherwise, real errors
-        perror("write");
-        printf("***signal_self_pipe: Can't self-pipe...\n");
-        assert(false);
-    }
-}
-
-
 QEventDispatcherUNIXPrivate::QEventDispatcherUNIXPrivate()
 {
     extern Qt::HANDLE qt_application_thread_id;
     mainThread = (QThread::currentThreadId() == qt_application_thread_id);
     bool pipefail = false;
 
-    // Initialize self-pipe
-    signal_self_pipe_func = signal_self_pipe;
-
-    if (!self_pipe_initialized) {
-        int ret = pipe(self_pipe);
-        if (ret < 0) {
-            perror("pipe");
-            printf("***QEventDispatcherUNIXPrivate: Can't init self-pipe...\n");
-            assert(false);
-        }
-
-        // We use non-blocking pipe since in case we receive too many signals
-        // we don't want to block when we write() to the pipe in the signal context.
-        // Also, we don't want to block on read() in doSelect().
-        ret = fcntl(self_pipe[READ_END], F_SETFL, O_NONBLOCK);
-        if (ret < 0) {
-            perror("fcntl");
-            printf("***QEventDispatcherUNIXPrivate: Can't set pipe to non-blocking...\n");
-            assert(false);
-        }
-        ret = fcntl(self_pipe[WRITE_END], F_SETFL, O_NONBLOCK);
-        if (ret < 0) {
-            perror("fcntl");
-            printf("***QEventDispatcherUNIXPrivate: Can't set pipe to non-blocking...\n");
-            assert(false);
-        }
-
-        self_pipe_initialized = true;
-    }
-
-    // Dynamically load nbb_handle_events
-    const char *lib = "/usr/local/Trolltech/QtEmbedded-4.7.0-generic/lib/libQtGui.so";
-    const char *sym = "nbb_handle_events";
-    nbb_handle_events = (handle_events_func) get_dl_symbol(lib, sym);
-    assert(nbb_handle_events != 0);
-
     // initialize the common parts of the event loop
 #if defined(Q_OS_INTEGRITY)
     // INTEGRITY doesn't like a "select" on pipes, so use socketpair instead
@@ -269,6 +155,7 @@ QEventDispatcherUNIXPrivate::QEventDispatcherUNIXPrivate()
     sn_highest = -1;
 
     interrupt = false;
+    nextExternalSourceId = 1;
 }
 
 QEventDispatcherUNIXPrivate::~QEventDispatcherUNIXPrivate()
@@ -298,6 +185,7 @@ int QEventDispatcherUNIXPrivate::doSelect(QEventLoop::ProcessEventsFlags flags,
     timerList.updateCurrentTime();
 
     int nsel;
+    int nexternal = 0;
     do {
         if (mainThread) {
             while (signal_received) {
@@ -325,12 +213,11 @@ int QEventDispatcherUNIXPrivate::doSelect(QEventLoop::ProcessEventsFlags flags,
             FD_ZERO(&sn_vec[2].select_fds);
         }
 
-        // Sanity check
-        assert(self_pipe_initialized);
-        assert(self_pipe[READ_END] >= 0 && self_pipe[READ_END] < FD_SETSIZE);
-        // Do our own self-pipe trick
-        FD_SET(self_pipe[READ_END], &sn_vec[0].select_fds);
-        highest = qMax(highest, self_pipe[READ_END]);
+        for (int i = 0; i < externalSources.size(); ++i) {
+            int fd = externalSources.at(i).fd;
+            FD_SET(fd, &sn_vec[0].select_fds);
+            highest = qMax(highest, fd);
+        }
 
         FD_SET(thread_pipe[0], &sn_vec[0].select_fds);
         highest = qMax(highest, thread_pipe[0]);
@@ -341,44 +228,19 @@ int QEventDispatcherUNIXPrivate::doSelect(QEventLoop::ProcessEventsFlags flags,
                          &sn_vec[2].select_fds,
                          timeout);
 
-        // Let's handle our self-pipe first and subtract 1, in case Qt stuff relies
-        // on the the return value of select().
-        if (nsel > 0 && FD_ISSET(self_pipe[READ_END], &sn_vec[0].select_fds)) {
-            // Comment this out when it works...
-            // qDebug() << __func__ << ": Got input from self-pipe...";
-
-            // Consume all the bytes in the self-pipe and call handle events
-            // read() is non-blocking as set above
-            char tmp[16];
-            int ret;
-
-            // Keep reading until we consume all the bytes, OR
-            // restart when we are interrupted by a signal.
-            do {
-                ret = read(self_pipe[READ_END], tmp, sizeof(tmp));
-            } while ((ret > 0) || (ret < 0 && errno == EINTR));
-
-            // We should not receive EOF here (read() returns 0)
-            assert(ret != 0);
-
-            // EAGAIN means we finish consuming the self-pipe
-            if (ret < 0 && errno != EAGAIN) {
-                // Real error
-                perror("read");
-                assert(false);
-            }
-
-            // We finished consuming bytes from the self pipe
-            //printf("** qeventdispatcher right before handle_event\n");
-            nbb_handle_events();
-
-            nsel--;
-
-            // XXX: Only the self-pipe's read end was available, we should
-            // restart the select() call.
-            // XXX: Or maybe we should simply return from this doSelect()???
-            if (nsel == 0) {
-                continue;
+        // External sources are served right here, and taken out of the
+        // count since nothing else below knows about them. Work on a copy,
+        // a callback may (un)register sources.
+        if (nsel > 0 && !externalSources.isEmpty()) {
+            const QList<QExternalEventSource> sources = externalSources;
+            for (int i = 0; i < sources.size(); ++i) {
+                const QExternalEventSource &source = sources.at(i);
+                if (FD_ISSET(source.fd, &sn_vec[0].select_fds)) {
+                    FD_CLR(source.fd, &sn_vec[0].select_fds);
+                    source.callback(source.fd, source.data);
+                    ++nexternal;
+                    nsel--;
+                }
             }
         }
 
@@ -436,7 +298,7 @@ int QEventDispatcherUNIXPrivate::doSelect(QEventLoop::ProcessEventsFlags flags,
 
     // some other thread woke us up... consume the data on the thread pipe so that
     // select doesn't immediately return next time
-    int nevents = 0;
+    int nevents = nexternal;
     if (nsel > 0 && FD_ISSET(thread_pipe[0], &sn_vec[0].select_fds)) {
 #if defined(Q_OS_VXWORKS)
         char c[16];
@@ -468,20 +330,6 @@ int QEventDispatcherUNIXPrivate::doSelect(QEventLoop::ProcessEventsFlags flags,
         }
     }
 
-//    printf("** qeventdispatcher right before handle_event\n");
-//    nbb_handle_events();
-
-    /*
-    for(int i=1; i<SERVICE_MAX_CHANNELS; i++) {
-        if(g_clientSocketMap[i].has_data == true) {
-            client_handle_new_available_data(i);
-        }
-        if(g_serverSocketMap[i].has_new_connection == true) {
-            server_handle_new_connection(i);
-        }
-    }
-    */
-
     return (nevents + q->activateSocketNotifiers());
 }
 
@@ -1132,6 +980,49 @@ void QEventDispatcherUNIX::interrupt()
 void QEventDispatcherUNIX::flush()
 { }
 
+/*!
+    \internal
+
+    Watches \a fd for reading and calls \a callback with \a data from the
+    dispatcher as soon as select() reports it readable. The callback is
+    responsible for draining \a fd. Must be called from the dispatcher's
+    thread. Returns an id to pass to unregisterExternalEventSource().
+*/
+int QEventDispatcherUNIX::registerExternalEventSource(int fd, QExternalEventCallback callback, void *data)
+{
+    Q_D(QEventDispatcherUNIX);
+
+    if (fd < 0 || fd >= FD_SETSIZE || !callback) {
+        qWarning("QEventDispatcherUNIX: Invalid external event source %d", fd);
+        return -1;
+    }
+
+    QExternalEventSource source;
+    source.id = d->nextExternalSourceId++;
+    source.fd = fd;
+    source.callback = callback;
+    source.data = data;
+    d->externalSources.append(source);
+
+    return source.id;
+}
+
+/*!
+    \internal
+*/
+bool QEventDispatcherUNIX::unregisterExternalEventSource(int id)
+{
+    Q_D(QEventDispatcherUNIX);
+
+    for (int i = 0; i < d->externalSources.size(); ++i) {
+        if (d->externalSources.at(i).id == id) {
+            d->externalSources.removeAt(i);
+            return true;
+        }
+    }
+    return false;
+}
+
 
 
 
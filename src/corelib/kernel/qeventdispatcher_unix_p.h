@@ -137,6 +137,20 @@ public:
 
 };
 
+// An fd owned by someone outside of Qt (e.g. a self-pipe written from a
+// signal handler) whose readiness is handled by a plain callback, called
+// straight from the dispatcher instead of going through QSocketNotifier
+// and an event.
+typedef void (*QExternalEventCallback)(int fd, void *data);
+
+struct QExternalEventSource
+{
+    int id;
+    int fd;
+    QExternalEventCallback callback;
+    void *data;
+};
+
 class QEventDispatcherUNIXPrivate;
 
 class Q_CORE_EXPORT QEventDispatcherUNIX : public QAbstractEventDispatcher
@@ -163,6 +177,11 @@ public:
     void interrupt();
     void flush();
 
+    // Watch |fd| for reading in this dispatcher's thread and call
+    // |callback| when it's readable. Returns an id for unregistering.
+    int registerExternalEventSource(int fd, QExternalEventCallback callback, void *data);
+    bool unregisterExternalEventSource(int id);
+
 protected:
     QEventDispatcherUNIX(QEventDispatcherUNIXPrivate &dd, QObject *parent = 0);
 
@@ -201,6 +220,9 @@ public:
 
     QAtomicInt wakeUps;
     bool interrupt;
+
+    QList<QExternalEventSource> externalSources;
+    int nextExternalSourceId;
 };
 
 QT_END_NAMESPACE
@@ -44,7 +44,6 @@
 #include "qabstracteventdispatcher.h"
 #include "qcoreapplication.h"
 #include "qelapsedtimer.h"
-#include "../../gui/embedded/nbb.h"
 
 #include "qobject_p.h"
 #include <private/qthread_p.h>
@@ -38,6 +38,7 @@ embedded {
 		    embedded/qwssignalhandler_p.h \
 		    embedded/constants.h \
 		    embedded/nbb.h \
+		    embedded/nbb_ring.h \
             embedded/qwschannelsocket_qws.h \
 		    embedded/qchannelsocket_p.h \
 		    embedded/qwsembedwidget.h
@@ -67,7 +68,7 @@ embedded {
             embedded/qwschannelsocket_qws.cpp \
 		    embedded/qchannelsocket.cpp \
 			embedded/qsoundqss_qws.cpp \
-		    embedded/nbb.s
+		    embedded/nbb.c
 
         contains(QT_CONFIG,sxe)|contains(QT_CONFIG,qtopia) {
             SOURCES += embedded/qunixsocket.cpp embedded/qunixsocketserver.cpp
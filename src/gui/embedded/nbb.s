@@ -1 +0,0 @@
-../../../Non-blocking-Buffers/nbb.s
\ No newline at end of file
@@ -0,0 +1 @@
+../../../Non-blocking-Buffers/nbb_ring.h
\ No newline at end of file
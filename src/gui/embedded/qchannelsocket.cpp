@@ -113,6 +113,19 @@ void QChannelSocket::emitReadyRead()
     emit readyRead();
 }
 
+/*!
+  Called once NBB has reaped the channel because the peer died. The slot
+  is no longer ours, so the socket becomes unconnected before it emits
+  disconnected(); reads and writes fail from then on.
+  */
+void QChannelSocket::emitDisconnected()
+{
+    PRINTF("'%s' emitting disconnected signal\n", getSocketName());
+    slotNumber = -1;
+    sockState = QAbstractSocket::UnconnectedState;
+    emit disconnected();
+}
+
 /*!
   Returns the number of bytes available for immediate retrieval through a call
   to \l QChannelSocket::read().
@@ -135,6 +148,8 @@ bool QChannelSocket::isSequential() const
 
 /*!
   Returns the number of enqueued bytes still to be written to the socket.
+  Writes go straight into the peer's rings, so this is always 0; use
+  flowCredit() for what the peer hasn't read yet.
   */
 qint64 QChannelSocket::bytesToWrite() const
 {
@@ -142,9 +157,20 @@ qint64 QChannelSocket::bytesToWrite() const
     return 0;
 }
 
+// readData() and writeData() stay on nbb_read_bytes() and nbb_write_bytes()
+// rather than the inline ring calls in nbb_ring.h. A channel is more than
+// its normal lane's ring: the high lane, coalesced slots, spill segments,
+// the bulk arena and the delay buffer of partly read data all have to be
+// looked at, and doorbells, credit counts and capture all hang off the
+// library calls.
+// Every one of those lives in the channel, which only nbb.c can see.
+
 /*! \internal */
 qint64 QChannelSocket::readData(char * data, qint64 maxSize)
 {
+    if (slotNumber < 0) {
+        return qint64(-1);
+    }
 	qint64 bytes = nbb_read_bytes(slotNumber, data, maxSize);
 
     PRINTF("readData (%p) (bytes: %d): ", this, bytes);
@@ -174,6 +200,9 @@ qint64 QChannelSocket::writeData(const char * data, qint64 maxSize)
     }
     PRINTF("\n");
 
+    if (slotNumber < 0) {
+        return qint64(-1);
+    }
     int ret = nbb_write_bytes(slotNumber, data, maxSize);
 	if(ret) {
 	    PRINTF("WRITE ERROR! slotnumber %d \n", slotNumber);
@@ -182,6 +211,49 @@ qint64 QChannelSocket::writeData(const char * data, qint64 maxSize)
 	return maxSize;
 }
 
+/*!
+  Writes \a size bytes of \a data as one message on \a lane. The data
+  goes out as a single NBB item; a HighPriorityLane message may overtake
+  NormalLane ones, so the peer must see whole messages on both. Returns
+  -1 if the message could not be written, with errorString() saying why.
+  */
+qint64 QChannelSocket::writeToLane(const char * data, qint64 size, Lane lane)
+{
+    if (slotNumber < 0) {
+        return qint64(-1);
+    }
+    int ret = nbb_write_bytes_lane(slotNumber, data, size,
+        lane == HighPriorityLane ? NBB_LANE_HIGH : NBB_LANE_NORMAL);
+	if(ret) {
+	    PRINTF("WRITE ERROR! slotnumber %d \n", slotNumber);
+	    setErrorString(tr("Could not write to channel"));
+	    return qint64(-1);
+	}
+	emit bytesWritten(size);
+	return size;
+}
+
+/*!
+  Writes \a size bytes of \a data on the high priority lane, replacing
+  the unread message written with the same \a key if nothing else went
+  out on that lane since. Like writeToLane(), \a data must be a whole
+  message, and -1 is returned if it could not be written.
+  */
+qint64 QChannelSocket::writeCoalesced(uint key, const char * data, qint64 size)
+{
+    if (slotNumber < 0) {
+        return qint64(-1);
+    }
+    int ret = nbb_write_coalesced(slotNumber, key, data, size);
+	if(ret) {
+	    PRINTF("WRITE ERROR! slotnumber %d \n", slotNumber);
+	    setErrorString(tr("Could not write to channel"));
+	    return qint64(-1);
+	}
+	emit bytesWritten(size);
+	return size;
+}
+
 /*
 qint64 QChannelSocket::write(const QByteArray & byteArray) {
     return QChannelSocket::write(byteArray.data(), byteArray.length());
@@ -210,9 +282,57 @@ QAbstractSocket::SocketState QChannelSocket::state()
     return sockState;
 }
 
-/* Writes always flush, so return false */
+/*!
+  Wakes the peer for everything written since it was last woken. Returns
+  true if anything was held back, see setBatching().
+  */
 bool QChannelSocket::flush() {
-    return false;
+    return slotNumber >= 0 && nbb_flush(slotNumber);
+}
+
+/*!
+  Holds back the peer's wakeup for normal lane writes until \a maxBytes
+  are pending, flush() is called, or \a maxUsec microseconds passed since
+  the first of them. A \a maxBytes of 0 wakes the peer on every write, the
+  default. High priority writes always wake it at once.
+  */
+void QChannelSocket::setBatching(qint64 maxBytes, int maxUsec)
+{
+    if (slotNumber < 0) {
+        return;
+    }
+    if (nbb_set_batching(slotNumber, maxBytes, maxUsec)) {
+        PRINTF("BATCHING ERROR! slotnumber %d \n", slotNumber);
+    }
+}
+
+/*!
+  With \a enable, normal lane writes that find the ring full go to a
+  shared spill segment for the peer to catch up on, instead of failing.
+  The segment is released again once the peer has read it.
+  */
+void QChannelSocket::setElastic(bool enable)
+{
+    if (slotNumber < 0) {
+        return;
+    }
+    if (nbb_set_elastic(slotNumber, enable)) {
+        PRINTF("ELASTIC ERROR! slotnumber %d \n", slotNumber);
+    }
+}
+
+/*!
+  Fills in \a credit with how far the peer is behind on what we wrote,
+  see nbb_get_credit(). It only reads the rings' headers, so it's cheap
+  enough to ask before every write. Returns false once the channel is
+  gone.
+  */
+bool QChannelSocket::flowCredit(nbb_credit *credit) const
+{
+    if (slotNumber < 0) {
+        return false;
+    }
+    return nbb_get_credit(slotNumber, credit) == 0;
 }
 
 QT_END_NAMESPACE
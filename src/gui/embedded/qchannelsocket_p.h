@@ -84,6 +84,12 @@ public:
         ListeningState,
         ClosingState
     };
+    // NBB lanes. Writes on the high priority lane overtake whatever is
+    // still queued on the normal one, so each write must be a whole message.
+    enum Lane {
+        NormalLane,
+        HighPriorityLane
+    };
     bool isSequential() const;
 
     QChannelSocket(QObject * = 0);
@@ -93,6 +99,7 @@ public:
     qint64 bytesToWrite() const;
 
     void emitReadyRead();
+    void emitDisconnected();
 
     /*
     qint64 write(const char * data, qint64 maxSize);
@@ -102,6 +109,12 @@ public:
     //qint64 read(char * data, qint64 maxSize);
     QByteArray read(qint64 maxSize);
 
+    qint64 writeToLane(const char * data, qint64 size, Lane lane);
+    qint64 writeCoalesced(uint key, const char * data, qint64 size);
+    void setBatching(qint64 maxBytes, int maxUsec);
+    void setElastic(bool enable);
+    bool flowCredit(nbb_credit *credit) const;
+
     // Required for proper QAbstractSocket casting
     int socketDescriptor();
     virtual bool setSocketDescriptor(int socketDescriptor, QAbstractSocket::SocketState socketState = QAbstractSocket::ConnectedState, QAbstractSocket::OpenMode openMode = ReadWrite);
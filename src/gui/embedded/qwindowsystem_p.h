@@ -64,6 +64,20 @@
 
 QT_BEGIN_NAMESPACE
 
+#ifndef QT_NO_COP
+// Direct QCop channels. A client asks for a channel's route by sending
+// "route(QString)" with the channel's name on this channel. The server
+// answers with "route(QString,bool,QList<int>)", and pushes the same as
+// "update(QString,bool,QList<int>)" whenever the listeners change: whether
+// senders may bypass the server, and the client ids of the listeners. Each
+// listening client runs an NBB service for senders to connect to.
+#define QWS_QCOP_ROUTE_CHANNEL "QWS/QCopRoute"
+
+// Input settings a client asks the server for, such as
+// "setMotionEvents(bool)"; see QWSDisplay::setMotionEventsEnabled().
+#define QWS_INPUT_CHANNEL "QWS/Input"
+#endif
+
 class QWSServerPrivate : public QObjectPrivate {
     friend class QCopChannel;
     friend class QWSMouseHandler;
@@ -103,6 +117,7 @@ public:
     QWSScreenSaver* saver;
     QWSClient *cursorClient;
     int mouseState;
+    int elapsedMs() const { return timer.elapsed(); } // Input event timestamps
 //    bool prevWin;
     QList<QWSWindow*> deletedWindows;
     QList<int> crashedClientIds;
@@ -183,6 +198,9 @@ private:
     void invokeRegisterChannel(QWSQCopRegisterChannelCommand *cmd,
                                 QWSClient *client);
     void invokeQCopSend(QWSQCopSendCommand *cmd, QWSClient *client);
+    void sendQCopRoute(QWSClient *client, const QString &channel, bool reply);
+    void updateQCopRoutes(const QString &channel);
+    void detachQCopRoutes(QWSClient *client);
 #endif
     void invokeRepaintRegion(QWSRepaintRegionCommand *cmd,
                               QWSClient *client);
@@ -293,6 +311,7 @@ private:
 #endif
 #ifndef QT_NO_COP
     QMap<QString, QList<QWSClient*> > channels;
+    QMap<QString, QList<QWSClient*> > qcopRoutes; // Clients that asked, per channel
 #endif
 
 #ifndef QT_NO_QWS_MULTIPROCESS
@@ -48,6 +48,7 @@
 #include "qwsutils_qws.h"
 #include "qwscursor_qws.h"
 #include "qwsdisplay_qws.h"
+#include "qwsdisplay_qws_p.h"
 #include "qmouse_qws.h"
 #include "qcopchannel_qws.h"
 #include "qwssocket_qws.h"
@@ -115,6 +116,17 @@ static QWSServerPrivate *qwsServerPrivate=0;
 
 #define MOUSE 0
 #define KEY 1
+
+// Server to client doorbell batching, see QChannelSocket::setBatching()
+#define QWS_EVENT_BATCH_BYTES (16 * 1024)
+#define QWS_EVENT_BATCH_USEC 1000
+
+// Flow control, see QWSClient::FlowControl. A client is behind while this
+// many bytes we sent it are unread, and unresponsive once it has been
+// behind without reading anything for this long.
+#define QWS_CLIENT_BACKLOG_BYTES (8 * 1024)
+#define QWS_CLIENT_STALL_MSEC 2000
+
 //#define EVENT_BLOCK_DEBUG
 
 QWSScreenSaver::~QWSScreenSaver()
@@ -658,23 +670,39 @@ public:
 
     void setLockId(int id);
     void unlockCommunication();
+    void flushEvents();
+    void setResponsive(bool on);
+#ifndef QT_NO_QWS_MULTIPROCESS
+    bool wantsMouseEvent(const QWSMouseEvent *mouse);
+#endif
 
 private:
+    QWSClient::FlowControl flowControl;
+    bool responsive;
 #ifndef QT_NO_QWS_MULTIPROCESS
     QWSLock *clientLock;
     bool shutdown;
     int numUnbufferedSurfaces;
+    int lastMouseState; // Button and modifier state of the last mouse event sent
+    bool motionEvents;  // Whether it wants mouse events that only move
+    uint readProgress;  // nbb_credit::progress when last seen to change...
+    int readTime;       // ...and the server time then
 #endif
     QSet<QByteArray> usedFonts;
     friend class QWSServerPrivate;
 };
 
 QWSClientPrivate::QWSClientPrivate()
+    : flowControl(QWSClient::CoalesceMotion), responsive(true)
 {
 #ifndef QT_NO_QWS_MULTIPROCESS
     clientLock = 0;
     shutdown = false;
     numUnbufferedSurfaces = 0;
+    lastMouseState = 0;
+    motionEvents = true;
+    readProgress = 0;
+    readTime = 0;
 #endif
 }
 
@@ -694,6 +722,68 @@ void QWSClientPrivate::setLockId(int id)
 #endif
 }
 
+// Wake the client for the events batched up so far
+void QWSClientPrivate::flushEvents()
+{
+#ifndef QT_NO_QWS_MULTIPROCESS
+    Q_Q(QWSClient);
+    if (q->csocket)
+        q->csocket->flush();
+#endif
+}
+
+#ifndef QT_NO_QWS_MULTIPROCESS
+/*
+  Mouse events are the stream that can outrun a client, and the only one
+  that can be thinned out, so this decides before the event is serialized.
+  The channel's credit only takes a few loads from the rings' headers, so
+  a client that's behind costs the server no more per event than one that
+  keeps up.
+*/
+bool QWSClientPrivate::wantsMouseEvent(const QWSMouseEvent *mouse)
+{
+    Q_Q(QWSClient);
+    const bool motion = mouse->simpleData.state == lastMouseState
+                        && mouse->simpleData.delta == 0;
+
+    // It reads the position from the input state block when it needs it
+    if (motion && !motionEvents)
+        return false;
+    if (flowControl == QWSClient::CoalesceMotion)
+        return true;
+
+    nbb_credit credit;
+    if (!q->csocket->flowCredit(&credit))
+        return true;
+    const bool behind = credit.pending_bytes >= QWS_CLIENT_BACKLOG_BYTES;
+
+    if (flowControl == QWSClient::SuspendUnresponsive) {
+        const int now = qwsServerPrivate->elapsedMs();
+        if (!behind || credit.progress != readProgress) {
+            readProgress = credit.progress;
+            readTime = now;
+            setResponsive(true);
+        } else if (now - readTime >= QWS_CLIENT_STALL_MSEC) {
+            setResponsive(false);
+        }
+        // Button changes it missed go out with the first event after
+        if (!responsive)
+            return false;
+    }
+
+    return !(motion && behind);
+}
+#endif
+
+void QWSClientPrivate::setResponsive(bool on)
+{
+    Q_Q(QWSClient);
+    if (responsive == on)
+        return;
+    responsive = on;
+    emit q->responsiveChanged(on);
+}
+
 void QWSClientPrivate::unlockCommunication()
 {
 #ifndef QT_NO_QWS_MULTIPROCESS
@@ -752,8 +842,14 @@ QWSClient::QWSClient(QObject* parent, QWS_SOCK_BASE* sock, int id)
         csocket = static_cast<QWSChannelSocket*>(sock); //###
         isClosed = false;
 
-        //csocket->flush();
         socketDescriptor = csocket->socketDescriptor();
+        // Region, property and QCop events come in bursts while the server
+        // works through commands; it flushes after each batch of them.
+        // Input events take the high priority lane and are never held.
+        csocket->setBatching(QWS_EVENT_BATCH_BYTES, QWS_EVENT_BATCH_USEC);
+        // A client stuck in a long paint falls behind on region and
+        // property events; let those spill over rather than drop them.
+        csocket->setElastic(true);
         connect(csocket, SIGNAL(readyRead()), this, SIGNAL(readyRead()));
         connect(csocket, SIGNAL(disconnected()), this, SLOT(closeHandler()));
         connect(csocket, SIGNAL(error(QAbstractSocket::SocketError)), this, SLOT(errorHandler()));
@@ -795,6 +891,68 @@ void QWSClient::setIdentity(const QString& i)
     id = i;
 }
 
+/*!
+    \enum QWSClient::FlowControl
+
+    This enum describes what the server does with mouse events for a
+    client that falls behind on reading its events.
+
+    \value CoalesceMotion Motion replaces the client's unread motion
+    event, nothing else is held back. This is the default.
+    \value DropMotion As CoalesceMotion, but while the client is behind
+    it gets no events that only move the pointer at all.
+    \value SuspendUnresponsive As DropMotion, and once the client has
+    read nothing for a while, it gets no mouse events until it reads
+    again. The client is marked unresponsive meanwhile.
+
+    Key, region, property and QCop events are always sent.
+
+    \sa setFlowControl(), isResponsive()
+*/
+
+/*!
+    Sets the flow control \a policy for this client's mouse events.
+
+    \sa flowControl()
+*/
+void QWSClient::setFlowControl(FlowControl policy)
+{
+    Q_D(QWSClient);
+    d->flowControl = policy;
+    if (policy != SuspendUnresponsive)
+        d->setResponsive(true);
+}
+
+/*!
+    Returns the flow control policy for this client's mouse events.
+
+    \sa setFlowControl()
+*/
+QWSClient::FlowControl QWSClient::flowControl() const
+{
+    Q_D(const QWSClient);
+    return d->flowControl;
+}
+
+/*!
+    Returns false if the client has been marked unresponsive, which only
+    happens under the SuspendUnresponsive policy.
+
+    \sa responsiveChanged()
+*/
+bool QWSClient::isResponsive() const
+{
+    Q_D(const QWSClient);
+    return d->responsive;
+}
+
+/*!
+    \fn void QWSClient::responsiveChanged(bool responsive)
+
+    This signal is emitted when the client is marked unresponsive, with
+    \a responsive false, and again when it reads its events again.
+*/
+
 void QWSClient::closeHandler()
 {
     isClosed = true;
@@ -833,7 +991,56 @@ void QWSClient::sendEvent(QWSEvent* event)
         if ((QAbstractSocket::SocketState)(csocket->state()) == QAbstractSocket::ConnectedState) {
           //  std::cout << "QWSClient::sendEvent event->write(csocket)" << std::endl;
             nbb_print_timestamp("sendEvent");
-            event->write(csocket);
+
+            if (event->type == QWSEvent::Mouse
+                && !d_func()->wantsMouseEvent(static_cast<QWSMouseEvent*>(event)))
+                return;
+
+            // Serialize the event first so it goes out as one message;
+            // input events take the high priority lane past any region,
+            // property or QCop traffic still queued for this client.
+            QByteArray data;
+            QBuffer buffer(&data);
+            buffer.open(QIODevice::WriteOnly);
+            event->write(&buffer);
+
+            // Pure motion only matters as the latest position, so it
+            // replaces this window's unread motion event in the channel
+            // instead of queueing behind it. Anything that changes the
+            // button or modifier state, and any wheel step, is never
+            // coalesced away.
+            qint64 written;
+            bool input = true;
+            if (event->type == QWSEvent::Mouse) {
+                Q_D(QWSClient);
+                const QWSMouseEvent *mouse = static_cast<QWSMouseEvent*>(event);
+                if (mouse->simpleData.state == d->lastMouseState
+                    && mouse->simpleData.delta == 0) {
+                    written = csocket->writeCoalesced(mouse->simpleData.window,
+                                                      data.constData(), data.size());
+                } else {
+                    d->lastMouseState = mouse->simpleData.state;
+                    written = csocket->writeToLane(data.constData(), data.size(),
+                                                   QChannelSocket::HighPriorityLane);
+                }
+            } else {
+                input = (event->type == QWSEvent::Key);
+                written = csocket->writeToLane(data.constData(), data.size(),
+                                               input ? QChannelSocket::HighPriorityLane
+                                                     : QChannelSocket::NormalLane);
+            }
+
+            // The high priority lane can't spill, so an input event that
+            // finds it full waits behind the other traffic instead. What
+            // the normal lane refuses is lost: the client is gone, or
+            // stopped reading on a channel that can't grow, and is about
+            // to be reaped either way.
+            if (written < 0 && input)
+                written = csocket->writeToLane(data.constData(), data.size(),
+                                               QChannelSocket::NormalLane);
+            if (written < 0)
+                qWarning("QWSClient::sendEvent: Dropped an event for client %d: %s",
+                         clientId(), qPrintable(csocket->errorString()));
         }
     }
     else
@@ -1378,12 +1585,11 @@ void QWSServerPrivate::initServer(int flags)
     ssocket = new QWSChannelServerSocket(qws_qtePipeFilename(), q);
     QObject::connect(ssocket, SIGNAL(newConnection()), q, SLOT(_q_newConnection()));
 
-    /*
     if ( !ssocket->isListening()) {
-        perror("QWSServerPrivate::initServer: server socket not listening");
-        qFatal("Failed to bind to %s", qws_qtePipeFilename().toLatin1().constData());
+        qFatal("Failed to register NBB service %s", qws_qtePipeFilename().toLatin1().constData());
     }
 
+    /*
     struct linger tmp;
     tmp.l_onoff=1;
     tmp.l_linger=0;
@@ -1628,6 +1834,7 @@ void QWSServerPrivate::_q_clientClosed()
 #ifndef QT_NO_COP
     // Enfore unsubscription from all channels.
     QCopChannel::detach(cl);
+    detachQCopRoutes(cl);
 #endif
 
     // Shut down all windows for this client
@@ -2043,6 +2250,12 @@ void QWSServerPrivate::doClient(QWSClient *client)
         }
         delete cs;
     }
+
+    // Commands may have produced events for any client, wake them now
+    // rather than when their batching deadline runs out
+    QMap<int,QWSClient*>::const_iterator it = clientMap.constBegin();
+    for (; it != clientMap.constEnd(); ++it)
+        (*it)->d_func()->flushEvents();
 }
 
 
@@ -2215,7 +2428,26 @@ static bool prevWin;
 #endif
 
 
-extern int *qt_last_x,*qt_last_y;
+static QWSInputState qws_inputState;
+
+// Publish the server's input state for QWSDisplay::inputState()
+static void qws_publishInputState()
+{
+    if (!qt_input_state)
+        return;
+    qws_inputState.time = qwsServerPrivate->elapsedMs();
+    qt_input_state->write(qws_inputState);
+}
+
+static void qws_publishMouseState(const QPoint &pos, int state, int wheel)
+{
+    qws_inputState.x = pos.x();
+    qws_inputState.y = pos.y();
+    qws_inputState.buttons = state & Qt::MouseButtonMask;
+    qws_inputState.modifiers = qws_keyModifiers;
+    qws_inputState.wheel = wheel;
+    qws_publishInputState();
+}
 
 
 /*!
@@ -2249,10 +2481,7 @@ void QWSServer::sendMouseEvent(const QPoint& pos, int state, int wheel)
 	tpos = pos;
     }
 
-    if (qt_last_x) {
-         *qt_last_x = tpos.x();
-         *qt_last_y = tpos.y();
-    }
+    qws_publishMouseState(tpos, state, wheel);
     QWSServer::mousePosition = tpos;
     qwsServerPrivate->mouseState = state;
 
@@ -2546,6 +2775,10 @@ void QWSServer::sendKeyEvent(int unicode, int keycode, Qt::KeyboardModifiers mod
                              bool isPress, bool autoRepeat)
 {
     qws_keyModifiers = modifiers;
+    if (qws_inputState.keyModifiers != int(modifiers)) {
+        qws_inputState.keyModifiers = modifiers;
+        qws_publishInputState();
+    }
 
     if (isPress) {
         if (keycode != Qt::Key_F34 && keycode != Qt::Key_F35)
@@ -3229,13 +3462,126 @@ void QWSServerPrivate::invokeRegisterChannel(QWSQCopRegisterChannelCommand *cmd,
   // QCopChannel will force us to emit the newChannel signal if this channel
   // didn't already exist.
   QCopChannel::registerChannel(cmd->channel, client);
+
+  QList<QWSClient*> &listeners = channels[cmd->channel];
+  if (!listeners.contains(client)) {
+      listeners.append(client);
+      updateQCopRoutes(cmd->channel);
+  }
 }
 
 void QWSServerPrivate::invokeQCopSend(QWSQCopSendCommand *cmd, QWSClient *client)
 {
+    // Asking for a direct route is between the client and us
+    if (cmd->channel == QLatin1String(QWS_QCOP_ROUTE_CHANNEL)) {
+        QDataStream stream(cmd->data);
+        QString channel;
+        stream >> channel;
+
+        QList<QWSClient*> &routed = qcopRoutes[channel];
+        if (!routed.contains(client))
+            routed.append(client);
+        sendQCopRoute(client, channel, true);
+        return;
+    }
+
+    if (cmd->channel == QLatin1String(QWS_INPUT_CHANNEL)) {
+#ifndef QT_NO_QWS_MULTIPROCESS
+        if (cmd->message == QLatin1String("setMotionEvents(bool)")) {
+            QDataStream stream(cmd->data);
+            bool enable;
+            stream >> enable;
+            client->d_func()->motionEvents = enable;
+        }
+#endif
+        return;
+    }
+
+    // A client's last QCopChannel object for a channel went away
+    if (cmd->channel.isEmpty() && cmd->message == QLatin1String("detach()")) {
+        QDataStream stream(cmd->data);
+        QString channel;
+        stream >> channel;
+
+        if (channels[channel].removeAll(client))
+            updateQCopRoutes(channel);
+    }
+
     QCopChannel::answer(client, cmd->channel, cmd->message, cmd->data);
 }
 
+/*!
+  \internal
+
+  Tells \a client where its messages on \a channel go: straight to the
+  listening clients, or through us as before if the server itself listens
+  or nobody does. A client only switches to direct sends on a \a reply,
+  which comes after all of its messages we handled so far; those went out
+  to the listeners already, and are flushed here so anything sent directly
+  can't overtake them.
+*/
+void QWSServerPrivate::sendQCopRoute(QWSClient *client, const QString &channel, bool reply)
+{
+    const QList<QWSClient*> listeners = channels.value(channel);
+    bool direct = !listeners.isEmpty();
+    QList<int> ids;
+
+    for (int i = 0; direct && i < listeners.size(); ++i) {
+        QWSClient *listener = listeners.at(i);
+        if (!listener->csocket) {
+            direct = false;
+            break;
+        }
+        listener->csocket->flush();
+        ids.append(listener->clientId());
+    }
+    if (!direct)
+        ids.clear();
+
+    QByteArray data;
+    QDataStream stream(&data, QIODevice::WriteOnly);
+    stream << channel << direct << ids;
+
+    sendQCopEvent(client, QLatin1String(QWS_QCOP_ROUTE_CHANNEL),
+                  reply ? QLatin1String("route(QString,bool,QList<int>)")
+                        : QLatin1String("update(QString,bool,QList<int>)"),
+                  data);
+}
+
+void QWSServerPrivate::updateQCopRoutes(const QString &channel)
+{
+    const QList<QWSClient*> routed = qcopRoutes.value(channel);
+    for (int i = 0; i < routed.size(); ++i)
+        sendQCopRoute(routed.at(i), channel, false);
+}
+
+void QWSServerPrivate::detachQCopRoutes(QWSClient *client)
+{
+    QStringList changed;
+
+    QMap<QString, QList<QWSClient*> >::iterator it = channels.begin();
+    while (it != channels.end()) {
+        if (it.value().removeAll(client))
+            changed.append(it.key());
+        if (it.value().isEmpty())
+            it = channels.erase(it);
+        else
+            ++it;
+    }
+
+    it = qcopRoutes.begin();
+    while (it != qcopRoutes.end()) {
+        it.value().removeAll(client);
+        if (it.value().isEmpty())
+            it = qcopRoutes.erase(it);
+        else
+            ++it;
+    }
+
+    for (int i = 0; i < changed.size(); ++i)
+        updateQCopRoutes(changed.at(i));
+}
+
 #endif
 
 #ifndef QT_NO_QWS_INPUTMETHODS
@@ -4884,10 +5230,7 @@ uint QWSInputMethod::inputResolutionShift() const
 */
 void QWSInputMethod::sendMouseEvent( const QPoint &pos, int state, int wheel )
 {
-        if (qt_last_x) {
-         *qt_last_x = pos.x();
-         *qt_last_y = pos.y();
-    }
+    qws_publishMouseState(pos, state, wheel);
     QWSServer::mousePosition = pos;
     qwsServerPrivate->mouseState = state;
     QWSServerPrivate::sendMouseEventUnfiltered(pos, state, wheel);
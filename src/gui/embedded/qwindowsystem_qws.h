@@ -475,10 +475,16 @@ public:
 
     int clientId() const { return cid; }
 
+    enum FlowControl { CoalesceMotion, DropMotion, SuspendUnresponsive };
+    void setFlowControl(FlowControl policy);
+    FlowControl flowControl() const;
+    bool isResponsive() const;
+
     QWSCursorMap cursors; // cursors defined by this client
 Q_SIGNALS:
     void connectionClosed();
     void readyRead();
+    void responsiveChanged(bool responsive);
 private Q_SLOTS:
     void closeHandler();
     void errorHandler();
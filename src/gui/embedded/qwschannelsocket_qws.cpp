@@ -41,6 +41,9 @@
 
 #include "qplatformdefs.h"
 #include "qwschannelsocket_qws.h"
+#include "qabstracteventdispatcher.h"
+#include <private/qcore_unix_p.h>
+#include <private/qeventdispatcher_unix_p.h>
 
 // Include the .c file for now.
 // TODO: Integrate NBB into Qt
@@ -58,7 +61,6 @@
 #include <sys/un.h>
 #include <assert.h>
 #include <stdlib.h>
-#include <dlfcn.h>
 
 #include <iostream>
 
@@ -96,44 +98,6 @@ QT_BEGIN_NAMESPACE
   HELPER FUNCTION/DATA FOR QWSChannelSocket
  *******************************************/
 
-// Dynamically load |sym| from |lib|
-static void *get_dl_symbol(const char *lib, const char *sym)
-{
-    assert(lib != 0 && sym != 0);
-
-    void *handle = dlopen(lib, RTLD_LAZY);
-    if (!handle) {
-        printf("%s\n", dlerror());
-        assert(false && "dlopen failed");
-    }
-
-    // Clear any existing error
-    dlerror();
-
-    void *lib_sym = dlsym(handle, sym);
-    char *error = dlerror();
-    if (error != NULL) {
-        printf("%s\n", error);
-        assert(false && "dlsym failed");
-    }
-
-    dlclose(handle);
-
-    return lib_sym;
-}
-
-static const char *lib = "/usr/local/Trolltech/QtEmbedded-4.7.0-generic/lib/libQtCore.so";
-static const char *sym = "_Z16signal_self_pipev";
-
-// Self-pipe trick
-// XXX: Have to dlopen()/dlsym() from QtCoreLib
-// We initialize these in QWS Server Socket since
-// we always create its instances first.
-typedef void (*self_pipe_func)(void);
-static self_pipe_func signal_self_pipe;
-static bool self_pipe_func_initialized = false;
-
-
 // Global socket mappings from slot ID to sockets and flags
 static meta_client_socket_t g_clientSocketMap[SERVICE_MAX_CHANNELS];
 static meta_server_socket_t g_serverSocketMap[SERVICE_MAX_CHANNELS];
@@ -143,6 +107,9 @@ static int socket_handle_events() {
         if(g_clientSocketMap[i].has_data == true) {
             client_handle_new_available_data(i);
         }
+        if(g_clientSocketMap[i].peer_gone == true) {
+            client_handle_disconnect(i);
+        }
         if(g_serverSocketMap[i].has_new_connection == true) {
             server_handle_new_connection(i);
         }
@@ -150,13 +117,132 @@ static int socket_handle_events() {
     return 0;
 }
 
-// Signal handler function
+// Self-pipe trick
+// NBB callbacks run in the signal handler, so they only flag the socket and
+// write to this pipe. The event dispatcher watches the read end as an
+// external event source and calls channel_pipe_ready() outside of the
+// signal context.
+#define READ_END 0
+#define WRITE_END 1
+static int channel_pipe[2] = { -1, -1 };
+
+// Set when the event dispatcher reads NBB's signals itself through
+// nbb_signal_fd(). Callbacks then run in the event loop and the pipe isn't
+// needed.
+static bool channel_signal_fd = false;
+
+static void signal_channel_pipe()
+{
+    char c = 1;
+    int ret;
+
+    // In case we get interrupted by a signal, we should restart this write()
+    // since we rely on it to emit Qt signals
+    do {
+        ret = ::write(channel_pipe[WRITE_END], &c, sizeof(char));
+    } while (ret < 0 && errno == EINTR);
+
+    // EAGAIN means the pipe is full of wakeups already, which is just as good
+    if (ret < 0 && errno != EAGAIN) {
+        perror("write");
+        printf("***signal_channel_pipe: Can't self-pipe...\n");
+        assert(false);
+    }
+}
+
+static void channel_pipe_ready(int fd, void *)
+{
+    char tmp[16];
+    int ret;
+
+    // Keep reading until we consume all the bytes, OR
+    // restart when we are interrupted by a signal.
+    do {
+        ret = ::read(fd, tmp, sizeof(tmp));
+    } while ((ret > 0) || (ret < 0 && errno == EINTR));
+
+    socket_handle_events();
+}
+
+static void channel_signals_ready(int, void *)
+{
+    // Reads every signalled channel, flagging sockets like the handler does
+    nbb_dispatch_signals();
+    socket_handle_events();
+}
+
+// Batched writes whose deadline passed, see QChannelSocket::setBatching()
+static void batch_timer_ready(int, void *)
+{
+    nbb_flush_expired();
+}
+
+// A peer died. Reaping its channel runs the disconnect callbacks right here.
+static void peer_fd_ready(int, void *)
+{
+    nbb_reap_dead_peers();
+    socket_handle_events();
+}
+
+// Set once the event dispatcher watches NBB's wakeups
+static bool channel_sources_registered = false;
+
+// Hand NBB's wakeups to the current thread's event dispatcher: the signals
+// themselves through a signalfd where we can, or else the self-pipe the
+// signal handler writes to. Also the doorbell batching timer and the fd
+// that tells us a peer died.
+// Every channel socket, client or server, calls this when it's created. A
+// socket created before the application's event dispatcher only gets the
+// pipe, so wakeups pile up there until a later one can register it.
+static void init_channel_pipe()
+{
+    if (channel_sources_registered)
+        return;
+
+    QEventDispatcherUNIX *dispatcher =
+        qobject_cast<QEventDispatcherUNIX *>(QAbstractEventDispatcher::instance());
+
+    // Wakeups may already be waiting in the pipe, so stay with it then
+    if (dispatcher && channel_pipe[READ_END] < 0) {
+        int fd = nbb_signal_fd();
+        if (fd >= 0 && dispatcher->registerExternalEventSource(fd, channel_signals_ready, 0) >= 0)
+            channel_signal_fd = true;
+        else if (fd >= 0)
+            nbb_close_signal_fd();
+    }
+
+    if (!channel_signal_fd) {
+        // Non-blocking, so the signal handler never blocks on a full pipe
+        if (channel_pipe[READ_END] < 0 && qt_safe_pipe(channel_pipe, O_NONBLOCK) == -1)
+            qFatal("QWSChannelSocket: Can't create the NBB self-pipe: %s",
+                   qPrintable(qt_error_string(errno)));
+
+        if (!dispatcher)
+            return;
+        if (dispatcher->registerExternalEventSource(channel_pipe[READ_END], channel_pipe_ready, 0) < 0) {
+            qWarning("QWSChannelSocket: The event dispatcher can't watch NBB channels");
+            return;
+        }
+    }
+    channel_sources_registered = true;
+
+    // Without it, batched writes still go out on the next write or flush()
+    int timer = nbb_batch_timer_fd();
+    if (timer < 0 || dispatcher->registerExternalEventSource(timer, batch_timer_ready, 0) < 0)
+        qWarning("QWSChannelSocket: Batched writes will only go out on flush");
+
+    int peers = nbb_peer_fd();
+    if (peers < 0 || dispatcher->registerExternalEventSource(peers, peer_fd_ready, 0) < 0)
+        qWarning("QWSChannelSocket: Dead peers won't be noticed");
+}
+
+// NBB callback, from the signal handler or nbb_dispatch_signals()
 static void client_on_new_available_data(int slot_id) {
     g_clientSocketMap[slot_id].has_data = true;
 
-    // Trigger self-pipe in event dispatcher (QtCorelib)
-    assert(signal_self_pipe != 0);
-    (signal_self_pipe)();
+    // Wake up the event dispatcher, unless we're already in it
+    if (!channel_signal_fd)
+        signal_channel_pipe();
 }
 
 // Called in the event loop to clear out new data
@@ -164,10 +250,29 @@ void client_handle_new_available_data(int slot_id)
 {
     QWSChannelSocket *socket = g_clientSocketMap[slot_id].csocket;
     g_clientSocketMap[slot_id].has_data = false;
-    assert(socket != 0);
+    // Leftovers of a dead client, read before the next one announced itself
+    if (socket == 0)
+        return;
     socket->emitReadyRead();
 }
 
+// NBB callback, from nbb_reap_dead_peers() in the event loop
+static void client_on_disconnect(int slot_id) {
+    g_clientSocketMap[slot_id].peer_gone = true;
+}
+
+// Called in the event loop once the peer's channel was reaped. The slot
+// may go to another client now, so it no longer maps to this socket.
+void client_handle_disconnect(int slot_id)
+{
+    QWSChannelSocket *socket = g_clientSocketMap[slot_id].csocket;
+    g_clientSocketMap[slot_id].csocket = 0;
+    g_clientSocketMap[slot_id].has_data = false;
+    g_clientSocketMap[slot_id].peer_gone = false;
+    if (socket != 0)
+        socket->emitDisconnected();
+}
+
 /***********************************************************************
  *
  * QWSChannelSocket
@@ -180,18 +285,17 @@ QWSChannelSocket::QWSChannelSocket(QObject *parent)
 //    QObject::connect( this, SIGNAL(stateChanged(SocketState)),
 //            this, SLOT(forwardStateChange(SocketState)));
 
-    // Dynamically load function from QtCoreLib (event dispatcher)
-    if (!self_pipe_func_initialized) {
-        signal_self_pipe = (self_pipe_func) get_dl_symbol(lib, sym);
-        assert(signal_self_pipe != 0);
-        self_pipe_func_initialized = true;
-    }
-
-    nbb_set_handle_events(socket_handle_events);
+    init_channel_pipe();
 }
 
 QWSChannelSocket::~QWSChannelSocket()
 {
+    int slot = socketDescriptor();
+    if (slot >= 0 && g_clientSocketMap[slot].csocket == this) {
+        g_clientSocketMap[slot].csocket = 0;
+        g_clientSocketMap[slot].has_data = false;
+        g_clientSocketMap[slot].peer_gone = false;
+    }
 }
 
 // Not implemented
@@ -233,14 +337,15 @@ bool QWSChannelSocket::connectToLocalFile(const QString &file)
 
     // Register for new incoming data event from nbb
     nbb_set_cb_new_data(client_name, client_on_new_available_data);
+    nbb_set_cb_disconnect(client_name, client_on_disconnect);
 
     return true;
 }
 
-// Do nothing in our channels implementation
+// Wakes the peer for batched writes, see QChannelSocket::setBatching()
 bool QWSChannelSocket::flush()
 {
-    return true;
+    return QChannelSocket::flush();
 }
 
 // Override QChannelSocket
@@ -262,13 +367,15 @@ bool QWSChannelSocket::setSocketDescriptor(int socketDescriptor, QAbstractSocket
     meta_client_socket_t s;
     s.csocket = this;
     s.has_data = false;
+    s.peer_gone = false;
     g_clientSocketMap[socketDescriptor] = s;
 
     // (Possible change ownership from service to this client socket)
     nbb_set_owner(socketDescriptor, socketName);
 
-    // Register for new incoming data from nbb
+    // Register for new incoming data from nbb, and for the peer dying
     nbb_set_cb_new_data(socketName, client_on_new_available_data);
+    nbb_set_cb_disconnect(socketName, client_on_disconnect);
 
     return true;
 }
@@ -292,9 +399,9 @@ static void server_on_new_connection(int slot_id, void *arg) {
                 reinterpret_cast<QWSChannelServerSocket*>(arg);
     g_serverSocketMap[slot_id].has_new_connection = true;
 
-    // Trigger self-pipe in event dispatcher (QtCorelib)
-    assert(signal_self_pipe != 0);
-    (signal_self_pipe)();
+    // Wake up the event dispatcher, unless we're already in it
+    if (!channel_signal_fd)
+        signal_channel_pipe();
 }
 
 void server_handle_new_connection(int slot_id)
@@ -314,33 +421,44 @@ QWSChannelServerSocket::QWSChannelServerSocket(const QString& file, QObject *par
     : QObject(parent)
 #endif
 {
-    init(file);
+    // TODO this is a hardcoded 5 constant. If we need more clients per
+    // server, increase this number
+    init(file, 5);
+}
+
+/*!
+  Listens as the NBB service \a file for up to \a maxConnections peers at
+  a time. Unlike the constructor above, failing to register the service
+  isn't fatal; check isListening().
+  */
+QWSChannelServerSocket::QWSChannelServerSocket(const QString& file, int maxConnections, QObject *parent)
+
+#ifndef QT_NO_SXE
+    : QUnixSocketServer(parent)
+#else
+    : QObject(parent)
+#endif
+{
+    init(file, maxConnections);
 }
 
-void QWSChannelServerSocket::init(const QString &file)
+void QWSChannelServerSocket::init(const QString &file, int maxConnections)
 {
     // Use the file as the service name
-    char *service_name = file.toAscii().data();
-
-    // TODO this is a hardcoded 5 constant. If we need more clients per
-    // server, increase this number
-    if (::nbb_init_service(5, service_name)) {
-        cout << "QWSChannelServerSocket::init(): Failed to init service!"
-             << endl;
-        exit(-1);
+    QByteArray name = file.toAscii();
+    const char *service_name = name.constData();
+
+    listening = (::nbb_init_service(maxConnections, service_name) == 0);
+    if (!listening) {
+        cout << "QWSChannelServerSocket::init(): Failed to init service "
+             << service_name << "!" << endl;
+        return;
     }
 
     ::nbb_set_cb_new_connection(service_name, server_on_new_connection, this);
     //::nbb_set_cb_new_data(service_name, server_on_new_data);
 
-    // Dynamically load function from QtCoreLib (event dispatcher)
-    if (!self_pipe_func_initialized) {
-        signal_self_pipe = (self_pipe_func) get_dl_symbol(lib, sym);
-        assert(signal_self_pipe != 0);
-        self_pipe_func_initialized = true;
-    }
-
-    nbb_set_handle_events(socket_handle_events);
+    init_channel_pipe();
 
     cout << "QWSChannelServerSocket::init(): Successfully init-ed "
          << service_name << endl;
@@ -350,6 +468,11 @@ QWSChannelServerSocket::~QWSChannelServerSocket()
 {
 }
 
+bool QWSChannelServerSocket::isListening() const
+{
+    return listening;
+}
+
 
 // In our channels, socket descriptor is equivalent to slot ID
 void QWSChannelServerSocket::incomingConnection(int socketDescriptor)
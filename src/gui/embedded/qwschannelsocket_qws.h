@@ -77,6 +77,7 @@ class QWSChannelServerSocket;
 typedef struct meta_client_socket {
     QWSChannelSocket* csocket;
     bool has_data;
+    bool peer_gone;
 } meta_client_socket_t;
 
 typedef struct meta_server_socket {
@@ -91,6 +92,7 @@ extern meta_server_socket_t g_serverSocketMap[SERVICE_MAX_CHANNELS];
 */
 
 void client_handle_new_available_data(int slot_id);
+void client_handle_disconnect(int slot_id);
 void server_handle_new_connection(int slot_id);
 
 
@@ -138,7 +140,6 @@ public:
     QString errorString();
 Q_SIGNALS:
     void connected();
-    void disconnected();
     void error(QAbstractSocket::SocketError);
 private Q_SLOTS:
     void forwardStateChange(SocketState);
@@ -155,8 +156,11 @@ class QWSChannelServerSocket : public QObject
 public:
     QWSChannelServerSocket(QObject *parent=0);
     QWSChannelServerSocket(const QString& file, QObject *parent=0);
+    QWSChannelServerSocket(const QString& file, int maxConnections, QObject *parent=0);
     ~QWSChannelServerSocket();
 
+    bool isListening() const;
+
 //#ifndef QT_NO_SXE
     QWSChannelSocket *nextPendingConnection();
     void incomingConnection(int socketDescriptor);
@@ -170,7 +174,8 @@ private:
 private:
     Q_DISABLE_COPY(QWSChannelServerSocket)
 
-    void init(const QString &file);
+    void init(const QString &file, int maxConnections);
+    bool listening;
 };
 
 QT_END_NAMESPACE
@@ -72,6 +72,20 @@ public:
 
 };
 
+class QWSInputState
+{
+
+public:
+
+    int x, y;           // Pointer position, in screen coordinates
+    int buttons;        // Qt::MouseButtons held down
+    int modifiers;      // Qt::KeyboardModifiers sent with the last mouse event
+    int wheel;          // Delta of the last mouse event, 0 unless it was a wheel event
+    int keyModifiers;   // Qt::KeyboardModifiers as of the last key event
+    int time;           // Server time of the last change, as in QWSMouseEvent
+
+};
+
 #define QT_QWS_PROPERTY_CONVERTSELECTION 999
 #define QT_QWS_PROPERTY_WINDOWNAME 998
 #define QT_QWS_PROPERTY_MARKEDTEXT 997
@@ -137,6 +151,7 @@ public:
     void registerChannel(const QString &channel);
     void sendMessage(const QString &channel, const QString &msg,
                        const QByteArray &data);
+    void setMotionEventsEnabled(bool enable);
     void flushCommands();
 #ifndef QT_NO_QWS_INPUTMETHODS
     void sendIMUpdate(int type, int winId, int widgetid);
@@ -158,6 +173,7 @@ public:
 
     static void setTransformation(int transformation, int screenNo = -1);
     static void setRawMouseEventFilter(void (*filter)(QWSMouseEvent *));
+    static bool inputState(QWSInputState *state);
 
 private:
     friend int qt_fork_qapplication();
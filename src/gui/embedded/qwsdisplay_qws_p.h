@@ -60,9 +60,47 @@
 #include "qwscommand_qws_p.h"
 #include "qwslock_p.h"
 #include "qwschannelsocket_qws.h"
+#include <QtCore/qhash.h>
 
 QT_BEGIN_NAMESPACE
 
+// The server's view of the pointer and keyboard, at the end of sharedRam.
+// Only the server writes it, and seq is odd while it does: a reader that
+// sees the same even seq before and after copying the state got a
+// consistent copy.
+struct QWSInputStateBlock
+{
+    volatile uint seq;
+    QWSInputState state;
+
+    void write(const QWSInputState &s)
+    {
+        seq = seq + 1;
+        __sync_synchronize();
+        state = s;
+        __sync_synchronize();
+        seq = seq + 1;
+    }
+
+    // Gives up if the server keeps changing it, or died halfway through
+    bool read(QWSInputState *s) const
+    {
+        for (int tries = 0; tries < 1000; ++tries) {
+            const uint before = seq;
+            if (before & 1)
+                continue;
+            __sync_synchronize();
+            *s = state;
+            __sync_synchronize();
+            if (seq == before)
+                return true;
+        }
+        return false;
+    }
+};
+
+extern QWSInputStateBlock *qt_input_state;
+
 class QWSDisplay::Data
 {
 public:
@@ -88,6 +126,11 @@ public:
     void waitForCreation();
 #ifndef QT_NO_COP
     void waitForQCopResponse();
+#ifndef QT_NO_QWS_MULTIPROCESS
+    void startQCopService();
+    bool sendQCopDirect(const QString &channel, const QString &msg, const QByteArray &data);
+    void requestQCopRoute(const QString &channel);
+#endif
 #endif
     void init();
     void reinit( const QString& newAppName );
@@ -145,6 +188,26 @@ private:
     int region_offset_window;
 #ifndef QT_NO_COP
     QWSQCopMessageEvent *qcop_response;
+#ifndef QT_NO_QWS_MULTIPROCESS
+    // Direct QCop channels, see QWS_QCOP_ROUTE_CHANNEL. Messages on a
+    // channel go through the server until it answers our request for a
+    // route, and again whenever it says the channel can't be direct.
+    struct QCopRoute {
+        QCopRoute() : direct(false) {}
+        bool direct;
+        QList<int> clients;
+    };
+    QHash<QString, QCopRoute> qcopRoutes;             // Requested so far
+    QHash<int, QWSChannelSocket*> qcopPeers;          // Sending, by client id
+    QList<QWSChannelSocket*> qcopSenders;             // Receiving
+    QWSChannelServerSocket *qcopService;
+    bool qcopServiceStarted;
+
+    void sendQCopRouteRequest(const QString &channel);
+    void updateQCopRoute(const QWSQCopMessageEvent *e);
+    QWSChannelSocket *qcopPeer(int clientId);
+    void readQCopDirect();
+#endif
 #endif
     QWSEvent* current_event;
     QList<int> unused_identifiers;
@@ -156,6 +156,18 @@ QWidget *qt_pressGrab = 0;
 QWidget *qt_mouseGrb = 0;
 int *qt_last_x = 0;
 int *qt_last_y = 0;
+QWSInputStateBlock *qt_input_state = 0;
+
+// Carve the input state block off the end of sharedRam; the server and
+// every client take it from the same place. qt_last_x and qt_last_y are
+// its position.
+static void qt_attach_input_state(uchar *sharedRam, int &sharedRamSize)
+{
+    sharedRamSize -= sizeof(QWSInputStateBlock);
+    qt_input_state = reinterpret_cast<QWSInputStateBlock *>(sharedRam + sharedRamSize);
+    qt_last_x = &qt_input_state->state.x;
+    qt_last_y = &qt_input_state->state.y;
+}
 
 static int mouse_x_root = -1;
 static int mouse_y_root = -1;
@@ -520,6 +532,10 @@ QWSDisplay::Data::Data(QObject* parent, bool singleProcess)
                          qApp, SLOT(quit()));
     }
     clientLock = 0;
+#ifndef QT_NO_COP
+    qcopService = 0;
+    qcopServiceStarted = false;
+#endif
 #endif
     init();
 }
@@ -550,6 +566,11 @@ QWSDisplay::Data::~Data()
     qDeleteAll(queue);
 #ifndef QT_NO_COP
     delete qcop_response;
+#ifndef QT_NO_QWS_MULTIPROCESS
+    qDeleteAll(qcopPeers);
+    qDeleteAll(qcopSenders);
+    delete qcopService;
+#endif
 #endif
 }
 
@@ -723,6 +744,9 @@ void QWSDisplay::Data::reinit( const QString& newAppName )
 #ifndef QT_NO_COP
     delete qcop_response;
     qcop_response = 0;
+    // Routes go by client id, and we're getting a new one. Our QCop service
+    // keeps the old one's name, so messages to us go through the server.
+    qcopRoutes.clear();
 #endif
     delete current_event;
     current_event = 0;
@@ -795,10 +819,7 @@ void QWSDisplay::Data::reinit( const QString& newAppName )
     // resizing since we have the MWR before windows are displayed.
     waitForCreation();
 
-    sharedRamSize -= sizeof(int);
-    qt_last_x = reinterpret_cast<int *>(sharedRam + sharedRamSize);
-    sharedRamSize -= sizeof(int);
-    qt_last_y = reinterpret_cast<int *>(sharedRam + sharedRamSize);
+    qt_attach_input_state(sharedRam, sharedRamSize);
 
 #ifndef QT_NO_COP
     QCopChannel::reregisterAll();
@@ -929,10 +950,7 @@ void QWSDisplay::Data::init()
             qFatal("Unable to initialize screen driver!");
     }
 
-    sharedRamSize -= sizeof(int);
-    qt_last_x = reinterpret_cast<int *>(sharedRam + sharedRamSize);
-    sharedRamSize -= sizeof(int);
-    qt_last_y = reinterpret_cast<int *>(sharedRam + sharedRamSize);
+    qt_attach_input_state(sharedRam, sharedRamSize);
 
     /* Initialise framebuffer memory manager */
     /* Add 4k for luck and to avoid clobbering hardware cursor */
@@ -1106,6 +1124,12 @@ void QWSDisplay::Data::fillQueue()
 #ifndef QT_NO_COP
         } else if (e->type == QWSEvent::QCopMessage) {
             QWSQCopMessageEvent *pe = static_cast<QWSQCopMessageEvent*>(e);
+#ifndef QT_NO_QWS_MULTIPROCESS
+            if (pe->channel == QWS_QCOP_ROUTE_CHANNEL) {
+                updateQCopRoute(pe);
+                delete e;
+            } else
+#endif
             if (pe->simpleData.is_response) {
                 qcop_response = pe;
             } else {
@@ -1122,6 +1146,11 @@ void QWSDisplay::Data::fillQueue()
 #endif
         e = readMore();
     }
+
+#if !defined(QT_NO_COP) && !defined(QT_NO_QWS_MULTIPROCESS)
+    if (csocket)
+        readQCopDirect();
+#endif
 }
 
 #ifndef QT_NO_QWS_MULTIPROCESS
@@ -1787,6 +1816,10 @@ void QWSDisplay::playSoundFile(const QString& f)
 #ifndef QT_NO_COP
 void QWSDisplay::registerChannel(const QString& channel)
 {
+#ifndef QT_NO_QWS_MULTIPROCESS
+    // Up before the server can route anybody to us
+    qt_fbdpy->d->startQCopService();
+#endif
     QWSQCopRegisterChannelCommand reg;
     reg.setChannel(channel);
     qt_fbdpy->d->sendCommand(reg);
@@ -1795,11 +1828,231 @@ void QWSDisplay::registerChannel(const QString& channel)
 void QWSDisplay::sendMessage(const QString &channel, const QString &msg,
                    const QByteArray &data)
 {
+#ifndef QT_NO_QWS_MULTIPROCESS
+    if (qt_fbdpy->d->sendQCopDirect(channel, msg, data))
+        return;
+#endif
     QWSQCopSendCommand com;
     com.setMessage(channel, msg, data);
     qt_fbdpy->d->sendCommand(com);
+#ifndef QT_NO_QWS_MULTIPROCESS
+    // Asked after the message, so the server has passed it on by the time
+    // it answers
+    qt_fbdpy->d->requestQCopRoute(channel);
+#endif
+}
+
+/*!
+  \internal
+
+  Stops or resumes mouse events that only move the pointer. Button,
+  modifier and wheel changes still arrive either way; a client that
+  turns motion off can poll inputState() for the position instead.
+*/
+void QWSDisplay::setMotionEventsEnabled(bool enable)
+{
+    QByteArray data;
+    QDataStream stream(&data, QIODevice::WriteOnly);
+    stream << enable;
+
+    QWSQCopSendCommand com;
+    com.setMessage(QLatin1String(QWS_INPUT_CHANNEL),
+                   QLatin1String("setMotionEvents(bool)"), data);
+    qt_fbdpy->d->sendCommand(com);
+}
+
+#ifndef QT_NO_QWS_MULTIPROCESS
+// Senders connected to our QCop service at a time. Each takes an NBB slot
+// in both processes; senders beyond that go through the server.
+#define QWS_QCOP_DIRECT_PEERS 4
+
+static QString qws_qcopServiceName(int clientId)
+{
+    return QString::fromLatin1("QCop-%1-%2").arg(qws_display_id).arg(clientId);
+}
+
+void QWSDisplay::Data::startQCopService()
+{
+    if (!csocket || qcopServiceStarted)
+        return;
+    qcopServiceStarted = true;
+
+    qcopService = new QWSChannelServerSocket(qws_qcopServiceName(qws_client_id),
+                                             QWS_QCOP_DIRECT_PEERS);
+    if (!qcopService->isListening()) {
+        qWarning("QWSDisplay: QCop messages to this client will go through the server");
+        delete qcopService;
+        qcopService = 0;
+    }
+}
+
+bool QWSDisplay::Data::sendQCopDirect(const QString &channel, const QString &msg,
+                                      const QByteArray &data)
+{
+    QHash<QString, QCopRoute>::iterator route = qcopRoutes.find(channel);
+    if (!csocket || route == qcopRoutes.end() || !route->direct)
+        return false;
+
+    // Either every listener gets it directly or none does
+    QList<QWSChannelSocket*> peers;
+    bool self = false;
+    for (int i = 0; i < route->clients.size(); ++i) {
+        int id = route->clients.at(i);
+        if (id == qws_client_id) {
+            self = true;
+            continue;
+        }
+        QWSChannelSocket *peer = qcopPeer(id);
+        if (!peer) {
+            route->direct = false;
+            return false;
+        }
+        peers.append(peer);
+    }
+
+    // The server's wire format, so listeners read it the same way
+    QByteArray ch = channel.toLatin1();
+    QByteArray message = msg.toLatin1();
+    QByteArray raw = ch + message + data;
+    QWSQCopMessageEvent event;
+    event.simpleData.is_response = false;
+    event.simpleData.lchannel = ch.size();
+    event.simpleData.lmessage = message.size();
+    event.simpleData.ldata = data.size();
+    event.setData(raw.constData(), raw.size());
+
+    // One NBB message per event, see readQCopDirect()
+    QByteArray bytes;
+    QBuffer buffer(&bytes);
+    buffer.open(QIODevice::WriteOnly);
+    event.write(&buffer);
+    for (int i = 0; i < peers.size(); ++i) {
+        if (peers.at(i)->writeToLane(bytes.constData(), bytes.size(),
+                                     QChannelSocket::NormalLane) >= 0)
+            continue;
+
+        // Peers are elastic, so this one went away or can't spill. The
+        // server can still deliver it if nobody has it yet; past that it
+        // would reach the others twice. Either way later messages on this
+        // channel go through the server.
+        route->direct = false;
+        if (i == 0)
+            return false;
+        qWarning("QWSDisplay: Lost a QCop message on %s to a listener: %s",
+                 ch.constData(), qPrintable(peers.at(i)->errorString()));
+    }
+
+    if (self) {
+        QWSEvent *copy = QWSEvent::factory(event.type);
+        copy->copyFrom(&event);
+        queue.append(copy);
+    }
+    return true;
+}
+
+void QWSDisplay::Data::requestQCopRoute(const QString &channel)
+{
+    // The empty channel carries requests for the server itself
+    if (!csocket || channel.isEmpty() || qcopRoutes.contains(channel)
+        || channel == QLatin1String(QWS_QCOP_ROUTE_CHANNEL))
+        return;
+
+    qcopRoutes.insert(channel, QCopRoute());
+    sendQCopRouteRequest(channel);
+}
+
+void QWSDisplay::Data::sendQCopRouteRequest(const QString &channel)
+{
+    QByteArray data;
+    QDataStream stream(&data, QIODevice::WriteOnly);
+    stream << channel;
+
+    QWSQCopSendCommand com;
+    com.setMessage(QLatin1String(QWS_QCOP_ROUTE_CHANNEL), QLatin1String("route(QString)"), data);
+    sendCommand(com);
+}
+
+void QWSDisplay::Data::updateQCopRoute(const QWSQCopMessageEvent *e)
+{
+    QDataStream stream(e->data);
+    QString channel;
+    bool direct;
+    QList<int> clients;
+    stream >> channel >> direct >> clients;
+
+    QCopRoute &route = qcopRoutes[channel];
+
+    // Only a reply is known to come after everything we sent through the
+    // server so far; going direct on an update could overtake some of it.
+    if (direct && !route.direct && !e->message.startsWith("route(")) {
+        sendQCopRouteRequest(channel);
+        return;
+    }
+
+    route.direct = direct;
+    route.clients = clients;
+}
+
+QWSChannelSocket *QWSDisplay::Data::qcopPeer(int clientId)
+{
+    QWSChannelSocket *peer = qcopPeers.value(clientId);
+
+    // Reaped since, the server drops it from the route too
+    if (peer && peer->state() != QAbstractSocket::ConnectedState) {
+        qcopPeers.remove(clientId);
+        delete peer;
+        peer = 0;
+    }
+
+    if (!peer) {
+        peer = new QWSChannelSocket();
+        if (!peer->connectToLocalFile(qws_qcopServiceName(clientId))) {
+            delete peer;
+            return 0;
+        }
+        // A busy listener falls behind rather than losing messages
+        peer->setElastic(true);
+        qcopPeers.insert(clientId, peer);
+    }
+    return peer;
 }
 
+// Called by fillQueue() after it read the server's events. Whatever the
+// server delivered before a sender went direct is queued ahead of what the
+// sender wrote to us since.
+void QWSDisplay::Data::readQCopDirect()
+{
+    if (qcopService) {
+        while (QWSChannelSocket *sender = qcopService->nextPendingConnection())
+            qcopSenders.append(sender);
+    }
+
+    int i = 0;
+    while (i < qcopSenders.size()) {
+        QWSChannelSocket *sender = qcopSenders.at(i);
+
+        // Each event is one NBB message, so it's whole once any of it is here
+        while (sender->bytesAvailable() > 0) {
+            int type = qws_read_uint(sender);
+            if (type != QWSEvent::QCopMessage) {
+                qWarning("QWSDisplay: Unexpected event %d on a QCop channel", type);
+                break;
+            }
+            QWSEvent *e = QWSEvent::factory(type);
+            e->read(sender);
+            queue.append(e);
+        }
+
+        if (sender->state() != QAbstractSocket::ConnectedState) {
+            qcopSenders.removeAt(i);
+            delete sender;
+        } else {
+            ++i;
+        }
+    }
+}
+#endif // QT_NO_QWS_MULTIPROCESS
+
 void QWSDisplay::flushCommands()
 {
     qt_fbdpy->d->flushCommands();
@@ -1919,6 +2172,23 @@ void QWSDisplay::setRawMouseEventFilter(void (*filter)(QWSMouseEvent *))
         qt_fbdpy->d->setMouseFilter(filter);
 }
 
+/*!
+  \internal
+
+  Copies the pointer and keyboard state as the server last saw it into
+  \a state, straight out of shared memory. Returns false if there is no
+  display yet, or if the server kept changing the state while it was
+  being read.
+
+  \sa setMotionEventsEnabled()
+*/
+bool QWSDisplay::inputState(QWSInputState *state)
+{
+    if (!qt_input_state)
+        return false;
+    return qt_input_state->read(state);
+}
+
 /*!
   \relates QScreen
 